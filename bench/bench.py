@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+"""
+Offline end-to-end benchmark for twitter_fdw.
+
+Creates a throwaway cluster with twitter_fdw preloaded, points the
+twitter_service server at a local replay server (replay_server.py) and
+runs each pgbench script in workloads/ against it.  For every workload
+it reports transactions and tweets per second, transaction latency
+percentiles, and the peak resident set size of the benchmark backends.
+
+twitter_fdw must be installed (make install) into the PostgreSQL
+found through pg_config.  Requires pgbench 9.6 or later.
+"""
+
+import argparse
+import glob
+import json
+import os
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+WORKLOADS = ("single_page", "paginated", "fan_out", "join", "lookup")
+
+
+def run(cmd, **kwargs):
+    return subprocess.run(cmd, check=True, universal_newlines=True,
+                          stdout=subprocess.PIPE, **kwargs).stdout
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+class Cluster:
+    """A temporary PostgreSQL cluster reachable through a private socket."""
+
+    def __init__(self, bindir, workdir, clients):
+        self.bindir = bindir
+        self.datadir = os.path.join(workdir, "data")
+        self.sockdir = workdir
+        self.port = free_port()
+        self.clients = clients
+
+    def bin(self, name):
+        return os.path.join(self.bindir, name)
+
+    def start(self):
+        run([self.bin("initdb"), "-D", self.datadir, "-A", "trust",
+             "-U", "postgres"], stderr=subprocess.STDOUT)
+        with open(os.path.join(self.datadir, "postgresql.conf"), "a") as f:
+            f.write("port = %d\n" % self.port)
+            f.write("listen_addresses = ''\n")
+            f.write("unix_socket_directories = '%s'\n" % self.sockdir)
+            f.write("max_connections = %d\n" % (self.clients + 10))
+            f.write("shared_preload_libraries = 'twitter_fdw'\n")
+        run([self.bin("pg_ctl"), "-D", self.datadir, "-w", "-l",
+             os.path.join(self.datadir, "server.log"), "start"])
+
+    def stop(self):
+        subprocess.call([self.bin("pg_ctl"), "-D", self.datadir, "-w",
+                         "-m", "fast", "stop"], stdout=subprocess.DEVNULL)
+
+    def conninfo(self):
+        return ["-h", self.sockdir, "-p", str(self.port), "-U", "postgres"]
+
+    def psql(self, sql=None, args=()):
+        cmd = [self.bin("psql"), "-X", "-q", "-A", "-t",
+               "-v", "ON_ERROR_STOP=1"] + self.conninfo() + list(args)
+        if sql is not None:
+            cmd += ["-c", sql]
+        return run(cmd, stderr=subprocess.STDOUT).strip()
+
+
+class RssSampler(threading.Thread):
+    """Track the peak RSS of the pgbench backends while a workload runs."""
+
+    def __init__(self, cluster, interval=0.5):
+        threading.Thread.__init__(self, daemon=True)
+        self.cluster = cluster
+        self.interval = interval
+        self.peak = {}
+        self.done = threading.Event()
+
+    def run(self):
+        while not self.done.wait(self.interval):
+            try:
+                pids = self.cluster.psql(
+                    "SELECT pid FROM pg_stat_activity "
+                    "WHERE application_name = 'pgbench'").split()
+            except subprocess.CalledProcessError:
+                continue
+            for pid in pids:
+                try:
+                    with open("/proc/%s/status" % pid) as f:
+                        for line in f:
+                            if line.startswith("VmRSS:"):
+                                kb = int(line.split()[1])
+                                self.peak[pid] = max(self.peak.get(pid, 0), kb)
+                except (IOError, ValueError):
+                    pass
+
+    def stop(self):
+        self.done.set()
+        self.join()
+        return max(self.peak.values()) / 1024.0 if self.peak else None
+
+
+def percentile(values, fraction):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[min(int(fraction * len(values)), len(values) - 1)]
+
+
+def run_workload(cluster, name, args, workdir):
+    script = os.path.join(HERE, "workloads", name + ".sql")
+    logdir = os.path.join(workdir, name)
+    os.mkdir(logdir)
+
+    cluster.psql("SELECT twitter_fdw_stats_reset()")
+    sampler = RssSampler(cluster)
+    sampler.start()
+    out = run([cluster.bin("pgbench"), "-n", "-f", script,
+               "-c", str(args.clients), "-j", str(args.jobs),
+               "-T", str(args.duration), "-l"] + cluster.conninfo(),
+              cwd=logdir, stderr=subprocess.STDOUT)
+    rss = sampler.stop()
+
+    tps = float(re.search(r"tps = ([0-9.]+)", out).group(1))
+
+    # per-transaction log lines: client_id transaction_no time ...
+    latencies = []
+    for log in glob.glob(os.path.join(logdir, "pgbench_log.*")):
+        with open(log) as f:
+            latencies += [int(line.split()[2]) / 1000.0 for line in f]
+
+    rows, requests, failures = (int(x or 0) for x in cluster.psql(
+        "SELECT sum(rows), sum(requests), sum(failures) "
+        "FROM pg_stat_twitter_fdw").split("|"))
+
+    return {
+        "workload": name,
+        "tps": tps,
+        "rows_per_sec": rows / float(args.duration),
+        "requests": requests,
+        "failures": failures,
+        "p50_ms": percentile(latencies, 0.50),
+        "p95_ms": percentile(latencies, 0.95),
+        "p99_ms": percentile(latencies, 0.99),
+        "peak_rss_mb": rss,
+    }
+
+
+def report(results):
+    def fmt(value, spec):
+        return "-" if value is None else format(value, spec)
+
+    print("%-12s %9s %11s %9s %9s %9s %9s %8s" %
+          ("workload", "tps", "rows/s", "p50 ms", "p95 ms", "p99 ms",
+           "RSS MB", "failed"))
+    for r in results:
+        print("%-12s %9s %11s %9s %9s %9s %9s %8d" %
+              (r["workload"], fmt(r["tps"], ".1f"),
+               fmt(r["rows_per_sec"], ".0f"), fmt(r["p50_ms"], ".2f"),
+               fmt(r["p95_ms"], ".2f"), fmt(r["p99_ms"], ".2f"),
+               fmt(r["peak_rss_mb"], ".1f"), r["failures"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--pg-config", default="pg_config")
+    parser.add_argument("--clients", type=int, default=4)
+    parser.add_argument("--jobs", type=int, default=2)
+    parser.add_argument("--duration", type=int, default=30,
+                        help="seconds per workload")
+    parser.add_argument("--delay-ms", type=float, default=0,
+                        help="simulated API latency of the replay server")
+    parser.add_argument("--workloads", default=",".join(WORKLOADS),
+                        help="comma separated subset of: %s"
+                        % ", ".join(WORKLOADS))
+    parser.add_argument("--json", action="store_true",
+                        help="print results as JSON")
+    parser.add_argument("--keep", action="store_true",
+                        help="keep the cluster and logs for inspection")
+    args = parser.parse_args()
+
+    workloads = args.workloads.split(",")
+    for name in workloads:
+        if name not in WORKLOADS:
+            parser.error("unknown workload \"%s\"" % name)
+
+    bindir = run([args.pg_config, "--bindir"]).strip()
+    workdir = tempfile.mkdtemp(prefix="twitter_fdw_bench.")
+    cluster = Cluster(bindir, workdir, args.clients)
+    replay = subprocess.Popen([sys.executable,
+                               os.path.join(HERE, "replay_server.py"),
+                               "--delay-ms", str(args.delay_ms)],
+                              stdout=subprocess.PIPE,
+                              universal_newlines=True)
+    try:
+        endpoint = replay.stdout.readline().strip()
+        cluster.start()
+        lookup_endpoint = endpoint.replace("search.json", "lookup.json")
+        cluster.psql(args=["-v", "endpoint=" + endpoint,
+                           "-v", "lookup_endpoint=" + lookup_endpoint,
+                           "-f", os.path.join(HERE, "setup.sql")])
+
+        results = [run_workload(cluster, name, args, workdir)
+                   for name in workloads]
+    finally:
+        replay.terminate()
+        cluster.stop()
+        if args.keep:
+            print("cluster and logs kept in %s" % workdir, file=sys.stderr)
+        else:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+    if args.json:
+        print(json.dumps(results, indent=2))
+    else:
+        report(results)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,266 @@
+#!/usr/bin/env python3
+"""
+Replay server for twitter_fdw benchmarks.
+
+Serves search API responses in the shape of the old
+search.twitter.com/search.json endpoint, from fixtures generated
+deterministically at startup so that every run sees the same bytes.
+The q parameter picks the fixture by its prefix:
+
+    small-...    15 tweets, one default API page
+    medium-...   100 tweets
+    large-...    500 tweets
+    xlarge-...   1000 tweets, more than fit a page of any API
+    anything else, the small fixture
+
+and, to check twitter_fdw's limits on responses, worst cases:
+
+    deep-...         a results array nested 100000 levels deep
+    longstring-...   a tweet whose text is 8MB long
+    escapes-...      a tweet whose text is 1MB of escapes
+    huge-...         the small fixture padded to 32MB
+
+The rest of q is free, so that workloads can send distinct queries.
+The page and rpp parameters split a fixture into pages with next_page
+links, as the real API did; without them the whole fixture is returned
+in one response.
+
+Paths ending in lookup.json serve the statuses lookup API instead: the
+tweets of the large fixture whose ids the id parameter lists, separated
+by commas, as an array.
+
+With --daemon the server forks into the background once it listens,
+so the regression tests can start it from psql, and exits after
+--idle-timeout seconds without a request.
+"""
+
+import argparse
+import json
+import os
+import random
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, HTTPServer
+from socketserver import ThreadingMixIn
+from urllib.parse import parse_qs, quote, urlsplit
+
+FIXTURES = {"small": 15, "medium": 100, "large": 500, "xlarge": 1000}
+WORST_CASES = ("deep", "longstring", "escapes", "huge")
+USERS = 200
+
+WORDS = ("postgres sql query index vacuum planner executor tuple heap "
+         "wal replication backup json foreign wrapper join scan cache "
+         "latency throughput release extension").split()
+LANGS = ("en", "ja", "nl", "de", "fr", "es")
+SOURCES = ('<a href="http://twitter.com/">web</a>',
+           '<a href="http://twitter.com/#!/download/iphone">Twitter for iPhone</a>',
+           '<a href="http://www.tweetdeck.com">TweetDeck</a>')
+DAYS = ("Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun")
+MONTHS = ("Jan", "Feb", "Mar", "Apr", "May", "Jun",
+          "Jul", "Aug", "Sep", "Oct", "Nov", "Dec")
+
+
+def make_tweet(rng, seq):
+    from_id = rng.randrange(USERS)
+    to_id = rng.randrange(USERS) if rng.random() < 0.3 else None
+    words = [rng.choice(WORDS) for _ in range(rng.randrange(4, 20))]
+    if to_id is not None:
+        words.insert(0, "@user%d" % to_id)
+    if rng.random() < 0.2:
+        # non-ASCII text, to exercise \u escapes
+        words.append("ポストグレス")
+    if rng.random() < 0.3:
+        words.append("http://example.com/%d" % seq)
+    t = time.gmtime(1239218530 + seq * 37)
+    return {
+        "text": " ".join(words),
+        "to_user_id": to_id,
+        "to_user": ("user%d" % to_id) if to_id is not None else None,
+        "from_user": "user%d" % from_id,
+        "metadata": {"result_type": "recent",
+                     "recent_retweets": rng.randrange(100)},
+        "id": 1478555574 + seq,
+        "from_user_id": 1833773 + from_id,
+        "iso_language_code": rng.choice(LANGS),
+        "source": rng.choice(SOURCES),
+        "profile_image_url":
+            "http://a0.twimg.com/profile_images/%d/user%d_normal.jpg"
+            % (100000 + from_id, from_id),
+        "created_at": "%s, %02d %s %d %02d:%02d:%02d +0000"
+            % (DAYS[t.tm_wday], t.tm_mday, MONTHS[t.tm_mon - 1],
+               t.tm_year, t.tm_hour, t.tm_min, t.tm_sec),
+    }
+
+
+def make_fixtures():
+    fixtures = {}
+    for name, count in FIXTURES.items():
+        rng = random.Random(name)
+        fixtures[name] = [make_tweet(rng, i) for i in range(count)]
+    return fixtures
+
+
+def worst_case(name, small):
+    """A pathological response, always the same bytes for a name."""
+    if name == "deep":
+        return b'{"results":[' + b"[" * 100000 + b"]" * 100000 + b"]}"
+    if name == "longstring":
+        return b'{"results":[{"id":1,"text":"' + b"x" * (8 << 20) + b'"}]}'
+    if name == "escapes":
+        run = b'\\n\\"\\\\\\u00e9\\ud83d\\ude00'
+        return (b'{"results":[{"id":1,"text":"' +
+                run * ((1 << 20) // len(run)) + b'"}]}')
+    # whitespace is valid anywhere between tokens
+    body = escape(json.dumps({"results": small})).encode("ascii")
+    return body[:-1] + b" " * (32 << 20) + b"}"
+
+
+def escape(text):
+    # the API escaped slashes, and so do we, to keep the parser honest
+    return text.replace("/", "\\/")
+
+
+def render(cache, name, tweets, q, page, rpp):
+    """Encode one page of a fixture the way the search API did."""
+    start = (page - 1) * rpp
+    max_id = tweets[0]["id"] if tweets else 0
+
+    # encoding the tweets would make the server the bottleneck; reuse them
+    results = cache.get((name, page, rpp))
+    if results is None:
+        results = escape(json.dumps(tweets[start:start + rpp]))
+        cache[(name, page, rpp)] = results
+
+    body = {
+        "since_id": 0,
+        "max_id": max_id,
+        "refresh_url": "?since_id=%d&q=%s" % (max_id, quote(q)),
+        "results_per_page": rpp,
+        "completed_in": 0.012,
+        "page": page,
+        "query": quote(q),
+    }
+    if start + rpp < len(tweets):
+        body["next_page"] = "?page=%d&max_id=%d&rpp=%d&q=%s" % (
+            page + 1, max_id, rpp, quote(q))
+    return ('{"results":' + results + ", " +
+            escape(json.dumps(body))[1:]).encode("ascii")
+
+
+class ReplayHandler(BaseHTTPRequestHandler):
+    server_version = "twitter_fdw-replay/1.0"
+
+    def do_GET(self):
+        self.server.last_request = time.time()
+        url = urlsplit(self.path)
+        params = parse_qs(url.query)
+        if url.path.endswith("lookup.json"):
+            self.lookup(params.get("id", [""])[0])
+            return
+        q = params.get("q", [""])[0]
+        name = q.split("-", 1)[0]
+        if name in WORST_CASES:
+            body = self.server.worst.get(name)
+            if body is None:
+                body = worst_case(name, self.server.fixtures["small"])
+                self.server.worst[name] = body
+            self.reply(body)
+            return
+        if name not in self.server.fixtures:
+            name = "small"
+        tweets = self.server.fixtures[name]
+        try:
+            page = max(int(params.get("page", ["1"])[0]), 1)
+            rpp = max(int(params.get("rpp", [str(len(tweets))])[0]), 1)
+        except ValueError:
+            self.send_error(400)
+            return
+
+        self.reply(render(self.server.cache, name, tweets, q, page, rpp))
+
+    def lookup(self, ids):
+        try:
+            ids = [int(i) for i in ids.split(",") if i]
+        except ValueError:
+            self.send_error(400)
+            return
+        tweets = [self.server.by_id[i] for i in ids if i in self.server.by_id]
+        self.reply(escape(json.dumps(tweets)).encode("ascii"))
+
+    def reply(self, body):
+        if self.server.delay > 0:
+            time.sleep(self.server.delay)
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        pass
+
+
+class ReplayServer(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, address, delay_ms=0):
+        HTTPServer.__init__(self, address, ReplayHandler)
+        self.fixtures = make_fixtures()
+        self.by_id = dict((t["id"], t) for t in self.fixtures["large"])
+        self.cache = {}
+        self.worst = {}
+        self.delay = delay_ms / 1000.0
+        self.last_request = time.time()
+
+    def serve_until_idle(self, idle_timeout):
+        """Serve until no request came for idle_timeout seconds."""
+        self.timeout = 1
+        while time.time() - self.last_request < idle_timeout:
+            self.handle_request()
+
+
+def daemonize():
+    """Detach from the caller once the socket listens; True in the child."""
+    if os.fork() > 0:
+        return False
+    os.setsid()
+    devnull = os.open(os.devnull, os.O_RDWR)
+    for fd in (0, 1, 2):
+        os.dup2(devnull, fd)
+    os.close(devnull)
+    return True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=0,
+                        help="port to listen on, 0 picks a free one")
+    parser.add_argument("--delay-ms", type=float, default=0,
+                        help="simulated API latency per request")
+    parser.add_argument("--daemon", action="store_true",
+                        help="run in the background once listening")
+    parser.add_argument("--idle-timeout", type=float, default=0,
+                        help="exit after this many seconds without a "
+                        "request, 0 never does")
+    args = parser.parse_args()
+
+    server = ReplayServer((args.host, args.port), args.delay_ms)
+    # the runner reads the endpoint from our first line of output
+    print("http://%s:%d/search.json" % server.server_address[:2], flush=True)
+    if args.daemon and not daemonize():
+        server.server_close()
+        return 0
+    try:
+        if args.idle_timeout > 0:
+            server.serve_until_idle(args.idle_timeout)
+        else:
+            server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
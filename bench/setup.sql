@@ -0,0 +1,11 @@
+-- Benchmark database setup, run by bench.py with
+--   psql -v endpoint=<replay server URL> -v lookup_endpoint=<its lookup URL>
+--   -f setup.sql
+CREATE EXTENSION twitter_fdw;
+ALTER SERVER twitter_service OPTIONS (ADD endpoint :'endpoint',
+	ADD lookup_endpoint :'lookup_endpoint');
+
+-- the replay server's tweets come from user0 .. user199
+CREATE TABLE bench_users AS
+	SELECT 'user' || g AS name FROM generate_series(0, 99) g;
+ANALYZE bench_users;
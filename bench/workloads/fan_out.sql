@@ -0,0 +1,12 @@
+-- eight distinct searches of 100 tweets each in one statement
+\set n random(1, 100000)
+SELECT count(*) FROM (
+	SELECT id FROM twitter WHERE q = 'medium-:n-1'
+	UNION ALL SELECT id FROM twitter WHERE q = 'medium-:n-2'
+	UNION ALL SELECT id FROM twitter WHERE q = 'medium-:n-3'
+	UNION ALL SELECT id FROM twitter WHERE q = 'medium-:n-4'
+	UNION ALL SELECT id FROM twitter WHERE q = 'medium-:n-5'
+	UNION ALL SELECT id FROM twitter WHERE q = 'medium-:n-6'
+	UNION ALL SELECT id FROM twitter WHERE q = 'medium-:n-7'
+	UNION ALL SELECT id FROM twitter WHERE q = 'medium-:n-8'
+) s;
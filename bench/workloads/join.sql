@@ -0,0 +1,5 @@
+-- 100 tweets joined against a local table
+\set n random(1, 100000)
+SELECT count(*)
+	FROM bench_users u JOIN twitter t ON t.from_user = u.name
+	WHERE t.q = 'medium-:n';
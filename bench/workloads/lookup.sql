@@ -0,0 +1,4 @@
+-- 20 tweets of the large fixture looked up by id, in one request
+\set n random(0, 480)
+SELECT count(*) FROM twitter
+	WHERE id = ANY (ARRAY(SELECT 1478555574 + :n + g FROM generate_series(0, 19) g));
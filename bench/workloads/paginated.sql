@@ -0,0 +1,3 @@
+-- a deep result of 500 tweets; twitter_fdw fetches it as one page for now
+\set n random(1, 100000)
+SELECT count(*) FROM twitter WHERE q = 'large-:n';
@@ -0,0 +1,3 @@
+-- one request returning a default page of 15 tweets
+\set n random(1, 100000)
+SELECT count(*) FROM twitter WHERE q = 'small-:n';
@@ -23,6 +23,11 @@
 #include <stdarg.h>
 #include "json.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JSON_SIMD_X86
+#include <immintrin.h>
+#endif
+
 #ifdef TRACING_ENABLE
 #include <stdio.h>
 #define TRACING(fmt, ...)	fprintf(stderr, "tracing: " fmt, ##__VA_ARGS__)
@@ -262,8 +267,18 @@ static inline void *memory_calloc(void *(*calloc_fct)(size_t, size_t), size_t nm
 	return (calloc_fct) ? calloc_fct(nmemb, size) : calloc(nmemb, size);
 }
 
+static inline void memory_free(void (*free_fct)(void *), void *ptr)
+{
+	if (free_fct) {
+		if (ptr)
+			free_fct(ptr);
+	} else
+		free(ptr);
+}
+
 #define parser_calloc(parser, n, s) memory_calloc(parser->config.user_calloc, n, s)
 #define parser_realloc(parser, n, s) memory_realloc(parser->config.user_realloc, n, s)
+#define parser_free(parser, p) memory_free(parser->config.user_free, p)
 
 static int state_grow(json_parser *parser)
 {
@@ -272,6 +287,8 @@ static int state_grow(json_parser *parser)
 
 	if (parser->config.max_nesting != 0)
 		return JSON_ERROR_NESTING_LIMIT;
+	if (parser->stack_size > UINT32_MAX / 2)
+		return JSON_ERROR_NO_MEMORY;
 
 	ptr = parser_realloc(parser, parser->stack, newsize * sizeof(uint8_t));
 	if (!ptr)
@@ -306,10 +323,12 @@ static int buffer_grow(json_parser *parser)
 {
 	uint32_t newsize;
 	void *ptr;
-	int max = parser->config.max_data;
+	uint32_t max = parser->config.max_data;
 
 	if (max > 0 && parser->buffer_size == max)
 		return JSON_ERROR_DATA_LIMIT;
+	if (parser->buffer_size > UINT32_MAX / 2)
+		return JSON_ERROR_NO_MEMORY;
 	newsize = parser->buffer_size * 2;
 	if (max > 0 && newsize > max)
 		newsize = max;
@@ -335,16 +354,315 @@ static int buffer_push(json_parser *parser, unsigned char c)
 	return 0;
 }
 
+/* move the in place token into the buffer, when it can't be passed in place */
+static int token_spill(json_parser *parser)
+{
+	int ret;
+
+	while (parser->buffer_offset + parser->token_length >= parser->buffer_size) {
+		ret = buffer_grow(parser);
+		if (ret)
+			return ret;
+	}
+	if (parser->token_length > 0)
+		memcpy(parser->buffer + parser->buffer_offset, parser->token, parser->token_length);
+	parser->buffer_offset += parser->token_length;
+	parser->token = NULL;
+	parser->token_length = 0;
+	parser->token_buffered = 1;
+	return 0;
+}
+
+/* append a char of the input string s to the current token */
+static int token_push(json_parser *parser, const char *s)
+{
+	int ret;
+
+	if (parser->token) {
+		if (parser->token + parser->token_length == s) {
+			/* same limit as if it were in the buffer */
+			if (parser->config.max_data > 0 &&
+			    parser->token_length + 1 >= parser->config.max_data)
+				return JSON_ERROR_DATA_LIMIT;
+			parser->token_length++;
+			return 0;
+		}
+		ret = token_spill(parser);
+		if (ret)
+			return ret;
+	} else if (!parser->token_buffered) {
+		parser->token = s;
+		parser->token_length = 1;
+		return 0;
+	}
+	return buffer_push(parser, *s);
+}
+
+/* the simd engine only scans strings: it compares whole blocks of the input at
+ * once to find the first byte that ends a run of plain string characters, a quote,
+ * a backslash or a control character, so that the state machine can take the run
+ * in one step instead of char by char. there is no structural index: everything
+ * else, validation included, stays with the state machine. */
+typedef uint32_t (*scan_string_fn)(const char *s, uint32_t length);
+
+static uint32_t scan_string_tail(const char *s, uint32_t length, uint32_t i)
+{
+	for (; i < length; i++) {
+		unsigned char ch = s[i];
+		if (ch == '"' || ch == '\\' || ch < 0x20)
+			break;
+	}
+	return i;
+}
+
+#ifdef JSON_SIMD_X86
+__attribute__((target("sse2")))
+static uint32_t scan_string_sse2(const char *s, uint32_t length)
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i control = _mm_set1_epi8(0x1f);
+	uint32_t i, mask;
+
+	for (i = 0; i + 16 <= length; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		/* control characters are the bytes v for which min(v, 0x1f) == v */
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+		                                      _mm_cmpeq_epi8(v, backslash)),
+		                         _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+		mask = _mm_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return scan_string_tail(s, length, i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan_string_avx2(const char *s, uint32_t length)
+{
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i backslash = _mm256_set1_epi8('\\');
+	const __m256i control = _mm256_set1_epi8(0x1f);
+	uint32_t i, mask;
+
+	for (i = 0; i + 32 <= length; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+		__m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+		                                            _mm256_cmpeq_epi8(v, backslash)),
+		                            _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v));
+		mask = _mm256_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return scan_string_tail(s, length, i);
+}
+#endif
+
+/* the scanner of an engine, NULL for the plain state machine */
+static scan_string_fn scan_string_select(int engine)
+{
+	if (engine == JSON_ENGINE_SCALAR)
+		return NULL;
+#ifdef JSON_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return scan_string_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return scan_string_sse2;
+#endif
+	return NULL;
+}
+
+static void engine_select(json_parser *parser)
+{
+	parser->scan_string = scan_string_select(parser->config.engine);
+}
+
+/* take a run of plain string characters at once, as the state machine would have
+ * char by char. return non zero to leave it to the state machine instead, when the
+ * run would hit a limit, so that the error is reported on the exact char. */
+static int string_run(json_parser *parser, const char *s, uint32_t n)
+{
+	uint32_t max = parser->config.max_data;
+
+	if (parser->config.zero_copy && !parser->token_buffered) {
+		if (parser->token && parser->token + parser->token_length != s)
+			return 1;
+		if (max > 0 && parser->token_length + n >= max)
+			return 1;
+		if (!parser->token)
+			parser->token = s;
+		parser->token_length += n;
+		return 0;
+	}
+	if (parser->token)
+		return 1;
+	while (parser->buffer_offset + n >= parser->buffer_size)
+		if (buffer_grow(parser))
+			return 1;
+	memcpy(parser->buffer + parser->buffer_offset, s, n);
+	parser->buffer_offset += n;
+	return 0;
+}
+
+#define NUMBER_NEGATIVE		0x01
+#define NUMBER_DOT		0x02
+#define NUMBER_EXPONENT		0x04
+#define NUMBER_EXPONENT_NEGATIVE	0x08
+#define NUMBER_INEXACT		0x10
+
+/* more digits than this may not fit in the mantissa */
+#define NUMBER_MAX_DIGITS	19
+#define NUMBER_MAX_EXPONENT	100000
+
+/* add a char of the current number to its mantissa or exponent */
+static void number_push(json_parser *parser, unsigned char c)
+{
+	switch (c) {
+	case '-':
+		parser->number_flags |= (parser->number_flags & NUMBER_EXPONENT)
+			? NUMBER_EXPONENT_NEGATIVE : NUMBER_NEGATIVE;
+		break;
+	case '.':
+		parser->number_flags |= NUMBER_DOT;
+		break;
+	case 'e': case 'E':
+		parser->number_flags |= NUMBER_EXPONENT;
+		break;
+	case '+':
+		break;
+	default:
+		if (parser->number_flags & NUMBER_EXPONENT) {
+			if (parser->number_exponent < NUMBER_MAX_EXPONENT)
+				parser->number_exponent = parser->number_exponent * 10 + (c - '0');
+			break;
+		}
+		if (parser->number_flags & NUMBER_DOT)
+			parser->number_fraction++;
+		/* leading zeros don't count */
+		if (parser->number_digits == 0 && c == '0')
+			break;
+		if (parser->number_digits == NUMBER_MAX_DIGITS) {
+			parser->number_flags |= NUMBER_INEXACT;
+			break;
+		}
+		parser->number_mantissa = parser->number_mantissa * 10 + (c - '0');
+		parser->number_digits++;
+		break;
+	}
+}
+
+/* powers of ten that are exact as doubles */
+static const double exact_powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define MAX_EXACT_POWER_OF_TEN	22
+#define MAX_EXACT_MANTISSA	(1ULL << 53)
+
+/* compute the value of the current number, return 0 if it can't be done exactly */
+static int number_value(json_parser *parser, int type, json_number *number)
+{
+	uint64_t m = parser->number_mantissa;
+	int negative = parser->number_flags & NUMBER_NEGATIVE;
+	int64_t e;
+
+	if (parser->number_flags & NUMBER_INEXACT)
+		return 0;
+
+	if (type == JSON_INT) {
+		if (m > (uint64_t) INT64_MAX + negative)
+			return 0;
+		number->int_value = (negative) ? (int64_t) (0 - m) : (int64_t) m;
+		number->float_value = (double) number->int_value;
+		return 1;
+	}
+
+	/* both the mantissa and the power of ten are exact, so is their product or ratio */
+	e = (parser->number_flags & NUMBER_EXPONENT_NEGATIVE)
+		? -(int64_t) parser->number_exponent : (int64_t) parser->number_exponent;
+	e -= parser->number_fraction;
+	if (m == 0)
+		number->float_value = 0.0;
+	else if (m > MAX_EXACT_MANTISSA || e > MAX_EXACT_POWER_OF_TEN || e < -MAX_EXACT_POWER_OF_TEN)
+		return 0;
+	else if (e >= 0)
+		number->float_value = (double) m * exact_powers_of_ten[e];
+	else
+		number->float_value = (double) m / exact_powers_of_ten[-e];
+	if (negative)
+		number->float_value = -number->float_value;
+	number->int_value = 0;
+	return 1;
+}
+
+static void token_reset(json_parser *parser)
+{
+	parser->buffer_offset = 0;
+	parser->token = NULL;
+	parser->token_length = 0;
+	parser->token_buffered = 0;
+	parser->number_mantissa = 0;
+	parser->number_exponent = 0;
+	parser->number_fraction = 0;
+	parser->number_digits = 0;
+	parser->number_flags = 0;
+}
+
+/* a pull parser queues the events of a char for json_parser_next; there are two at
+ * most, a value and the end of the structure that holds it */
+static int event_push(json_parser *parser, int type, const char *data, uint32_t length,
+                      const json_number *number)
+{
+	json_event *event = &parser->events[parser->nevents];
+
+	event->type = type;
+	event->data = data;
+	event->length = length;
+	event->number = NULL;
+	if (number) {
+		parser->event_numbers[parser->nevents] = *number;
+		event->number = &parser->event_numbers[parser->nevents];
+	}
+	parser->nevents++;
+	return 0;
+}
+
 static int do_callback_withbuf(json_parser *parser, int type)
 {
-	if (!parser->callback)
+	const char *data;
+	uint32_t length;
+	json_number number;
+	int typed;
+
+	if (!parser->callback && !parser->typed_callback && !parser->pull)
 		return 0;
-	parser->buffer[parser->buffer_offset] = '\0';
-	return (*parser->callback)(parser->userdata, type, parser->buffer, parser->buffer_offset);
+	if (parser->token) {
+		data = parser->token;
+		length = parser->token_length;
+	} else {
+		parser->buffer[parser->buffer_offset] = '\0';
+		data = parser->buffer;
+		length = parser->buffer_offset;
+	}
+	if (!parser->typed_callback && !parser->pull)
+		return (*parser->callback)(parser->userdata, type, data, length);
+
+	typed = parser->config.typed_numbers && (type == JSON_INT || type == JSON_FLOAT)
+		&& number_value(parser, type, &number);
+	if (parser->pull)
+		return event_push(parser, type, data, length, (typed) ? &number : NULL);
+	return (*parser->typed_callback)(parser->userdata, type, data, length,
+	                                 (typed) ? &number : NULL);
 }
 
 static int do_callback(json_parser *parser, int type)
 {
+	if (parser->pull)
+		return event_push(parser, type, NULL, 0, NULL);
+	if (parser->typed_callback)
+		return (*parser->typed_callback)(parser->userdata, type, NULL, 0, NULL);
 	if (!parser->callback)
 		return 0;
 	return (*parser->callback)(parser->userdata, type, NULL, 0);
@@ -365,7 +683,7 @@ static int do_buffer(json_parser *parser)
 	default:
 		break;
 	}
-	parser->buffer_offset = 0;
+	token_reset(parser);
 	return ret;
 }
 
@@ -523,7 +841,7 @@ int act_se(json_parser *parser)
 {
 	int ret;
 	CHK(do_callback_withbuf(parser, (parser->expecting_key) ? JSON_KEY : JSON_STRING));
-	parser->buffer_offset = 0;
+	token_reset(parser);
 	parser->state = (parser->expecting_key) ? STATE_CO : STATE_OK;
 	parser->expecting_key = 0;
 	return 0;
@@ -600,6 +918,7 @@ int json_parser_init(json_parser *parser, json_config *config,
 		memcpy(&parser->config, config, sizeof(json_config));
 	parser->callback = callback;
 	parser->userdata = userdata;
+	engine_select(parser);
 
 	/* initialise parsing stack and state */
 	parser->stack_offset = 0;
@@ -624,24 +943,121 @@ int json_parser_init(json_parser *parser, json_config *config,
 
 	parser->buffer = parser_calloc(parser, parser->buffer_size, sizeof(char));
 	if (!parser->buffer) {
-		free(parser->stack);
+		parser_free(parser, parser->stack);
 		return JSON_ERROR_NO_MEMORY;
 	}
 	return 0;
 }
 
+/** json_parser_init_typed initialize a parser structure like json_parser_init,
+ * with a callback that also receives the value of numbers.
+ */
+int json_parser_init_typed(json_parser *parser, json_config *config,
+                           json_parser_typed_callback callback, void *userdata)
+{
+	int ret;
+
+	ret = json_parser_init(parser, config, NULL, userdata);
+	if (ret)
+		return ret;
+	parser->typed_callback = callback;
+	return 0;
+}
+
+/** json_parser_init_pull initialize a parser structure driven by json_parser_next
+ */
+int json_parser_init_pull(json_parser *parser, json_config *config)
+{
+	int ret;
+
+	ret = json_parser_init(parser, config, NULL, NULL);
+	if (ret)
+		return ret;
+	parser->pull = 1;
+	return 0;
+}
+
+/** json_parser_feed give the next part of the document to a pull parser */
+int json_parser_feed(json_parser *parser, const char *s, uint32_t length)
+{
+	parser->input = s;
+	parser->input_length = length;
+	parser->input_offset = 0;
+	return 0;
+}
+
+/** json_parser_next parse a pull parser up to its next event */
+int json_parser_next(json_parser *parser, json_event *event)
+{
+	uint32_t processed;
+	int ret;
+
+	if (parser->event_next < parser->nevents) {
+		*event = parser->events[parser->event_next++];
+		return 0;
+	}
+	parser->nevents = 0;
+	parser->event_next = 0;
+
+	/* json_parser_string stops right after a char that made events */
+	while (parser->input_offset < parser->input_length) {
+		ret = json_parser_string(parser, parser->input + parser->input_offset,
+		                         parser->input_length - parser->input_offset, &processed);
+		parser->input_offset += processed;
+		if (ret)
+			return ret;
+		if (parser->nevents) {
+			*event = parser->events[0];
+			parser->event_next = 1;
+			return 0;
+		}
+	}
+	memset(event, 0, sizeof(*event));
+	return 0;
+}
+
 /** json_parser_free freed memory structure allocated by the parser */
 int json_parser_free(json_parser *parser)
 {
 	if (!parser)
 		return 0;
-	free(parser->stack);
-	free(parser->buffer);
+	parser_free(parser, parser->stack);
+	parser_free(parser, parser->buffer);
 	parser->stack = NULL;
 	parser->buffer = NULL;
 	return 0;
 }
 
+/** json_parser_reset makes the parser ready for a new document, keeping its memory */
+int json_parser_reset(json_parser *parser)
+{
+	parser->state = STATE_GO;
+	parser->save_state = 0;
+	parser->expecting_key = 0;
+	parser->unicode_multi = 0;
+	parser->type = JSON_NONE;
+	parser->stack_offset = 0;
+	parser->nevents = 0;
+	parser->event_next = 0;
+	parser->input = NULL;
+	parser->input_length = 0;
+	parser->input_offset = 0;
+	token_reset(parser);
+	return 0;
+}
+
+/** json_parser_engine return the name of the engine the parser runs */
+const char *json_parser_engine(json_parser *parser)
+{
+#ifdef JSON_SIMD_X86
+	if (parser->scan_string == scan_string_avx2)
+		return "avx2";
+	if (parser->scan_string == scan_string_sse2)
+		return "sse2";
+#endif
+	return "scalar";
+}
+
 /** json_parser_is_done return 0 is the parser isn't in a finish state. !0 if it is */
 int json_parser_is_done(json_parser *parser)
 {
@@ -663,7 +1079,18 @@ int json_parser_string(json_parser *parser, const char *s,
 
 	ret = 0;
 	for (i = 0; i < length; i++) {
-		unsigned char ch = s[i];
+		unsigned char ch;
+
+		/* with the simd engine, runs of plain string characters are taken at once */
+		if (parser->state == STATE__S && parser->scan_string) {
+			uint32_t n = parser->scan_string(s + i, length - i);
+			if (n > 0 && !string_run(parser, s + i, n)) {
+				i += n;
+				if (i == length)
+					break;
+			}
+		}
+		ch = s[i];
 
 		ret = 0;
 		next_class = (ch >= 128) ? C_OTHER : character_class[ch];
@@ -681,11 +1108,21 @@ int json_parser_string(json_parser *parser, const char *s,
 			break;
 		}
 
+		/* escapes are decoded in the buffer */
+		if (parser->config.zero_copy && next_state == STATE_E0) {
+			ret = token_spill(parser);
+			if (ret)
+				break;
+		}
+
 		/* add char to buffer */
 		if (buffer_policy) {
-			ret = (buffer_policy == 2)
-				? buffer_push_escape(parser, ch)
-				: buffer_push(parser, ch);
+			if (buffer_policy == 2)
+				ret = buffer_push_escape(parser, ch);
+			else if (parser->config.zero_copy)
+				ret = token_push(parser, s + i);
+			else
+				ret = buffer_push(parser, ch);
 			if (ret)
 				break;
 		}
@@ -697,7 +1134,21 @@ int json_parser_string(json_parser *parser, const char *s,
 			parser->state = next_state;
 		if (ret)
 			break;
+
+		/* the type is known once the first char of a number is processed */
+		if (parser->config.typed_numbers && buffer_policy == 1 &&
+		    (parser->type == JSON_INT || parser->type == JSON_FLOAT))
+			number_push(parser, ch);
+
+		/* a pull parser hands over the events of this char first */
+		if (parser->nevents) {
+			i++;
+			break;
+		}
 	}
+	/* a token spanning to the next string has to be kept */
+	if (parser->token && !ret)
+		ret = token_spill(parser);
 	if (processed)
 		*processed = i;
 	return ret;
@@ -721,43 +1172,102 @@ int json_print_init(json_printer *printer, json_printer_callback callback, void
 	printer->indentlevel = 0;
 	printer->enter_object = 1;
 	printer->first = 1;
+	printer->scan_string = scan_string_select(JSON_ENGINE_AUTO);
 	return 0;
 }
 
-/** json_print_free free a printer a context
- * doesn't do anything now, but in future print_init could allocate memory */
+/* pass the buffered output to the callback, keeping its first error */
+static int print_flush(json_printer *printer)
+{
+	int ret;
+
+	if (printer->buffer_offset > 0) {
+		ret = printer->callback(printer->userdata, printer->buffer, printer->buffer_offset);
+		printer->buffer_offset = 0;
+		if (ret && !printer->error)
+			printer->error = ret;
+	}
+	return printer->error;
+}
+
+/* buffer some output, flushing blocks. what doesn't fit in the buffer
+ * goes to the callback directly */
+static void print_out(json_printer *printer, const char *s, uint32_t length)
+{
+	int ret;
+
+	if (printer->buffer_offset + length > JSON_PRINTER_BUFFER_SIZE) {
+		print_flush(printer);
+		if (length >= JSON_PRINTER_BUFFER_SIZE) {
+			ret = printer->callback(printer->userdata, s, length);
+			if (ret && !printer->error)
+				printer->error = ret;
+			return;
+		}
+	}
+	memcpy(printer->buffer + printer->buffer_offset, s, length);
+	printer->buffer_offset += length;
+}
+
+/** json_print_flush pass everything printed so far to the printer callback */
+int json_print_flush(json_printer *printer)
+{
+	return print_flush(printer);
+}
+
+/** json_print_free free a printer a context, flushing what is left
+ * doesn't free anything now, but in future print_init could allocate memory */
 int json_print_free(json_printer *printer)
 {
-	return 0;
+	return print_flush(printer);
 }
 
-/* escape a C string to be a JSON valid string on the wire.
+/* escape a C string to be a JSON valid string on the wire. runs of characters
+ * that need no escape are output at once, found as the parser finds them.
  * XXX: it doesn't do unicode verification. yet?. */
 static int print_string(json_printer *printer, const char *data, uint32_t length)
 {
-	int i;
+	uint32_t i, n;
 
-	printer->callback(printer->userdata, "\"", 1);
+	print_out(printer, "\"", 1);
 	for (i = 0; i < length; i++) {
-		unsigned char c = data[i];
+		unsigned char c;
+
+		if (printer->scan_string)
+			n = printer->scan_string(data + i, length - i);
+		else
+			n = scan_string_tail(data + i, length - i, 0);
+		if (n > 0) {
+			print_out(printer, data + i, n);
+			i += n;
+			if (i == length)
+				break;
+		}
+		c = data[i];
 		if (c < 36) {
 			char *esc = character_escape[c];
-			printer->callback(printer->userdata, esc, strlen(esc));
+			print_out(printer, esc, strlen(esc));
 		} else if (c == '\\') {
-			printer->callback(printer->userdata, "\\\\", 2);
+			print_out(printer, "\\\\", 2);
 		} else
-			printer->callback(printer->userdata, data + i, 1);
+			print_out(printer, data + i, 1);
 	}
-	printer->callback(printer->userdata, "\"", 1);
+	print_out(printer, "\"", 1);
 	return 0;
 }
 
 static int print_indent(json_printer *printer)
 {
 	int i;
-	printer->callback(printer->userdata, "\n", 1);
+
+	/* the user may set indentstr after init */
+	if (printer->indent_measured != printer->indentstr) {
+		printer->indent_measured = printer->indentstr;
+		printer->indent_length = strlen(printer->indentstr);
+	}
+	print_out(printer, "\n", 1);
 	for (i = 0; i < printer->indentlevel; i++)
-		printer->callback(printer->userdata, printer->indentstr, strlen(printer->indentstr));
+		print_out(printer, printer->indentstr, printer->indent_length);
 	return 0;
 }
 
@@ -766,7 +1276,7 @@ int json_print_mode(json_printer *printer, int type, const char *data, uint32_t
 	int enterobj = printer->enter_object;
 
 	if (!enterobj && !printer->afterkey && (type != JSON_ARRAY_END && type != JSON_OBJECT_END)) {
-		printer->callback(printer->userdata, ",", 1);
+		print_out(printer, ",", 1);
 		if (pretty) print_indent(printer);
 	}
 
@@ -779,12 +1289,12 @@ int json_print_mode(json_printer *printer, int type, const char *data, uint32_t
 	printer->afterkey = 0;
 	switch (type) {
 	case JSON_ARRAY_BEGIN:
-		printer->callback(printer->userdata, "[", 1);
+		print_out(printer, "[", 1);
 		printer->indentlevel++;
 		printer->enter_object = 1;
 		break;
 	case JSON_OBJECT_BEGIN:
-		printer->callback(printer->userdata, "{", 1);
+		print_out(printer, "{", 1);
 		printer->indentlevel++;
 		printer->enter_object = 1;
 		break;
@@ -792,16 +1302,16 @@ int json_print_mode(json_printer *printer, int type, const char *data, uint32_t
 	case JSON_OBJECT_END:
 		printer->indentlevel--;
 		if (pretty && !enterobj) print_indent(printer);
-		printer->callback(printer->userdata, (type == JSON_OBJECT_END) ? "}" : "]", 1);
+		print_out(printer, (type == JSON_OBJECT_END) ? "}" : "]", 1);
 		break;
-	case JSON_INT: printer->callback(printer->userdata, data, length); break;
-	case JSON_FLOAT: printer->callback(printer->userdata, data, length); break;
-	case JSON_NULL: printer->callback(printer->userdata, "null", 4); break;
-	case JSON_TRUE: printer->callback(printer->userdata, "true", 4); break;
-	case JSON_FALSE: printer->callback(printer->userdata, "false", 5); break;
+	case JSON_INT: print_out(printer, data, length); break;
+	case JSON_FLOAT: print_out(printer, data, length); break;
+	case JSON_NULL: print_out(printer, "null", 4); break;
+	case JSON_TRUE: print_out(printer, "true", 4); break;
+	case JSON_FALSE: print_out(printer, "false", 5); break;
 	case JSON_KEY:
 		print_string(printer, data, length);
-		printer->callback(printer->userdata, ": ", (pretty) ? 2 : 1);
+		print_out(printer, ": ", (pretty) ? 2 : 1);
 		printer->afterkey = 1;
 		break;
 	case JSON_STRING:
@@ -811,7 +1321,7 @@ int json_print_mode(json_printer *printer, int type, const char *data, uint32_t
 		break;
 	}
 
-	return 0;
+	return printer->error;
 }
 
 /** json_print_pretty pretty print the passed argument (type/data/length). */
@@ -855,7 +1365,7 @@ int json_print_args(json_printer *printer,
 		case JSON_STRING:
 			data = va_arg(ap, char *);
 			length = va_arg(ap, uint32_t);
-			if (length == -1)
+			if (length == (uint32_t) -1)
 				length = strlen(data);
 			ret = (*f)(printer, type, data, length);
 			break;
@@ -871,38 +1381,76 @@ static int dom_push(struct json_parser_dom *ctx, void *val)
 {
 	if (ctx->stack_offset == ctx->stack_size) {
 		void *ptr;
-		uint32_t newsize = ctx->stack_size * 2;
-		ptr = memory_realloc(ctx->user_realloc, ctx->stack, newsize);
+		uint32_t newsize = (ctx->stack_size) ? ctx->stack_size * 2 : 1024;
+		ptr = memory_realloc(ctx->user_realloc, ctx->stack, newsize * sizeof(*(ctx->stack)));
 		if (!ptr)
 			return JSON_ERROR_NO_MEMORY;
 		ctx->stack = ptr;
 		ctx->stack_size = newsize;
 	}
 	ctx->stack[ctx->stack_offset].val = val;
-	ctx->stack[ctx->stack_offset].key = NULL;
+	ctx->stack[ctx->stack_offset].key_offset = ctx->keys_offset;
 	ctx->stack[ctx->stack_offset].key_length = 0;
+	ctx->stack[ctx->stack_offset].has_key = 0;
 	ctx->stack_offset++;
 	return 0;
 }
 
 static int dom_pop(struct json_parser_dom *ctx, void **val)
 {
+	if (ctx->stack_offset == 0)
+		return JSON_ERROR_POP_EMPTY;
 	ctx->stack_offset--;
 	*val = ctx->stack[ctx->stack_offset].val;
+	/* drop the keys of the structure */
+	ctx->keys_offset = ctx->stack[ctx->stack_offset].key_offset;
 	return 0;
 }
 
+/* keep the key of the current member in the arena */
+static int dom_key(struct json_parser_dom *ctx, const char *key, uint32_t length)
+{
+	struct stack_elem *stack = &(ctx->stack[ctx->stack_offset - 1]);
+
+	/* the previous key of this object is on top of the arena */
+	ctx->keys_offset = stack->key_offset;
+	stack->key_length = length;
+
+	if (ctx->keys_offset + length + 1 > ctx->keys_size) {
+		uint32_t newsize = (ctx->keys_size) ? ctx->keys_size : 256;
+		void *ptr;
+
+		while (ctx->keys_offset + length + 1 > newsize)
+			newsize *= 2;
+		ptr = memory_realloc(ctx->user_realloc, ctx->keys, newsize);
+		if (!ptr)
+			return JSON_ERROR_NO_MEMORY;
+		ctx->keys = ptr;
+		ctx->keys_size = newsize;
+	}
+	memcpy(ctx->keys + ctx->keys_offset, key, length);
+	ctx->keys[ctx->keys_offset + length] = '\0';
+	ctx->keys_offset += length + 1;
+	stack->has_key = 1;
+	return 0;
+}
+
+/* append a value to the current structure, under its current key */
+static void dom_append(struct json_parser_dom *ctx, void *v)
+{
+	struct stack_elem *stack = &(ctx->stack[ctx->stack_offset - 1]);
+	char *key = stack->has_key ? ctx->keys + stack->key_offset : NULL;
+
+	ctx->append(stack->val, key, stack->key_length, v);
+}
+
 int json_parser_dom_init(json_parser_dom *dom,
                          json_parser_dom_create_structure create_structure,
                          json_parser_dom_create_data create_data,
                          json_parser_dom_append append)
 {
+	/* the stack is allocated on first use, so that the allocator can be set after init */
 	memset(dom, 0, sizeof(*dom));
-	dom->stack_size = 1024;
-	dom->stack_offset = 0;
-	dom->stack = memory_calloc(dom->user_calloc, dom->stack_size, sizeof(*(dom->stack)));
-	if (!dom->stack)
-		return JSON_ERROR_NO_MEMORY;
 	dom->append = append;
 	dom->create_structure = create_structure;
 	dom->create_data = create_data;
@@ -911,7 +1459,16 @@ int json_parser_dom_init(json_parser_dom *dom,
 
 int json_parser_dom_free(json_parser_dom *dom)
 {
-	free(dom->stack);
+	memory_free(dom->user_free, dom->stack);
+	memory_free(dom->user_free, dom->keys);
+	return 0;
+}
+
+int json_parser_dom_reset(json_parser_dom *dom)
+{
+	dom->stack_offset = 0;
+	dom->keys_offset = 0;
+	dom->root_structure = NULL;
 	return 0;
 }
 
@@ -919,7 +1476,7 @@ int json_parser_dom_callback(void *userdata, int type, const char *data, uint32_
 {
 	struct json_parser_dom *ctx = userdata;
 	void *v;
-	struct stack_elem *stack = NULL;
+	int ret;
 
 	switch (type) {
 	case JSON_ARRAY_BEGIN:
@@ -927,37 +1484,45 @@ int json_parser_dom_callback(void *userdata, int type, const char *data, uint32_
 		v = ctx->create_structure(ctx->stack_offset, type == JSON_OBJECT_BEGIN);
 		if (!v)
 			return JSON_ERROR_CALLBACK;
-		dom_push(ctx, v);
+		ret = dom_push(ctx, v);
+		if (ret)
+			return ret;
 		break;
 	case JSON_OBJECT_END:
 	case JSON_ARRAY_END:
-		dom_pop(ctx, &v);
-		if (ctx->stack_offset > 0) {
-			stack = &(ctx->stack[ctx->stack_offset - 1]);
-			ctx->append(stack->val, stack->key, stack->key_length, v);
-			free(stack->key);
-		} else
+		ret = dom_pop(ctx, &v);
+		if (ret)
+			return ret;
+		if (ctx->stack_offset > 0)
+			dom_append(ctx, v);
+		else
 			ctx->root_structure = v;
 		break;
 	case JSON_KEY:
-		stack = &(ctx->stack[ctx->stack_offset - 1]);
-		stack->key = memory_calloc(ctx->user_calloc, length + 1, sizeof(char));
-		stack->key_length = length;
-		if (!stack->key)
-			return JSON_ERROR_NO_MEMORY;
-		memcpy(stack->key, data, length);
-		break;
+		return dom_key(ctx, data, length);
 	case JSON_STRING:
 	case JSON_INT:
 	case JSON_FLOAT:
 	case JSON_NULL:
 	case JSON_TRUE:
 	case JSON_FALSE:
-		stack = &(ctx->stack[ctx->stack_offset - 1]);
 		v = ctx->create_data(type, data, length);
-		ctx->append(stack->val, stack->key, stack->key_length, v);
-		free(stack->key);
+		dom_append(ctx, v);
 		break;
 	}
 	return 0;
 }
+
+int json_parser_dom_typed_callback(void *userdata, int type, const char *data, uint32_t length,
+                                   const json_number *number)
+{
+	struct json_parser_dom *ctx = userdata;
+	void *v;
+
+	if ((type != JSON_INT && type != JSON_FLOAT) || !ctx->create_number)
+		return json_parser_dom_callback(userdata, type, data, length);
+
+	v = ctx->create_number(type, data, length, number);
+	dom_append(ctx, v);
+	return 0;
+}
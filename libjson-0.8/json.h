@@ -66,20 +66,52 @@ typedef enum
 	JSON_ERROR_CALLBACK,
 } json_error;
 
+/* engines that can run the parser, see json_parser_init */
+enum {
+	JSON_ENGINE_AUTO = 0,
+	JSON_ENGINE_SCALAR,
+	JSON_ENGINE_SIMD,
+};
+
 #define LIBJSON_DEFAULT_STACK_SIZE 256
 #define LIBJSON_DEFAULT_BUFFER_SIZE 4096
 
 typedef int (*json_parser_callback)(void *userdata, int type, const char *data, uint32_t length);
+
+/* value of a JSON_INT or JSON_FLOAT, as computed with typed_numbers */
+typedef struct {
+	int64_t int_value;
+	double float_value;
+} json_number;
+
+/* same as json_parser_callback, with the value of numbers that could be computed exactly */
+typedef int (*json_parser_typed_callback)(void *userdata, int type, const char *data, uint32_t length,
+                                          const json_number *number);
 typedef int (*json_printer_callback)(void *userdata, const char *s, uint32_t length);
 
+/* an event returned by json_parser_next, with what a typed callback would receive */
+typedef struct {
+	json_type type;
+	const char *data;
+	uint32_t length;
+	const json_number *number;
+} json_event;
+
 typedef struct {
 	uint32_t buffer_initial_size;
 	uint32_t max_nesting;
 	uint32_t max_data;
 	int allow_c_comments;
 	int allow_yaml_comments;
+	/* pass strings and numbers to the callback in place, see json_parser_string */
+	int zero_copy;
+	/* compute numbers while tokenizing, see json_parser_init_typed */
+	int typed_numbers;
+	/* JSON_ENGINE_*, see json_parser_init */
+	int engine;
 	void * (*user_calloc)(size_t nmemb, size_t size);
 	void * (*user_realloc)(void *ptr, size_t size);
+	void (*user_free)(void *ptr);
 } json_config;
 
 typedef struct json_parser {
@@ -87,6 +119,7 @@ typedef struct json_parser {
 
 	/* SAJ callback */
 	json_parser_callback callback;
+	json_parser_typed_callback typed_callback;
 	void *userdata;
 
 	/* parser state */
@@ -105,8 +138,36 @@ typedef struct json_parser {
 	char *buffer;
 	uint32_t buffer_size;
 	uint32_t buffer_offset;
+
+	/* zero copy: current token in the caller's string, or in the buffer */
+	const char *token;
+	uint32_t token_length;
+	uint8_t token_buffered;
+
+	/* typed numbers: decimal mantissa and exponent of the current number */
+	uint64_t number_mantissa;
+	uint32_t number_exponent;
+	uint32_t number_fraction;
+	uint8_t number_digits;
+	uint8_t number_flags;
+
+	/* simd engine: length of the run of plain string characters at s */
+	uint32_t (*scan_string)(const char *s, uint32_t length);
+
+	/* pull mode: events of the last char processed, and the input fed */
+	uint8_t pull;
+	uint8_t nevents;
+	uint8_t event_next;
+	json_event events[2];
+	json_number event_numbers[2];
+	const char *input;
+	uint32_t input_length;
+	uint32_t input_offset;
 } json_parser;
 
+/* size of the output buffer of a printer */
+#define JSON_PRINTER_BUFFER_SIZE	4096
+
 typedef struct json_printer {
 	json_printer_callback callback;
 	void *userdata;
@@ -116,21 +177,70 @@ typedef struct json_printer {
 	int afterkey;
 	int enter_object;
 	int first;
+
+	/* output not passed to the callback yet */
+	char buffer[JSON_PRINTER_BUFFER_SIZE];
+	uint32_t buffer_offset;
+	int error;
+	const char *indent_measured;
+	uint32_t indent_length;
+	uint32_t (*scan_string)(const char *s, uint32_t length);
 } json_printer;
 
 /** json_parser_init initialize a parser structure taking a config,
  * a config and its userdata.
+ * the engine config picks how the input is scanned: JSON_ENGINE_AUTO, the default,
+ * uses the simd engine when the cpu supports it, and JSON_ENGINE_SCALAR forces the
+ * plain state machine. both engines accept the same documents and make the same
+ * callbacks; the simd engine only scans runs of string characters a block at a time.
  * return JSON_ERROR_NO_MEMORY if memory allocation failed or SUCCESS.  */
 int json_parser_init(json_parser *parser, json_config *cfg,
                      json_parser_callback callback, void *userdata);
 
+/** json_parser_engine return the name of the engine the parser runs:
+ * "scalar", "sse2" or "avx2" */
+const char *json_parser_engine(json_parser *parser);
+
+/** json_parser_init_typed initialize a parser structure like json_parser_init,
+ * with a callback that also receives the value of numbers.
+ * with the typed_numbers config, the value of a JSON_INT that fits in int64_t, or
+ * of a JSON_FLOAT that converts exactly to a double without rounding, is computed
+ * while tokenizing and passed along with the text. number is NULL for other
+ * atoms, and for numbers that didn't fit, in which case the text has to be used. */
+int json_parser_init_typed(json_parser *parser, json_config *cfg,
+                           json_parser_typed_callback callback, void *userdata);
+
+/** json_parser_init_pull initialize a parser structure driven by the user instead
+ * of callbacks: the document is handed over with json_parser_feed, and its events
+ * are taken one at a time with json_parser_next, which can stop at any of them. */
+int json_parser_init_pull(json_parser *parser, json_config *cfg);
+
+/** json_parser_feed give the next part of the document to a pull parser, once
+ * json_parser_next has consumed the previous one. s is not copied, and has to stay
+ * valid until it is consumed, and as long as the data of its events is used. */
+int json_parser_feed(json_parser *parser, const char *s, uint32_t length);
+
+/** json_parser_next parse a pull parser up to its next event, and return it in event.
+ * return 0 if everything went ok, a JSON_ERROR_* otherwise. event->type is JSON_NONE
+ * once everything fed so far is consumed. the data and number of an event are the ones
+ * a typed callback would receive, and stay valid until the next call. */
+int json_parser_next(json_parser *parser, json_event *event);
+
 /** json_parser_free freed memory structure allocated by the parser */
 int json_parser_free(json_parser *parser);
 
+/** json_parser_reset makes the parser ready to parse a new document, keeping the
+ * memory it has allocated, so that one parser can serve many documents */
+int json_parser_reset(json_parser *parser);
+
 /** json_parser_string append a string s with a specific length to the parser
  * return 0 if everything went ok, a JSON_ERROR_* otherwise.
  * the user can supplied a valid processed pointer that will
- * be fill with the number of processed characters before returning */
+ * be fill with the number of processed characters before returning.
+ * with the zero_copy config, a string, key or number without escapes that lies
+ * wholly in s is passed to the callback as a pointer into s, which is not
+ * nul terminated; the callback has to use the length, and to copy the data
+ * if it needs it after json_parser_string returns. */
 int json_parser_string(json_parser *parser, const char *string,
                        uint32_t length, uint32_t *processed);
 
@@ -141,14 +251,22 @@ int json_parser_char(json_parser *parser, unsigned char next_char);
 /** json_parser_is_done return 0 is the parser isn't in a finish state. !0 if it is */
 int json_parser_is_done(json_parser *parser);
 
-/** json_print_init initialize a printer context. always succeed */
+/** json_print_init initialize a printer context. always succeed.
+ * the output is buffered: the callback is given blocks of up to
+ * JSON_PRINTER_BUFFER_SIZE bytes, or more at once for long data, and the
+ * last of it only when json_print_flush or json_print_free is called */
 int json_print_init(json_printer *printer, json_printer_callback callback, void *userdata);
 
-/** json_print_free free a printer context
- * doesn't do anything now, but in future print_init could allocate memory */
+/** json_print_flush pass everything printed so far to the callback.
+ * return 0, or the first non zero value returned by the callback */
+int json_print_flush(json_printer *printer);
+
+/** json_print_free free a printer context, flushing it first
+ * doesn't free anything now, but in future print_init could allocate memory */
 int json_print_free(json_printer *printer);
 
-/** json_print_pretty pretty print the passed argument (type/data/length). */
+/** json_print_pretty pretty print the passed argument (type/data/length).
+ * return 0, or the first non zero value returned by the callback */
 int json_print_pretty(json_printer *printer, int type, const char *data, uint32_t length);
 
 /** json_print_raw prints without eye candy the passed argument (type/data/length). */
@@ -167,6 +285,10 @@ typedef void * (*json_parser_dom_create_structure)(int, int);
 /** callback from the parser_dom callback to create data values */
 typedef void * (*json_parser_dom_create_data)(int, const char *, uint32_t);
 
+/** optional callback from the parser_dom typed callback to create number values,
+ * number is NULL when it couldn't be computed */
+typedef void * (*json_parser_dom_create_number)(int, const char *, uint32_t, const json_number *);
+
 /** callback from the parser helper callback to append a value to an object or array value
  * append(parent, key, key_length, val); */
 typedef int (*json_parser_dom_append)(void *, char *, uint32_t, void *);
@@ -175,14 +297,21 @@ typedef int (*json_parser_dom_append)(void *, char *, uint32_t, void *);
  * use of 3 callbacks where the user can choose the representation of the JSON values */
 typedef struct json_parser_dom
 {
-	/* object stack */
-	struct stack_elem { void *val; char *key; uint32_t key_length; } *stack;
+	/* object stack. key_offset is where the key of the current member starts in the
+	 * key arena, has_key whether there is one */
+	struct stack_elem { void *val; uint32_t key_offset; uint32_t key_length; int has_key; } *stack;
 	uint32_t stack_size;
 	uint32_t stack_offset;
 
+	/* key arena, rewound as members and structures end */
+	char *keys;
+	uint32_t keys_size;
+	uint32_t keys_offset;
+
 	/* overridable memory allocator */
 	void * (*user_calloc)(size_t nmemb, size_t size);
 	void * (*user_realloc)(void *ptr, size_t size);
+	void (*user_free)(void *ptr);
 
 	/* returned root structure (object or array) */
 	void *root_structure;
@@ -190,6 +319,7 @@ typedef struct json_parser_dom
 	/* callbacks */
 	json_parser_dom_create_structure create_structure;
 	json_parser_dom_create_data create_data;
+	json_parser_dom_create_number create_number;
 	json_parser_dom_append append;
 } json_parser_dom;
 
@@ -201,7 +331,15 @@ int json_parser_dom_init(json_parser_dom *helper,
 /** free memory allocated by the DOM callback helper */
 int json_parser_dom_free(json_parser_dom *ctx);
 
+/** make the DOM helper ready for a new document, keeping its memory */
+int json_parser_dom_reset(json_parser_dom *ctx);
+
 /** helper to parser callback that arrange parsing events into comprehensive JSON data structure */
 int json_parser_dom_callback(void *userdata, int type, const char *data, uint32_t length);
 
+/** same as json_parser_dom_callback for a typed parser, numbers are created with
+ * create_number when set */
+int json_parser_dom_typed_callback(void *userdata, int type, const char *data, uint32_t length,
+                                   const json_number *number);
+
 #endif /* JSON_H */
@@ -0,0 +1,289 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * parsing of one big document on several threads, see json_parser_parallel.
+ * kept apart from json.c, so that the parser itself doesn't need pthreads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "json_parallel.h"
+
+/* parts smaller than this are not worth a thread */
+#define PARALLEL_MIN_PART	(256 * 1024)
+
+/* json_parser_string takes a 32 bits length */
+#define PARALLEL_MAX_FEED	(1U << 30)
+
+/* recorded event: type, flags, 32 bits length, then the data nul terminated,
+ * and the number, depending on the flags */
+#define EVENT_HEADER	(2 + sizeof(uint32_t))
+#define EVENT_DATA	0x01
+#define EVENT_NUMBER	0x02
+
+struct part {
+	const char *s;
+	size_t length;
+	int first;
+	int last;
+	json_config config;
+	int record;
+	char *events;
+	size_t events_size;
+	size_t events_offset;
+	int ret;
+	pthread_t thread;
+};
+
+static int is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int feed(json_parser *parser, const char *s, size_t length, size_t *processed)
+{
+	size_t offset = 0;
+	uint32_t done;
+	int ret = 0;
+
+	while (offset < length) {
+		uint32_t n = (length - offset > PARALLEL_MAX_FEED)
+			? PARALLEL_MAX_FEED : (uint32_t) (length - offset);
+		ret = json_parser_string(parser, s + offset, n, &done);
+		offset += done;
+		if (ret)
+			break;
+	}
+	if (processed)
+		*processed = offset;
+	return ret;
+}
+
+static int record_event(void *userdata, int type, const char *data, uint32_t length,
+                        const json_number *number)
+{
+	struct part *part = userdata;
+	size_t needed = EVENT_HEADER;
+	char *p;
+
+	if (data)
+		needed += length + 1;
+	if (number)
+		needed += sizeof(json_number);
+	if (part->events_offset + needed > part->events_size) {
+		size_t size = (part->events_size) ? part->events_size * 2 : 65536;
+		while (size < part->events_offset + needed)
+			size *= 2;
+		p = realloc(part->events, size);
+		if (!p)
+			return JSON_ERROR_NO_MEMORY;
+		part->events = p;
+		part->events_size = size;
+	}
+
+	p = part->events + part->events_offset;
+	p[0] = type;
+	p[1] = ((data) ? EVENT_DATA : 0) | ((number) ? EVENT_NUMBER : 0);
+	memcpy(p + 2, &length, sizeof(uint32_t));
+	p += EVENT_HEADER;
+	if (data) {
+		memcpy(p, data, length);
+		p[length] = '\0';
+		p += length + 1;
+	}
+	if (number)
+		memcpy(p, number, sizeof(json_number));
+	part->events_offset += needed;
+	return 0;
+}
+
+/* parse a part as an array of its own: the opening and closing brackets of the
+ * root, in the first and last parts, are given to the others. a part that is not
+ * complete then was split at the wrong place */
+static void *part_main(void *arg)
+{
+	struct part *part = arg;
+	json_parser parser;
+	int ret;
+
+	ret = json_parser_init_typed(&parser, &part->config,
+	                             (part->record) ? record_event : NULL, part);
+	if (ret) {
+		part->ret = ret;
+		return NULL;
+	}
+	if (!part->first)
+		ret = json_parser_string(&parser, "[", 1, NULL);
+	if (!ret)
+		ret = feed(&parser, part->s, part->length, NULL);
+	if (!ret && !part->last)
+		ret = json_parser_string(&parser, "]", 1, NULL);
+	if (!ret && !json_parser_is_done(&parser))
+		ret = -1;
+	part->ret = ret;
+	json_parser_free(&parser);
+	return NULL;
+}
+
+/* pass the events of a part to the callbacks of the parser, leaving out the
+ * brackets that were added around it */
+static int part_deliver(json_parser *parser, struct part *part)
+{
+	size_t offset = 0, next;
+	json_number number;
+	uint32_t length;
+	const char *p, *data;
+	int type, flags, first = 1;
+	int ret = 0;
+
+	while (offset < part->events_offset) {
+		p = part->events + offset;
+		type = p[0];
+		flags = p[1];
+		memcpy(&length, p + 2, sizeof(uint32_t));
+		next = offset + EVENT_HEADER;
+		data = NULL;
+		if (flags & EVENT_DATA) {
+			data = part->events + next;
+			next += length + 1;
+		}
+		if (flags & EVENT_NUMBER) {
+			memcpy(&number, part->events + next, sizeof(json_number));
+			next += sizeof(json_number);
+		}
+
+		if ((first && !part->first) || (next == part->events_offset && !part->last))
+			ret = 0;
+		else if (parser->typed_callback)
+			ret = (*parser->typed_callback)(parser->userdata, type, data, length,
+			                                (flags & EVENT_NUMBER) ? &number : NULL);
+		else
+			ret = (*parser->callback)(parser->userdata, type, data, length);
+		if (ret)
+			return ret;
+		first = 0;
+		offset = next;
+	}
+	return 0;
+}
+
+/* guess where an element of the root array ends, between from and end: a comma
+ * between a closing and an opening bracket. the guess is checked by parsing */
+static const char *find_split(const char *s, const char *from, const char *end)
+{
+	const char *p, *q;
+
+	for (p = memchr(from, ',', end - from); p; p = memchr(p + 1, ',', end - p - 1)) {
+		for (q = p - 1; q > s && is_space(*q); q--);
+		if (*q != '}' && *q != ']')
+			continue;
+		for (q = p + 1; q < end && is_space(*q); q++);
+		if (q < end && (*q == '{' || *q == '['))
+			return p;
+	}
+	return NULL;
+}
+
+/** json_parser_parallel parse a document held in memory on several threads */
+int json_parser_parallel(json_parser *parser, const char *s, size_t length,
+                         int nthreads, size_t *processed)
+{
+	json_parser_callback callback;
+	json_parser_typed_callback typed_callback;
+	struct part *parts;
+	const char *p, *split;
+	size_t step;
+	int nparts, i, ret = 0;
+
+	for (p = s; p < s + length && is_space(*p); p++);
+	if (length / PARALLEL_MIN_PART < (size_t) nthreads)
+		nthreads = length / PARALLEL_MIN_PART;
+	if (nthreads < 2 || p == s + length || *p != '[' || parser->pull)
+		return feed(parser, s, length, processed);
+
+	parts = calloc(nthreads, sizeof(*parts));
+	if (!parts)
+		return feed(parser, s, length, processed);
+
+	/* one part per thread, if the splits can be found */
+	step = length / nthreads;
+	nparts = 0;
+	p = s;
+	for (i = 1; i < nthreads; i++) {
+		const char *from = s + step * i;
+		const char *end = (i + 1 < nthreads) ? from + step : s + length;
+
+		if (from <= p)
+			continue;
+		split = find_split(s, from, end);
+		if (!split)
+			continue;
+		parts[nparts].s = p;
+		parts[nparts].length = split - p;
+		nparts++;
+		p = split + 1;
+	}
+	parts[nparts].s = p;
+	parts[nparts].length = s + length - p;
+	nparts++;
+
+	for (i = 0; i < nparts; i++) {
+		parts[i].first = (i == 0);
+		parts[i].last = (i == nparts - 1);
+		parts[i].config = parser->config;
+		parts[i].config.user_calloc = NULL;
+		parts[i].config.user_realloc = NULL;
+		parts[i].config.user_free = NULL;
+		parts[i].record = (parser->callback || parser->typed_callback);
+	}
+
+	/* the calling thread takes the first part, or any part a thread can't */
+	for (i = 1; i < nparts; i++)
+		if (pthread_create(&parts[i].thread, NULL, part_main, &parts[i]))
+			parts[i].thread = pthread_self();
+	part_main(&parts[0]);
+	for (i = 1; i < nparts; i++) {
+		if (pthread_equal(parts[i].thread, pthread_self()))
+			part_main(&parts[i]);
+		else
+			pthread_join(parts[i].thread, NULL);
+	}
+
+	for (i = 0; i < nparts; i++)
+		if (parts[i].ret)
+			break;
+	if (nparts == 1 || i < nparts) {
+		/* a wrong guess, or an error to report at the right place */
+		ret = feed(parser, s, length, processed);
+	} else {
+		for (i = 0; i < nparts && !ret; i++)
+			ret = part_deliver(parser, &parts[i]);
+
+		/* leave the parser as if it had parsed the document itself */
+		callback = parser->callback;
+		typed_callback = parser->typed_callback;
+		parser->callback = NULL;
+		parser->typed_callback = NULL;
+		if (!ret)
+			ret = json_parser_string(parser, "[]", 2, NULL);
+		parser->callback = callback;
+		parser->typed_callback = typed_callback;
+		if (processed)
+			*processed = length;
+	}
+
+	for (i = 0; i < nparts; i++)
+		free(parts[i].events);
+	free(parts);
+	return ret;
+}
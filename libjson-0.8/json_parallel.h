@@ -0,0 +1,37 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef JSON_PARALLEL_H
+#define JSON_PARALLEL_H
+
+#include "json.h"
+
+/** json_parser_parallel parse a whole document s of length bytes held in memory,
+ * on up to nthreads threads, making the same callbacks in the same order as
+ * json_parser_string would with the parser, which has to be freshly initialized
+ * (or reset) by json_parser_init or json_parser_init_typed.
+ *
+ * when the root is an array of objects or arrays, the document is split at commas
+ * that look like they separate its elements, and the parts are parsed at the same
+ * time, by parsers of their own that record their events. once every part turned
+ * out to be valid, the events are passed to the callbacks from the calling thread.
+ * if a split was guessed wrong or a part fails, the document is parsed again
+ * serially, so that errors are the ones json_parser_string would report.
+ *
+ * the parts allocate with malloc, not with the functions of the config, since they
+ * run in other threads. afterwards json_parser_is_done tells whether the document
+ * was complete, as it would after json_parser_string.
+ * return 0 if everything went ok, a JSON_ERROR_* otherwise. processed, if not NULL,
+ * is set to the number of bytes of s processed. */
+int json_parser_parallel(json_parser *parser, const char *s, size_t length,
+                         int nthreads, size_t *processed);
+
+#endif /* JSON_PARALLEL_H */
@@ -18,10 +18,21 @@
 #include <locale.h>
 #include <getopt.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "json.h"
+#include "json_parallel.h"
 
 char *indent_string = NULL;
+int use_pull = 0;
+int use_parallel = 0;
+int parallel_threads = 0;
 
 char *string_of_errors[] =
 {
@@ -39,12 +50,30 @@ char *string_of_errors[] =
 	[JSON_ERROR_CALLBACK] = "error in a callback"
 };
 
+/* allocation counters, per thread since the allocator hooks take no userdata */
+static __thread uint64_t alloc_count;
+static __thread uint64_t alloc_bytes;
+
+static void *counting_calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += nmemb * size;
+	return calloc(nmemb, size);
+}
+
+static void *counting_realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return realloc(ptr, size);
+}
+
 static int printchannel(void *userdata, const char *data, uint32_t length)
 {
 	FILE *channel = userdata;
-	int ret;
-	/* should check return value */
-	ret = fwrite(data, length, 1, channel);
+
+	if (length > 0 && fwrite(data, length, 1, channel) != 1)
+		return 1;
 	return 0;
 }
 
@@ -55,6 +84,31 @@ static int prettyprint(void *userdata, int type, const char *data, uint32_t leng
 	return json_print_pretty(printer, type, data, length);
 }
 
+/* print numbers from their typed value, to check the conversion */
+static int prettyprint_typed(void *userdata, int type, const char *data, uint32_t length,
+                             const json_number *number)
+{
+	json_printer *printer = userdata;
+	char buf[32];
+	int precision;
+
+	if (number && type == JSON_INT) {
+		snprintf(buf, sizeof(buf), "%" PRId64, number->int_value);
+		return json_print_pretty(printer, type, buf, strlen(buf));
+	}
+	if (number && type == JSON_FLOAT) {
+		/* shortest representation that reads back the same */
+		for (precision = 1; precision < 17; precision++) {
+			snprintf(buf, sizeof(buf), "%.*g", precision, number->float_value);
+			if (strtod(buf, NULL) == number->float_value)
+				break;
+		}
+		snprintf(buf, sizeof(buf), "%.*g", precision, number->float_value);
+		return json_print_pretty(printer, type, buf, strlen(buf));
+	}
+	return json_print_pretty(printer, type, data, length);
+}
+
 FILE *open_filename(const char *filename, const char *opt, int is_input)
 {
 	FILE *input;
@@ -81,7 +135,8 @@ int process_file(json_parser *parser, FILE *input, int *retlines, int *retcols)
 	char buffer[4096];
 	int ret = 0;
 	int32_t read;
-	int lines, col, i;
+	int lines, col;
+	uint32_t i;
 
 	lines = 1;
 	col = 0;
@@ -102,6 +157,71 @@ int process_file(json_parser *parser, FILE *input, int *retlines, int *retcols)
 	return ret;
 }
 
+/* same as process_file, pulling events from the parser and passing them to callback */
+int process_file_pull(json_parser *parser, FILE *input, int *retlines, int *retcols,
+                      json_parser_typed_callback callback, void *userdata)
+{
+	char buffer[4096];
+	int ret = 0;
+	int32_t read;
+	int lines, col;
+	uint32_t i;
+	json_event event;
+
+	lines = 1;
+	col = 0;
+	while (1) {
+		read = fread(buffer, 1, 4096, input);
+		if (read <= 0)
+			break;
+		json_parser_feed(parser, buffer, read);
+		do {
+			ret = json_parser_next(parser, &event);
+			if (!ret && event.type != JSON_NONE && callback)
+				ret = (*callback)(userdata, event.type, event.data, event.length,
+				                  event.number);
+		} while (!ret && event.type != JSON_NONE);
+		for (i = 0; i < parser->input_offset; i++) {
+			if (buffer[i] == '\n') { col = 0; lines++; } else col++;
+		}
+		if (ret)
+			break;
+	}
+	if (retlines) *retlines = lines;
+	if (retcols) *retcols = col;
+	return ret;
+}
+
+/* same as process_file, with the file mapped in memory and parsed on several threads */
+int process_file_parallel(json_parser *parser, FILE *input, int *retlines, int *retcols)
+{
+	struct stat st;
+	const char *data;
+	size_t processed, i;
+	int nthreads = parallel_threads;
+	int ret, lines, col;
+
+	if (fstat(fileno(input), &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return process_file(parser, input, retlines, retcols);
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(input), 0);
+	if (data == MAP_FAILED)
+		return process_file(parser, input, retlines, retcols);
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	ret = json_parser_parallel(parser, data, st.st_size, nthreads, &processed);
+
+	lines = 1;
+	col = 0;
+	for (i = 0; i < processed; i++) {
+		if (data[i] == '\n') { col = 0; lines++; } else col++;
+	}
+	munmap((void *) data, st.st_size);
+	if (retlines) *retlines = lines;
+	if (retcols) *retcols = col;
+	return ret;
+}
+
 static int do_verify(json_config *config, const char *filename)
 {
 	FILE *input;
@@ -113,13 +233,21 @@ static int do_verify(json_config *config, const char *filename)
 		return 2;
 
 	/* initialize the parser structure. we don't need a callback in verify */
-	ret = json_parser_init(&parser, config, NULL, NULL);
+	if (use_pull)
+		ret = json_parser_init_pull(&parser, config);
+	else
+		ret = json_parser_init(&parser, config, NULL, NULL);
 	if (ret) {
 		fprintf(stderr, "error: initializing parser failed (code=%d): %s\n", ret, string_of_errors[ret]);
 		return ret;
 	}
 
-	ret = process_file(&parser, input, NULL, NULL);
+	if (use_pull)
+		ret = process_file_pull(&parser, input, NULL, NULL, NULL, NULL);
+	else if (use_parallel)
+		ret = process_file_parallel(&parser, input, NULL, NULL);
+	else
+		ret = process_file(&parser, input, NULL, NULL);
 	if (ret)
 		return 1;
 
@@ -143,13 +271,21 @@ static int do_parse(json_config *config, const char *filename)
 		return 2;
 
 	/* initialize the parser structure. we don't need a callback in verify */
-	ret = json_parser_init(&parser, config, NULL, NULL);
+	if (use_pull)
+		ret = json_parser_init_pull(&parser, config);
+	else
+		ret = json_parser_init(&parser, config, NULL, NULL);
 	if (ret) {
 		fprintf(stderr, "error: initializing parser failed (code=%d): %s\n", ret, string_of_errors[ret]);
 		return ret;
 	}
 
-	ret = process_file(&parser, input, &lines, &col);
+	if (use_pull)
+		ret = process_file_pull(&parser, input, &lines, &col, NULL, NULL);
+	else if (use_parallel)
+		ret = process_file_parallel(&parser, input, &lines, &col);
+	else
+		ret = process_file(&parser, input, &lines, &col);
 	if (ret) {
 		fprintf(stderr, "line %d, col %d: [code=%d] %s\n",
 		        lines, col, ret, string_of_errors[ret]);
@@ -191,13 +327,26 @@ static int do_format(json_config *config, const char *filename, const char *outp
 	if (indent_string)
 		printer.indentstr = indent_string;
 
-	ret = json_parser_init(&parser, config, &prettyprint, &printer);
+	if (use_pull)
+		ret = json_parser_init_pull(&parser, config);
+	else if (config->typed_numbers)
+		ret = json_parser_init_typed(&parser, config, &prettyprint_typed, &printer);
+	else
+		ret = json_parser_init(&parser, config, &prettyprint, &printer);
 	if (ret) {
 		fprintf(stderr, "error: initializing parser failed: [code=%d] %s\n", ret, string_of_errors[ret]);
 		return ret;
 	}
 
-	ret = process_file(&parser, input, &lines, &col);
+	/* numbers only come with the event when typed_numbers is set */
+	if (use_pull)
+		ret = process_file_pull(&parser, input, &lines, &col, &prettyprint_typed, &printer);
+	else if (use_parallel)
+		ret = process_file_parallel(&parser, input, &lines, &col);
+	else
+		ret = process_file(&parser, input, &lines, &col);
+	/* what was printed before an error is still output */
+	json_print_flush(&printer);
 	if (ret) {
 		fprintf(stderr, "line %d, col %d: [code=%d] %s\n",
 		        lines, col, ret, string_of_errors[ret]);
@@ -237,7 +386,9 @@ typedef struct json_val {
 
 static void *tree_create_structure(int nesting, int is_object)
 {
-	json_val_t *v = malloc(sizeof(json_val_t));
+	json_val_t *v = counting_calloc(1, sizeof(json_val_t));
+
+	(void) nesting;
 	if (v) {
 		/* instead of defining a new enum type, we abuse the
 		 * meaning of the json enum type for array and object */
@@ -257,7 +408,7 @@ static char *memalloc_copy_length(const char *src, uint32_t n)
 {
 	char *dest;
 
-	dest = calloc(n + 1, sizeof(char));
+	dest = counting_calloc(n + 1, sizeof(char));
 	if (dest)
 		memcpy(dest, src, n);
 	return dest;
@@ -267,7 +418,7 @@ static void *tree_create_data(int type, const char *data, uint32_t length)
 {
 	json_val_t *v;
 
-	v = malloc(sizeof(json_val_t));
+	v = counting_calloc(1, sizeof(json_val_t));
 	if (v) {
 		v->type = type;
 		v->length = length;
@@ -287,20 +438,20 @@ static int tree_append(void *structure, char *key, uint32_t key_length, void *ob
 		struct json_val_elem *objelem;
 
 		if (parent->length == 0) {
-			parent->u.object = calloc(1 + 1, sizeof(json_val_t *)); /* +1 for null */
+			parent->u.object = counting_calloc(1 + 1, sizeof(json_val_t *)); /* +1 for null */
 			if (!parent->u.object)
 				return 1;
 		} else {
 			uint32_t newsize = parent->length + 1 + 1; /* +1 for null */
 			void *newptr;
 
-			newptr = realloc(parent->u.object, newsize * sizeof(json_val_t *));
+			newptr = counting_realloc(parent->u.object, newsize * sizeof(json_val_t *));
 			if (!newptr)
 				return -1;
 			parent->u.object = newptr;
 		}
 
-		objelem = malloc(sizeof(struct json_val_elem));
+		objelem = counting_calloc(1, sizeof(struct json_val_elem));
 		if (!objelem)
 			return -1;
 
@@ -311,14 +462,14 @@ static int tree_append(void *structure, char *key, uint32_t key_length, void *ob
 		parent->u.object[parent->length] = NULL;
 	} else {
 		if (parent->length == 0) {
-			parent->u.array = calloc(1 + 1, sizeof(json_val_t *)); /* +1 for null */
+			parent->u.array = counting_calloc(1 + 1, sizeof(json_val_t *)); /* +1 for null */
 			if (!parent->u.array)
 				return 1;
 		} else {
 			uint32_t newsize = parent->length + 1 + 1; /* +1 for null */
 			void *newptr;
 
-			newptr = realloc(parent->u.object, newsize * sizeof(json_val_t *));
+			newptr = counting_realloc(parent->u.object, newsize * sizeof(json_val_t *));
 			if (!newptr)
 				return -1;
 			parent->u.array = newptr;
@@ -432,6 +583,411 @@ static int print_tree(json_val_t *root_structure, char *outputfile)
 	return 0;
 }
 
+static void free_tree(json_val_t *element)
+{
+	int i;
+
+	if (!element)
+		return;
+	switch (element->type) {
+	case JSON_OBJECT_BEGIN:
+		for (i = 0; i < element->length; i++) {
+			free(element->u.object[i]->key);
+			free_tree(element->u.object[i]->val);
+			free(element->u.object[i]);
+		}
+		free(element->u.object);
+		break;
+	case JSON_ARRAY_BEGIN:
+		for (i = 0; i < element->length; i++)
+			free_tree(element->u.array[i]);
+		free(element->u.array);
+		break;
+	default:
+		free(element->u.data);
+		break;
+	}
+	free(element);
+}
+
+/*
+ * benchmark mode: parse memory-mapped files in several threads with no
+ * callback, a callback that only counts events, and the DOM helper,
+ * and report throughput and allocations for each.
+ */
+enum { BENCH_NONE, BENCH_COUNT, BENCH_DOM, NR_BENCH_MODES };
+
+static const char *bench_mode_names[NR_BENCH_MODES] = { "none", "count", "dom" };
+
+struct bench_file {
+	const char *filename;
+	const char *data;
+	size_t length;
+	uint64_t tokens;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	json_config *config;
+	struct bench_file *file;
+	int mode;
+	int repeat;
+	uint32_t chunk_size;
+	int ret;
+	uint64_t allocs;
+	uint64_t alloc_bytes;
+};
+
+static int count_callback(void *userdata, int type, const char *data, uint32_t length)
+{
+	(void) type;
+	(void) data;
+	(void) length;
+	(*(uint64_t *) userdata)++;
+	return 0;
+}
+
+/* parse the file repeat times, with one parser reset in between */
+static int bench_parse(json_config *cfg, struct bench_file *file, int mode,
+                       uint32_t chunk_size, uint64_t *tokens, int repeat)
+{
+	json_config config = *cfg;
+	json_parser parser;
+	json_parser_dom dom;
+	const char *s;
+	size_t left;
+	int ret, i;
+
+	config.user_calloc = counting_calloc;
+	config.user_realloc = counting_realloc;
+
+	switch (mode) {
+	case BENCH_NONE:
+		ret = json_parser_init(&parser, &config, NULL, NULL);
+		break;
+	case BENCH_COUNT:
+		ret = json_parser_init(&parser, &config, count_callback, tokens);
+		break;
+	default:
+		ret = json_parser_dom_init(&dom, tree_create_structure, tree_create_data, tree_append);
+		if (ret)
+			return ret;
+		dom.user_calloc = counting_calloc;
+		dom.user_realloc = counting_realloc;
+		ret = json_parser_init(&parser, &config, json_parser_dom_callback, &dom);
+		break;
+	}
+	if (ret)
+		return ret;
+
+	for (i = 0; i < repeat && !ret; i++) {
+		if (i > 0) {
+			json_parser_reset(&parser);
+			if (mode == BENCH_DOM)
+				json_parser_dom_reset(&dom);
+		}
+
+		s = file->data;
+		left = file->length;
+		while (left > 0 && !ret) {
+			uint32_t n = (left > UINT32_MAX) ? UINT32_MAX : left;
+
+			if (chunk_size > 0 && n > chunk_size)
+				n = chunk_size;
+			ret = json_parser_string(&parser, s, n, NULL);
+			s += n;
+			left -= n;
+		}
+		if (!ret && !json_parser_is_done(&parser))
+			ret = JSON_ERROR_UNEXPECTED_CHAR;
+		if (!ret && mode == BENCH_DOM)
+			free_tree(dom.root_structure);
+	}
+
+	json_parser_free(&parser);
+	if (mode == BENCH_DOM)
+		json_parser_dom_free(&dom);
+	return ret;
+}
+
+static void *bench_thread_main(void *arg)
+{
+	struct bench_thread *t = arg;
+	uint64_t tokens = 0;
+
+	alloc_count = alloc_bytes = 0;
+	t->ret = bench_parse(t->config, t->file, t->mode, t->chunk_size, &tokens, t->repeat);
+	t->allocs = alloc_count;
+	t->alloc_bytes = alloc_bytes;
+	return NULL;
+}
+
+static int bench_map(struct bench_file *file, const char *filename)
+{
+	struct stat st;
+	void *data;
+	int fd;
+	int flags = MAP_PRIVATE;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "error: cannot open %s: %s\n", filename, strerror(errno));
+		return 2;
+	}
+	if (st.st_size == 0) {
+		fprintf(stderr, "error: %s is empty\n", filename);
+		close(fd);
+		return 2;
+	}
+#ifdef MAP_POPULATE
+	/* keep page faults out of the measurements */
+	flags |= MAP_POPULATE;
+#endif
+	data = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "error: cannot map %s: %s\n", filename, strerror(errno));
+		return 2;
+	}
+	file->filename = filename;
+	file->data = data;
+	file->length = st.st_size;
+	file->tokens = 0;
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int do_bench(json_config *config, char **filenames, int nfiles,
+                    int nthreads, int repeat, int modes, uint32_t chunk_size)
+{
+	struct bench_file *files;
+	struct bench_thread *threads;
+	json_parser parser;
+	int i, mode, ret = 0;
+
+	files = calloc(nfiles, sizeof(*files));
+	if (nthreads <= 0)
+		nthreads = nfiles;
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!files || !threads)
+		return 2;
+
+	for (i = 0; i < nfiles; i++) {
+		ret = bench_map(&files[i], filenames[i]);
+		if (ret)
+			return ret;
+		/* count events once up front, for tokens/s of every mode */
+		ret = bench_parse(config, &files[i], BENCH_COUNT, 0, &files[i].tokens, 1);
+		if (ret) {
+			fprintf(stderr, "%s: [code=%d] %s\n", filenames[i], ret,
+			        (ret < (int) (sizeof(string_of_errors) / sizeof(char *)))
+			        ? string_of_errors[ret] : "syntax error");
+			return 1;
+		}
+	}
+
+	if (json_parser_init(&parser, config, NULL, NULL))
+		return 2;
+	printf("engine: %s\n", json_parser_engine(&parser));
+	json_parser_free(&parser);
+
+	printf("%-6s %7s %10s %9s %9s %12s %12s %10s\n",
+	       "mode", "threads", "MB", "seconds", "MB/s", "tokens/s", "allocs", "alloc MB");
+	for (mode = 0; mode < NR_BENCH_MODES; mode++) {
+		uint64_t bytes = 0, tokens = 0, allocs = 0, abytes = 0;
+		double start, elapsed;
+
+		if (!(modes & (1 << mode)))
+			continue;
+
+		/* one file per thread, wrapping around if there are more threads */
+		start = now();
+		for (i = 0; i < nthreads; i++) {
+			struct bench_thread *t = &threads[i];
+
+			memset(t, 0, sizeof(*t));
+			t->config = config;
+			t->file = &files[i % nfiles];
+			t->mode = mode;
+			t->repeat = repeat;
+			t->chunk_size = chunk_size;
+			if (pthread_create(&t->thread, NULL, bench_thread_main, t)) {
+				fprintf(stderr, "error: cannot create thread\n");
+				return 2;
+			}
+		}
+		for (i = 0; i < nthreads; i++) {
+			struct bench_thread *t = &threads[i];
+
+			pthread_join(t->thread, NULL);
+			if (t->ret) {
+				fprintf(stderr, "%s: [code=%d] parse failed in %s mode\n",
+				        t->file->filename, t->ret, bench_mode_names[mode]);
+				ret = 1;
+			}
+			bytes += (uint64_t) t->file->length * repeat;
+			tokens += t->file->tokens * repeat;
+			allocs += t->allocs;
+			abytes += t->alloc_bytes;
+		}
+		elapsed = now() - start;
+
+		printf("%-6s %7d %10.1f %9.3f %9.1f %12.0f %12llu %10.1f\n",
+		       bench_mode_names[mode], nthreads, bytes / 1048576.0, elapsed,
+		       bytes / 1048576.0 / elapsed, tokens / elapsed,
+		       (unsigned long long) allocs, abytes / 1048576.0);
+	}
+
+	for (i = 0; i < nfiles; i++)
+		munmap((void *) files[i].data, files[i].length);
+	free(files);
+	free(threads);
+	return ret;
+}
+
+/*
+ * synthetic corpora for the benchmark mode, deterministic so that runs
+ * can be compared.
+ */
+#define GENERATE_NESTING_DEPTH 2000
+
+/* worst cases: length of the strings of long-strings and escape-runs */
+#define GENERATE_LONG_STRING (4 * 1048576)
+#define GENERATE_ESCAPE_RUN 65536
+
+static uint32_t generate_seed = 1;
+
+static uint32_t generate_random(void)
+{
+	generate_seed = generate_seed * 1103515245 + 12345;
+	return (generate_seed >> 16) & 0x7fff;
+}
+
+static long generate_item(FILE *output, const char *kind, long seq)
+{
+	static const char *words[] = {
+		"postgres", "json", "parser", "tweet", "index", "scan", "latency", "cache"
+	};
+	long n = 0;
+	int i;
+
+	if (strcmp(kind, "tweets") == 0 || strcmp(kind, "archive") == 0) {
+		n += fprintf(output,
+			"{\"text\":\"@user%u %s %s %s http:\\/\\/t.co\\/%lx\","
+			"\"to_user_id\":%s,\"to_user\":\"user%u\",\"from_user\":\"user%u\","
+			"\"metadata\":{\"result_type\":\"recent\",\"recent_retweets\":%u},"
+			"\"id\":%ld,\"from_user_id\":%u,\"iso_language_code\":\"en\","
+			"\"source\":\"&lt;a href=&quot;http:\\/\\/twitter.com\\/&quot;&gt;web&lt;\\/a&gt;\","
+			"\"profile_image_url\":\"http:\\/\\/a0.twimg.com\\/profile_images\\/%u\\/normal.jpg\","
+			"\"created_at\":\"Wed, 08 Apr 2009 19:%02u:%02u +0000\"}",
+			generate_random() % 1000, words[generate_random() % 8],
+			words[generate_random() % 8], words[generate_random() % 8], seq,
+			(seq % 3) ? "null" : "396524", generate_random() % 1000,
+			generate_random() % 1000, generate_random() % 200,
+			1478555574L + seq, 1833773 + generate_random(), generate_random(),
+			generate_random() % 60, generate_random() % 60);
+	} else if (strcmp(kind, "nesting") == 0) {
+		for (i = 0; i < GENERATE_NESTING_DEPTH; i++)
+			n += fprintf(output, (i % 2) ? "{\"k\":" : "[");
+		n += fprintf(output, "%ld", seq);
+		for (i = GENERATE_NESTING_DEPTH - 1; i >= 0; i--)
+			n += fprintf(output, (i % 2) ? "}" : "]");
+	} else if (strcmp(kind, "escapes") == 0) {
+		n += fprintf(output,
+			"\"line\\nbreak \\\"quoted %ld\\\" back\\\\slash\\ttab \\/path\\/to "
+			"caf\\u00e9 \\u4e2d\\u6587 \\ud83d\\ude00 \\u0000\\u001f\\r\\b\\f\"", seq);
+	} else if (strcmp(kind, "long-strings") == 0) {
+		n += fprintf(output, "\"");
+		for (i = 0; n < GENERATE_LONG_STRING; i++)
+			n += fprintf(output, "%s ", words[(seq + i) % 8]);
+		n += fprintf(output, "\"");
+	} else if (strcmp(kind, "escape-runs") == 0) {
+		static const char *escapes[] = {
+			"\\n", "\\\"", "\\\\", "\\u00e9", "\\t", "\\/", "\\ud83d\\ude00", "\\u0000"
+		};
+		n += fprintf(output, "\"");
+		for (i = 0; n < GENERATE_ESCAPE_RUN; i++)
+			n += fprintf(output, "%s", escapes[(seq + i) % 8]);
+		n += fprintf(output, "\"");
+	} else if (strcmp(kind, "numbers") == 0) {
+		n += fprintf(output, "[%ld,-%u,%u%09u,%u.%03u,-0.%u,%ue%d,%u.%uE-%u,9223372036854775807]",
+			seq, generate_random(), generate_random() + 1, generate_random(),
+			generate_random(), generate_random() % 1000, generate_random(),
+			generate_random() + 1, (int) (generate_random() % 20), generate_random(),
+			generate_random(), generate_random() % 300);
+	}
+	return n;
+}
+
+static int do_generate(const char *kind, long size_mb, const char *outputfile)
+{
+	FILE *output;
+	long written = 0, seq = 0;
+	long target = size_mb * 1048576L;
+	int tweets;
+
+	if (strcmp(kind, "tweets") && strcmp(kind, "archive") && strcmp(kind, "nesting") &&
+	    strcmp(kind, "escapes") && strcmp(kind, "numbers") && strcmp(kind, "deep") &&
+	    strcmp(kind, "long-strings") && strcmp(kind, "escape-runs")) {
+		fprintf(stderr, "error: unknown corpus %s (tweets, archive, nesting, escapes, numbers,"
+		        " deep, long-strings or escape-runs)\n", kind);
+		return 2;
+	}
+
+	output = open_filename(outputfile, "w", 0);
+	if (!output)
+		return 2;
+
+	/* a single array nested as deep as the size allows */
+	if (strcmp(kind, "deep") == 0) {
+		for (seq = 0; seq < target / 2; seq++)
+			fputc('[', output);
+		for (seq = 0; seq < target / 2; seq++)
+			fputc(']', output);
+		fputc('\n', output);
+		close_filename(outputfile, output);
+		return 0;
+	}
+
+	tweets = (strcmp(kind, "tweets") == 0);
+	written += fprintf(output, tweets ? "{\"results\":[" : "[");
+	while (written < target) {
+		if (seq > 0)
+			written += fprintf(output, ",\n");
+		written += generate_item(output, kind, seq++);
+	}
+	if (tweets)
+		fprintf(output, "],\"completed_in\":0.031704,\"page\":1,\"query\":\"bench\"}\n");
+	else
+		fprintf(output, "]\n");
+
+	close_filename(outputfile, output);
+	return 0;
+}
+
+/* a limit of the parser config, 0 meaning none; anything else that is not a
+ * number of the config's range is an error */
+static uint32_t parse_limit(const char *name, const char *arg)
+{
+	char *end;
+	long long value;
+
+	errno = 0;
+	value = strtoll(arg, &end, 10);
+	if (errno || end == arg || *end || value < 0 || value > UINT32_MAX) {
+		fprintf(stderr, "error: invalid %s %s\n", name, arg);
+		exit(2);
+	}
+	return value;
+}
+
 int usage(const char *argv0)
 {
 	printf("usage: %s [options] JSON-FILE(s)...\n", argv0);
@@ -444,13 +1000,32 @@ int usage(const char *argv0)
 	printf("\t--max-data : limit the number of characters of data (string/int/float) (default to no limit)\n");
 	printf("\t--indent-string : set the string to use for indenting one level (default to 1 tab)\n");
 	printf("\t--tree : build a tree (DOM)\n");
+	printf("\t--zero-copy : pass unescaped data to callbacks in place, without copying it\n");
+	printf("\t--typed-numbers : format numbers from their computed value, where exact\n");
+	printf("\t--engine : auto, scalar or simd parsing engine (default to auto)\n");
+	printf("\t--pull : pull events from the parser one by one instead of taking callbacks\n");
+	printf("\t--parallel : map the json file in memory and parse its root array on several threads\n");
+	printf("\t--bench : measure parsing throughput of the json files, mapped in memory\n");
+	printf("\t--bench-mode : none, count, dom or all callbacks to benchmark (default to all)\n");
+	printf("\t--threads : number of benchmark threads, one file each (default to one per file),\n"
+	       "\t            or of parallel threads (default to one per cpu)\n");
+	printf("\t--repeat : number of times each thread parses its file (default to 1)\n");
+	printf("\t--chunk-size : feed the parser chunks of this size in bench mode (default to whole file)\n");
+	printf("\t--generate : write a synthetic corpus: tweets, archive (an array of tweets),\n"
+	       "\t             nesting, escapes or numbers, or a worst case: deep (one array\n"
+	       "\t             nested all the way), long-strings or escape-runs\n");
+	printf("\t--size : size of the generated corpus in MB (default to 64)\n");
 	printf("\t-o : output to a specific file instead of stdout\n");
 	exit(0);
 }
 
 int main(int argc, char **argv)
 {
-	int format = 0, verify = 0, use_tree = 0;
+	int format = 0, verify = 0, use_tree = 0, bench = 0;
+	int bench_modes = (1 << NR_BENCH_MODES) - 1, threads = 0, repeat = 1;
+	uint32_t chunk_size = 0;
+	char *generate = NULL;
+	long size_mb = 64;
 	int ret = 0, i;
 	json_config config;
 	char *output = "-";
@@ -474,6 +1049,18 @@ int main(int argc, char **argv)
 			{ "max-data", 1, 0, 0 },
 			{ "indent-string", 1, 0, 0 },
 			{ "tree", 0, 0, 0 },
+			{ "zero-copy", 0, 0, 0 },
+			{ "typed-numbers", 0, 0, 0 },
+			{ "engine", 1, 0, 0 },
+			{ "pull", 0, 0, 0 },
+			{ "parallel", 0, 0, 0 },
+			{ "bench", 0, 0, 0 },
+			{ "bench-mode", 1, 0, 0 },
+			{ "threads", 1, 0, 0 },
+			{ "repeat", 1, 0, 0 },
+			{ "chunk-size", 1, 0, 0 },
+			{ "generate", 1, 0, 0 },
+			{ "size", 1, 0, 0 },
 			{ 0 },
 		};
 		int c = getopt_long(argc, argv, "o:", long_options, &option_index);
@@ -495,13 +1082,57 @@ int main(int argc, char **argv)
 			else if (strcmp(name, "verify") == 0)
 				verify = 1;
 			else if (strcmp(name, "max-nesting") == 0)
-				config.max_nesting = atoi(optarg);
+				config.max_nesting = parse_limit(name, optarg);
 			else if (strcmp(name, "max-data") == 0)
-				config.max_data = atoi(optarg);
+				config.max_data = parse_limit(name, optarg);
 			else if (strcmp(name, "indent-string") == 0)
 				indent_string = strdup(optarg);
 			else if (strcmp(name, "tree") == 0)
 				use_tree = 1;
+			else if (strcmp(name, "zero-copy") == 0)
+				config.zero_copy = 1;
+			else if (strcmp(name, "typed-numbers") == 0)
+				config.typed_numbers = 1;
+			else if (strcmp(name, "pull") == 0)
+				use_pull = 1;
+			else if (strcmp(name, "parallel") == 0)
+				use_parallel = 1;
+			else if (strcmp(name, "engine") == 0) {
+				if (strcmp(optarg, "auto") == 0)
+					config.engine = JSON_ENGINE_AUTO;
+				else if (strcmp(optarg, "scalar") == 0)
+					config.engine = JSON_ENGINE_SCALAR;
+				else if (strcmp(optarg, "simd") == 0)
+					config.engine = JSON_ENGINE_SIMD;
+				else {
+					fprintf(stderr, "error: unknown engine %s\n", optarg);
+					exit(2);
+				}
+			}
+			else if (strcmp(name, "bench") == 0)
+				bench = 1;
+			else if (strcmp(name, "bench-mode") == 0) {
+				int mode;
+				bench_modes = 0;
+				for (mode = 0; mode < NR_BENCH_MODES; mode++)
+					if (strcmp(optarg, bench_mode_names[mode]) == 0)
+						bench_modes = 1 << mode;
+				if (strcmp(optarg, "all") == 0)
+					bench_modes = (1 << NR_BENCH_MODES) - 1;
+				if (!bench_modes) {
+					fprintf(stderr, "error: unknown bench mode %s\n", optarg);
+					exit(2);
+				}
+			} else if (strcmp(name, "threads") == 0)
+				threads = atoi(optarg);
+			else if (strcmp(name, "repeat") == 0)
+				repeat = atoi(optarg);
+			else if (strcmp(name, "chunk-size") == 0)
+				chunk_size = atoi(optarg);
+			else if (strcmp(name, "generate") == 0)
+				generate = strdup(optarg);
+			else if (strcmp(name, "size") == 0)
+				size_mb = atol(optarg);
 			break;
 			}
 		case 'o':
@@ -511,12 +1142,16 @@ int main(int argc, char **argv)
 			break;
 		}
 	}
-	if (config.max_nesting < 0)
-		config.max_nesting = 0;
 	if (!output)
 		output = "-";
+	parallel_threads = threads;
+	if (generate)
+		return do_generate(generate, size_mb, output);
 	if (optind >= argc)
 		usage(argv[0]);
+	if (bench)
+		return do_bench(&config, argv + optind, argc - optind, threads,
+		                (repeat > 0) ? repeat : 1, bench_modes, chunk_size);
 
 	for (i = optind; i < argc; i++) {
 		if (use_tree) {
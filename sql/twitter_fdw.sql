@@ -1,8 +1,25 @@
 CREATE EXTENSION twitter_fdw;
 
+-- options
+ALTER SERVER twitter_service OPTIONS (endpoint 'ftp://localhost/search.json');
+ALTER SERVER twitter_service OPTIONS (lookup_endpoint 'ftp://localhost/lookup.json');
+ALTER SERVER twitter_service OPTIONS (nosuch 'x');
+ALTER FOREIGN TABLE twitter OPTIONS (endpoint 'http://localhost/search.json');
+ALTER SERVER twitter_service OPTIONS (max_nesting '-1');
+ALTER SERVER twitter_service OPTIONS (max_response_size '1MB', max_token_size '64kB');
+ALTER SERVER twitter_service OPTIONS (DROP max_response_size, DROP max_token_size);
+
+-- responses come from the replay server of the benchmarks, so that they
+-- are always the same
+\! python3 bench/replay_server.py --port 18931 --daemon --idle-timeout 30 > /dev/null 2>&1
+ALTER SERVER twitter_service OPTIONS (
+	endpoint 'http://127.0.0.1:18931/search.json',
+	lookup_endpoint 'http://127.0.0.1:18931/lookup.json');
+
 SELECT count(*) FROM twitter;
 
 SELECT count(*) FROM twitter WHERE q = '#postgresql';
+SELECT count(*) FROM twitter WHERE q = 'xlarge-a';
 
 CREATE TEMP TABLE twtest (id int, from_user text);
 INSERT INTO twtest(from_user)
@@ -10,3 +27,78 @@ INSERT INTO twtest(from_user)
 SELECT true FROM twtest INNER JOIN
 	twitter USING(from_user) WHERE q = '#postgres';
 
+
+-- search terms from patterns, rechecked locally
+EXPLAIN (COSTS OFF) SELECT id FROM twitter
+	WHERE q = '#postgresql' AND text LIKE '%foreign data wrapper%';
+EXPLAIN (COSTS OFF) SELECT id FROM twitter
+	WHERE text ~* '\mfdw\M' AND text LIKE '%postgres%';
+EXPLAIN (COSTS OFF) SELECT id FROM twitter
+	WHERE to_tsvector('simple', text) @@ to_tsquery('simple', 'fdw & (postgres | mysql)');
+
+-- alternatives of q, searched for at once
+EXPLAIN (COSTS OFF) SELECT id FROM twitter
+	WHERE q = '#postgresql' OR q = '#mysql';
+EXPLAIN (COSTS OFF) SELECT id FROM twitter
+	WHERE q IN ('#postgresql', '#mysql') AND (text LIKE '% fdw %' OR text ~* '\mwrapper\M');
+-- or one at a time when they cannot be
+EXPLAIN (COSTS OFF) SELECT id FROM twitter
+	WHERE q = 'foreign data' OR q = 'wrapper';
+
+-- conditions on text fields, checked before rows are formed
+EXPLAIN (COSTS OFF) SELECT id FROM twitter
+	WHERE iso_language_code = 'en' AND text ILIKE '%outage%';
+
+-- values of q from a join, searched for row by row
+EXPLAIN (COSTS OFF) SELECT t.id FROM (VALUES ('#postgresql'), ('#mysql')) v(tag)
+	JOIN twitter t ON t.q = v.tag;
+-- outer join clauses stay as written
+EXPLAIN (COSTS OFF) SELECT t.id FROM (VALUES ('#postgresql'), ('#mysql')) v(tag)
+	LEFT JOIN twitter t ON v.tag = t.q;
+SELECT v.tag, count(t.id) FROM (VALUES ('small-a'), ('medium-b')) v(tag)
+	LEFT JOIN twitter t ON v.tag = t.q GROUP BY v.tag ORDER BY v.tag;
+
+-- rows kept for values of q that come back
+SET twitter_fdw.rescan_cache = 4;
+SELECT v, n FROM (VALUES ('small-a'), ('medium-b'), ('small-a')) x(v),
+	LATERAL (SELECT count(*) FROM twitter WHERE q = v) s(n);
+RESET twitter_fdw.rescan_cache;
+
+-- columns taken from a json_path
+ALTER FOREIGN TABLE twitter ALTER COLUMN text OPTIONS (json_path 'metadata..result_type');
+CREATE FOREIGN TABLE twitter_paths (
+	id bigint,
+	text text OPTIONS (json_path 'metadata.result_type'),
+	result_type text OPTIONS (json_path 'metadata.result_type'),
+	q text
+) SERVER twitter_service;
+EXPLAIN (COSTS OFF) SELECT id FROM twitter_paths
+	WHERE q = '#postgresql' AND text LIKE '% fdw %';
+SELECT count(result_type) FROM twitter_paths WHERE q = '#postgresql';
+DROP FOREIGN TABLE twitter_paths;
+
+-- the whole tweet as jsonb, built only when read
+CREATE FOREIGN TABLE twitter_raw (id bigint, raw jsonb, q text) SERVER twitter_service;
+SELECT count(*) FROM twitter_raw WHERE q = '#postgresql' AND raw->>'id' = id::text;
+DROP FOREIGN TABLE twitter_raw;
+
+-- tweets looked up by id rather than searched for
+EXPLAIN (COSTS OFF) SELECT text FROM twitter WHERE id = 1478555574;
+EXPLAIN (COSTS OFF) SELECT text FROM twitter
+	WHERE id IN (1478555574, 1478555575) AND iso_language_code = 'en';
+EXPLAIN (COSTS OFF) SELECT t.text FROM (VALUES (1478555574), (1478555575)) v(id)
+	JOIN twitter t ON t.id = v.id;
+-- int4 = int8 with the column on the right, as outer joins leave it
+EXPLAIN (COSTS OFF) SELECT v.id, t.id IS NOT NULL AS found FROM (VALUES (1478555574), (1478555575), (1)) v(id)
+	LEFT JOIN twitter t ON v.id = t.id ORDER BY v.id;
+SELECT v.id, t.id IS NOT NULL AS found FROM (VALUES (1478555574), (1478555575), (1)) v(id)
+	LEFT JOIN twitter t ON v.id = t.id ORDER BY v.id;
+EXPLAIN (COSTS OFF) SELECT text FROM twitter
+	WHERE q = '#postgresql' AND id = 1478555574;
+
+-- export
+SELECT twitter_fdw_export('twitter', '#postgresql', 'xml');
+SELECT twitter_fdw_export('pg_class', '#postgresql');
+SELECT count(*) FROM twitter_fdw_export('twitter', '#postgresql', 'ndjson');
+SELECT jsonb_array_length(string_agg(e, E'\n')::jsonb)
+	FROM twitter_fdw_export('twitter', '#postgresql') e;
@@ -0,0 +1,93 @@
+/* contrib/twitter_fdw/twitter_fdw--1.2.0.sql */
+
+-- create wrapper with validator and handler
+CREATE OR REPLACE FUNCTION twitter_fdw_validator (text[], oid)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION twitter_fdw_handler ()
+RETURNS fdw_handler
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FOREIGN DATA WRAPPER twitter_fdw
+VALIDATOR twitter_fdw_validator HANDLER twitter_fdw_handler;
+
+CREATE SERVER twitter_service FOREIGN DATA WRAPPER twitter_fdw;
+
+CREATE USER MAPPING FOR current_user SERVER twitter_service;
+
+CREATE FOREIGN TABLE twitter(
+  id bigint,
+  text text,
+  from_user text,
+  from_user_id bigint,
+  to_user text,
+  to_user_id bigint,
+  iso_language_code text,
+  source text,
+  profile_image_url text,
+  created_at timestamp,
+  
+  -- virtual columns for parameters
+  q text
+) SERVER twitter_service;
+
+-- cumulative statistics, available when preloaded
+CREATE FUNCTION twitter_fdw_stats(
+    IN per_server bool,
+    OUT dbid oid,
+    OUT serverid oid,
+    OUT query text,
+    OUT requests int8,
+    OUT failures int8,
+    OUT http_4xx int8,
+    OUT http_5xx int8,
+    OUT transport_errors int8,
+    OUT throttled int8,
+    OUT bytes int8,
+    OUT rows int8,
+    OUT cache_hits int8,
+    OUT cache_misses int8,
+    OUT total_time float8,
+    OUT mean_time float8,
+    OUT p50_time float8,
+    OUT p95_time float8,
+    OUT p99_time float8,
+    OUT max_time float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION twitter_fdw_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+-- tweets of a search through a foreign table, as JSON text with one row
+-- per tweet: 'array' rows make up an array, 'ndjson' rows are objects
+CREATE FUNCTION twitter_fdw_export(
+    ftable regclass,
+    q text,
+    format text DEFAULT 'array'
+)
+RETURNS SETOF text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE VIEW pg_stat_twitter_fdw AS
+  SELECT * FROM twitter_fdw_stats(false);
+
+CREATE VIEW pg_stat_twitter_fdw_servers AS
+  SELECT dbid, serverid, requests, failures, http_4xx, http_5xx,
+         transport_errors, throttled, bytes, rows, cache_hits, cache_misses,
+         total_time, mean_time, p50_time, p95_time, p99_time, max_time
+    FROM twitter_fdw_stats(true);
+
+GRANT SELECT ON pg_stat_twitter_fdw TO PUBLIC;
+GRANT SELECT ON pg_stat_twitter_fdw_servers TO PUBLIC;
+
+-- don't want this to be available to non-superusers
+REVOKE ALL ON FUNCTION twitter_fdw_stats_reset() FROM PUBLIC;
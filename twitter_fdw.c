@@ -1,24 +1,64 @@
 #include "postgres.h"
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "access/reloptions.h"
+#include "access/sysattr.h"
+#include "catalog/pg_attribute.h"
+#include "catalog/pg_collation.h"
 #include "catalog/pg_foreign_table.h"
 #include "catalog/pg_foreign_server.h"
+#include "catalog/pg_type.h"
 #include "commands/defrem.h"
 #include "commands/explain.h"
+#include "executor/executor.h"
 #include "foreign/fdwapi.h"
 #include "foreign/foreign.h"
 #include "funcapi.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/clauses.h"
 #include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
 #include "optimizer/planmain.h"
 #include "optimizer/restrictinfo.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/relation.h"
+#include "access/table.h"
+#include "optimizer/optimizer.h"
+#else
+#include "optimizer/var.h"
+#endif
 #include "parser/parsetree.h"
+#include "portability/instr_time.h"
 #include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "tsearch/ts_type.h"
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/datetime.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/rel.h"
+#include "utils/resowner.h"
+#include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 90400
+#include "utils/jsonb.h"
+#endif
+#if PG_VERSION_NUM >= 100000
+#include "pgstat.h"
+#include "storage/condition_variable.h"
+#endif
 
 #include "curl/curl.h"
 #include "libjson-0.8/json.h"
@@ -57,8 +97,67 @@ PG_MODULE_MAGIC;
  */
 
 #define SEARCH_ENDPOINT "http://search.twitter.com/search.json"
+#define LOOKUP_ENDPOINT "http://api.twitter.com/1/statuses/lookup.json"
+
+/*
+ * Describes the valid options for objects that use this wrapper.
+ */
+struct TwitterFdwOption
+{
+	const char *optname;
+	Oid			optcontext;		/* Oid of catalog in which option may appear */
+};
+
+static struct TwitterFdwOption valid_options[] = {
+	/* search API URL, to go through a proxy or a replay server */
+	{"endpoint", ForeignServerRelationId},
+	/* and that of the lookup of tweets by id */
+	{"lookup_endpoint", ForeignServerRelationId},
+
+	/* limits on responses, overriding the twitter_fdw.max_* GUCs */
+	{"max_response_size", ForeignServerRelationId},
+	{"max_token_size", ForeignServerRelationId},
+	{"max_nesting", ForeignServerRelationId},
+
+	/* where in each tweet a column takes its value from */
+	{"json_path", AttributeRelationId},
+
+	/* Sentinel */
+	{NULL, InvalidOid}
+};
 
 #define PROCID_TEXTEQ 67
+#define PROCID_INT8EQ 467
+#define PROCID_INT84EQ 474
+#define PROCID_INT82EQ 1856
+#define PROCID_INT48EQ 852
+#define PROCID_INT28EQ 1850
+#define PROCID_TEXTLIKE 850
+#define PROCID_TEXTICLIKE 1633
+#define PROCID_TEXTREGEXEQ 1254
+#define PROCID_TEXTICREGEXEQ 1238
+#define PROCID_TS_MATCH_VQ 3634
+#define PROCID_TS_MATCH_QV 3635
+#define PROCID_TO_TSVECTOR_BYID 3745
+#define TSCONFIG_SIMPLE 3748
+
+/* the search API refuses longer queries */
+#define SEARCH_QUERY_MAX 1000
+
+/*
+ * Planner costs of a request: a search, or a lookup by id.  A join on q
+ * or id makes one per outer row, so past about JOIN_MAX_REQUESTS outer
+ * rows, what the API allowed in a rate limit window, a single search
+ * without q costs less.
+ */
+#define SEARCH_COST 1000.0
+#define LOOKUP_COST 100.0
+#define JOIN_MAX_REQUESTS 180
+
+/* letters and digits make up the words the search API matches */
+#define WORD_CHAR(c) \
+	(('0' <= (c) && (c) <= '9') || ('A' <= (c) && (c) <= 'Z') || \
+	 ('a' <= (c) && (c) <= 'z'))
 
 #if PG_VERSION_NUM < 90200
 #define OLD_FDW_API
@@ -66,6 +165,41 @@ PG_MODULE_MAGIC;
 #undef OLD_FDW_API
 #endif
 
+#if PG_VERSION_NUM < 90500
+#define MyLatch (&MyProc->procLatch)
+#endif
+
+#ifndef TupleDescAttr
+#define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
+#endif
+
+#if PG_VERSION_NUM >= 110000
+/* EXPLAIN properties take a unit since 11 */
+#define ExplainPropertyLong(qlabel, value, es) \
+	ExplainPropertyInteger(qlabel, NULL, value, es)
+#define ExplainPropertyFloat(qlabel, value, ndigits, es) \
+	(ExplainPropertyFloat)(qlabel, NULL, value, ndigits, es)
+#endif
+
+#if PG_VERSION_NUM >= 120000
+#define ExecStoreTuple(tuple, slot, buffer, shouldFree) \
+	ExecStoreHeapTuple(tuple, slot, shouldFree)
+#endif
+
+#if PG_VERSION_NUM >= 140000
+/* only placeholders need the planner info, which we do not look into */
+#define pull_varnos(node) pull_varnos(NULL, node)
+#endif
+
+#if PG_VERSION_NUM < 90200
+/* 9.1 latches know no wake events, fetch_wait() just polls there */
+#define WL_LATCH_SET			(1 << 0)
+#define WL_SOCKET_READABLE		(1 << 1)
+#define WL_SOCKET_WRITEABLE		(1 << 2)
+#define WL_TIMEOUT				(1 << 3)
+#define WL_POSTMASTER_DEATH		(1 << 4)
+#endif
+
 /*
  * The index of each item in fdw_private.
  * Since it needs to be stored as List, we keep all pointers
@@ -76,11 +210,26 @@ enum
 	FDW_PRIVATE_URL = 0,
 	FDW_PRIVATE_CLAUSES,
 	FDW_PRIVATE_PARAM_Q,
+	FDW_PRIVATE_ENDPOINT,
+	FDW_PRIVATE_TERMS,
+	FDW_PRIVATE_Q_ARRAY,
+	FDW_PRIVATE_PREFILTERS,
+	FDW_PRIVATE_PATHS,
+	FDW_PRIVATE_RAW,
+	FDW_PRIVATE_LOOKUP,
 	FDW_PRIVATE_LAST
 };
 
 /*
- * Currently, only PUSHDOWN and FILTER_LOCALLY are effective
+ * Paths carry after these the expression of a q known only at run time,
+ * which the plan moves to fdw_exprs for the executor to evaluate.
+ */
+#define FDW_PATH_Q_EXPR FDW_PRIVATE_LAST
+
+/*
+ * How each restriction clause is handled: sent to the API only, kept for
+ * local evaluation only, or both sent as narrowing search terms and
+ * rechecked locally, since the API matches words and not patterns.
  */
 enum
 {
@@ -92,38 +241,429 @@ enum
 typedef struct ResultRoot
 {
 	struct ResultArray	   *results;
+	char				   *completed_in;
 } ResultRoot;
 
 typedef struct ResultArray
 {
 	int					index;
-	struct Tweet	   *elements[512];
+	int					size;		/* allocated length of elements */
+	struct Tweet	  **elements;
 } ResultArray;
 
+/*
+ * An id as computed by libjson, so that it is stored as int8 without going
+ * through int8in.  Only ids that don't fit in int64 are kept as text.
+ */
+typedef struct TweetId
+{
+	char	   *text;
+	bool		valid;			/* value is set */
+	int64		value;
+} TweetId;
+
 typedef struct Tweet
 {
-	char	   *id;
+	TweetId		id;
 	char	   *text;
 	char	   *from_user;
-	char	   *from_user_id;
+	TweetId		from_user_id;
 	char	   *to_user;
-	char	   *to_user_id;
+	TweetId		to_user_id;
 	char	   *iso_language_code;
 	char	   *source;
 	char	   *profile_image_url;
 	char	   *created_at;
+	int			npaths;
+	char	  **paths;			/* values json_path options lead to */
+	struct varlena *raw;		/* the whole tweet as jsonb, if asked for */
 } Tweet;
 
+/*
+ * Fields of a tweet kept as text, which conditions can be checked on
+ * before a row is formed (see prefilter_clause()).
+ */
+static const struct
+{
+	const char *name;
+	int			offset;
+} text_fields[] = {
+	{"text", offsetof(Tweet, text)},
+	{"from_user", offsetof(Tweet, from_user)},
+	{"to_user", offsetof(Tweet, to_user)},
+	{"iso_language_code", offsetof(Tweet, iso_language_code)},
+	{"source", offsetof(Tweet, source)},
+	{"profile_image_url", offsetof(Tweet, profile_image_url)},
+	{"created_at", offsetof(Tweet, created_at)},
+	{NULL, 0}
+};
+
+#define TEXT_FIELD(tweet, offset) (*(char **) ((char *) (tweet) + (offset)))
+
+/*
+ * A condition checked on a text field as parsed: the field equals,
+ * starts with, ends with or contains the pattern, as PREFILTER_START and
+ * PREFILTER_END tell.  With PREFILTER_ICASE letters are compared in ASCII
+ * lower case.
+ */
+#define PREFILTER_START		0x01
+#define PREFILTER_END		0x02
+#define PREFILTER_ICASE		0x04
+
+typedef struct Prefilter
+{
+	int			flags;
+	int			offset;			/* of the field in Tweet */
+	char	   *pattern;
+	int			len;
+	int			skip[256];		/* Horspool shifts, for contains */
+} Prefilter;
+
+/*
+ * Keys parse_tweet() looks for, as an index into known_keys[].
+ */
+enum
+{
+	KEY_RESULTS,
+	KEY_COMPLETED_IN,
+	KEY_ID,
+	KEY_TEXT,
+	KEY_FROM_USER,
+	KEY_FROM_USER_ID,
+	KEY_TO_USER,
+	KEY_TO_USER_ID,
+	KEY_ISO_LANGUAGE_CODE,
+	KEY_SOURCE,
+	KEY_PROFILE_IMAGE_URL,
+	KEY_CREATED_AT
+};
+
+static const char *const known_keys[] = {
+	"results",
+	"completed_in",
+	"id",
+	"text",
+	"from_user",
+	"from_user_id",
+	"to_user",
+	"to_user_id",
+	"iso_language_code",
+	"source",
+	"profile_image_url",
+	"created_at"
+};
+
+/*
+ * Cumulative statistics, shown by the pg_stat_twitter_fdw view.
+ *
+ * Counters live in a shared hash table keyed by server and normalized query
+ * string.  Once twitter_fdw.stats_max entries exist, new queries are counted
+ * under their server's "<other>" entry.  Latencies are kept as a histogram
+ * of power-of-two millisecond buckets, from which percentiles are estimated.
+ */
+#define TWITTER_STATS_QUERY_LEN		256
+#define TWITTER_LATENCY_BUCKETS		20
+#define TWITTER_STATS_OTHER			"<other>"
+
+typedef struct TwitterStatsKey
+{
+	Oid				dbid;
+	Oid				serverid;
+	char			query[TWITTER_STATS_QUERY_LEN];
+} TwitterStatsKey;
+
+typedef struct TwitterCounters
+{
+	int64			requests;		/* HTTP requests sent */
+	int64			failures;		/* requests without a usable result */
+	int64			http_4xx;
+	int64			http_5xx;
+	int64			transport_errors;	/* no HTTP response at all */
+	int64			throttled;		/* rate limited by the API */
+	int64			bytes;
+	int64			rows;			/* tweets received */
+	int64			cache_hits;		/* scans served by another backend */
+	int64			cache_misses;	/* scans that fetched by themselves */
+	double			total_time;		/* msec */
+	double			max_time;
+	int64			latency[TWITTER_LATENCY_BUCKETS];
+} TwitterCounters;
+
+typedef struct TwitterStatsEntry
+{
+	TwitterStatsKey	key;			/* hash key of entry - MUST BE FIRST */
+	slock_t			mutex;			/* protects the counters only */
+	TwitterCounters	counters;
+} TwitterStatsEntry;
+
+/*
+ * Per-scan fetch and parse statistics, shown by EXPLAIN ANALYZE.
+ * curl timings are summed over requests, in seconds.  Parse time is spent
+ * in twitterIterate(), as rows are asked for.
+ */
+typedef struct TwitterScanStats
+{
+	bool			timing;			/* collect parse/convert times? */
+	long			requests;		/* HTTP requests sent */
+	long			pages;			/* responses received */
+	long			coalesced;		/* results taken from another backend */
+	long			cache_hits;		/* rescans read again, not searched */
+	long			retries;		/* fetched again after a leader failed */
+	long			bytes;			/* response body bytes received */
+	double			dns_time;
+	double			connect_time;
+	double			tls_time;
+	double			wait_time;		/* request sent until first byte */
+	double			transfer_time;
+	instr_time		parse_time;
+	instr_time		convert_time;
+	long			prefiltered;	/* tweets rejected by prefilters */
+	char		   *completed_in;	/* server-side time reported by the API */
+	TwitterStatsKey	key;			/* entry to count in pg_stat_twitter_fdw */
+} TwitterScanStats;
+
+/*
+ * Limits on what a response may hold, from the twitter_fdw.max_* GUCs and
+ * the options of the server.  Sizes are in kB, and 0 means no limit, up to
+ * MaxAllocSize for the response.
+ */
+typedef struct TwitterLimits
+{
+	int				max_response_size;
+	int				max_token_size;		/* of a string, key or number */
+	int				max_nesting;
+} TwitterLimits;
+
+/*
+ * A node of the trie json_path options are compiled into, see
+ * twitter_paths(): the value of key in the object of its parent, and the
+ * slot of Tweet.paths it is kept in if a column asks for it.  Node 0 is
+ * the tweet itself.
+ */
+typedef struct PathNode
+{
+	char	   *key;
+	int			len;
+	int			slot;			/* or -1 */
+	int			parent;
+	int			child;			/* first child, or -1 */
+	int			sibling;		/* next child of parent, or -1 */
+} PathNode;
+
+/*
+ * The libjson parser of a scan and the response it works through.  The
+ * response is only received by twitterBegin(); twitterIterate() pulls one
+ * tweet at a time out of it, so a scan that stops early does not pay for
+ * parsing the rest.  Everything is allocated in cxt, a child of the
+ * query's memory, so nothing is left behind if we error out halfway, and
+ * the parser is reset rather than rebuilt for each request of the scan.
+ */
+typedef struct TwitterParser
+{
+	MemoryContext	cxt;
+	MemoryContext	results_cxt;	/* tweets of the current response */
+	json_parser		parser;
+	TwitterLimits	limits;
+	StringInfoData	body;			/* part of the response not parsed yet */
+	struct TwitterFetch *fetch;		/* transfer of the rest, if running */
+	char		   *url;			/* where it came from, for errors */
+	ResultRoot	   *root;			/* tweets parsed so far */
+	Tweet		   *tweet;			/* tweet being parsed */
+	int				depth;			/* nesting of the next event */
+	int				tweet_depth;	/* that of the members of a tweet */
+	int				key;			/* KEY_* of the next value, or -1 */
+	bool			in_results;		/* inside the results array */
+	bool			done;			/* nothing more to parse */
+	PathNode	   *paths;			/* trie of json_path options, if any */
+	int				nslots;
+	int				path_node;		/* object of the trie we are in */
+	int				path_depth;		/* depth of its members */
+	int				path_next;		/* node of the next value, or -1 */
+	bool			raw;			/* keep tweets as jsonb too? */
+#if PG_VERSION_NUM >= 90400
+	JsonbParseState *raw_state;		/* of the tweet being parsed */
+#endif
+} TwitterParser;
+
+/*
+ * Where a column takes its value from, and how it is converted; worked
+ * out once per scan by plan_columns().  A NULL convert goes through the
+ * input function of the column's type.
+ */
+enum
+{
+	COLUMN_NONE,				/* no such field: null, as the type says */
+	COLUMN_DROPPED,
+	COLUMN_TEXT,				/* a text field, at offset in Tweet */
+	COLUMN_ID,					/* a TweetId, at offset in Tweet */
+	COLUMN_PATH,				/* a json_path, whose slot is offset */
+	COLUMN_RAW,					/* the jsonb of the tweet */
+	COLUMN_Q
+};
+
+typedef bool (*ColumnConverter) (char *str, Datum *value);
+
+typedef struct TwitterColumn
+{
+	int				source;			/* COLUMN_* */
+	int				offset;
+	bool			int8;			/* ids go in as they are */
+	ColumnConverter	convert;
+} TwitterColumn;
+
+/*
+ * The rows a scan returned for some values of q, kept for rescans to read
+ * again instead of searching again.  The tuplestore spills to disk past
+ * work_mem.
+ */
+typedef struct TwitterSpool
+{
+	List			   *key;		/* values of q, for a run-time q */
+	Tuplestorestate	   *store;
+	bool				complete;	/* has every row of the scan */
+} TwitterSpool;
+
 typedef struct TwitterReply
 {
+	TwitterParser  *parser;
 	ResultRoot	   *root;
 	AttInMetadata  *attinmeta;
+	TwitterColumn  *columns;
+	char		   *parse_key;		/* what the parser keeps, for flights */
 	int				rownum;
-	char		   *q;
+	List		   *q;				/* values of q searched for */
+	int				qindex;			/* next of them to try on the tweet */
+	char		   *endpoint;
+	List		   *terms;			/* words narrowing the search */
+	List		   *param_q;		/* values of q known at plan time */
+	ExprState	   *q_state;		/* or the expression giving them */
+	bool			q_array;		/* q = ANY (expression) */
+	bool			lookup;			/* q is ids to look up, not searches */
+	Oid				q_type;			/* of the expression */
+	MemoryContext	batch_cxt;		/* values of q and their batches */
+	List		   *batches;		/* lists of values searched at once */
+	int				batchno;		/* current batch */
+	bool			started;		/* have the searches begun? */
+	Prefilter	   *prefilters;		/* checked before a row is formed */
+	int				nprefilters;
+	bool			spooling;		/* keep rows for rescans? */
+	MemoryContext	spool_cxt;
+	TwitterSpool   *spool;			/* rows of the current scan */
+	List		   *spools;			/* earlier ones kept, latest first */
+	bool			replay;			/* reading the rows from spool */
+	TupleTableSlot *spool_slot;		/* spooled rows are read into, 12+ */
+	TwitterScanStats stats;
 } TwitterReply;
 
+/*
+ * An HTTP request in progress.  The transfer is driven through a curl multi
+ * handle, so that we can sleep on its socket and our latch at once and stay
+ * responsive to query cancel.  Open fetches are remembered with their
+ * resource owner; fetch_release() closes those an error left behind.
+ */
+#define FETCH_MAX_SOCKETS		4
+
+/* poll interval (msec) when the latch cannot watch curl's sockets */
+#define FETCH_POLL_INTERVAL		10
+
+typedef struct TwitterFetch
+{
+	StringInfo			body;
+	TwitterScanStats   *stats;
+	Size				max_size;		/* of the response */
+	Size				received;		/* bytes of the response so far */
+	bool				too_large;		/* write_data() gave up on the body */
+	CURL			   *curl;
+	CURLM			   *multi;
+	int					running;		/* is the transfer still going? */
+	CURLcode			result;			/* how it ended */
+	long				timeout;		/* msec until curl's timer, -1 if none */
+	int					nsockets;
+	curl_socket_t		sockets[FETCH_MAX_SOCKETS];
+	int					events[FETCH_MAX_SOCKETS];	/* CURL_POLL_* */
+	ResourceOwner		owner;
+	struct TwitterFetch *next;
+} TwitterFetch;
+
+/*
+ * Single-flight request coalescing.
+ *
+ * When several backends ask for the same URL at the same moment, only the
+ * first one (the leader) talks to the API.  The others attach to its flight,
+ * sleep until it lands and read the parsed tweets back from a spill file the
+ * leader wrote, so a thundering herd costs one request and one parse.
+ * Flights live in shared memory, so this is only active when the module is
+ * loaded by shared_preload_libraries.
+ */
+#define TWITTER_MAX_FLIGHTS		32
+#define TWITTER_MAX_URL			1024
+
+/* followers poll at this interval (usec) where condition variables lack */
+#define FLIGHT_POLL_INTERVAL	10000
+
+enum
+{
+	FLIGHT_FREE = 0,
+	FLIGHT_INFLIGHT,		/* leader is fetching, followers may attach */
+	FLIGHT_PUBLISHING,		/* leader is writing the spill file */
+	FLIGHT_DONE,			/* spill file is ready to read */
+	FLIGHT_FAILED			/* leader gave up, followers fetch themselves */
+};
+
+typedef struct TwitterFlight
+{
+	int				state;
+	int				refcount;		/* attached backends, leader included */
+	uint32			generation;		/* names the spill file */
+	char			url[TWITTER_MAX_URL];
+#if PG_VERSION_NUM >= 100000
+	ConditionVariable	cv;
+#endif
+} TwitterFlight;
+
+typedef struct TwitterSharedState
+{
+#if PG_VERSION_NUM >= 90400
+	LWLock		   *lock;
+	LWLock		   *stats_lock;		/* protects the stats hash table */
+#else
+	LWLockId		lock;
+	LWLockId		stats_lock;
+#endif
+	TwitterFlight	flights[TWITTER_MAX_FLIGHTS];
+} TwitterSharedState;
+
+/* GUC variables */
+static bool twitter_coalesce = true;
+static int	twitter_batch_size = 20;
+static int	twitter_rescan_cache = 0;
+static int	twitter_stats_max = 1000;
+static int	twitter_max_response_size = 16384;	/* kB */
+static int	twitter_max_token_size = 1024;		/* kB */
+static int	twitter_max_nesting = 64;
+
+static TwitterSharedState *twitter_shared = NULL;
+static HTAB *twitter_stats = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+/* fetches not closed yet, for cleanup on error */
+static TwitterFetch *open_fetches = NULL;
+
+/* flight this backend is attached to, for cleanup at exit */
+static int	my_flight = -1;
+static bool	my_flight_leader = false;
+
+void		_PG_init(void);
+void		_PG_fini(void);
+
 extern Datum twitter_fdw_validator(PG_FUNCTION_ARGS);
 extern Datum twitter_fdw_handler(PG_FUNCTION_ARGS);
+extern Datum twitter_fdw_stats(PG_FUNCTION_ARGS);
+extern Datum twitter_fdw_stats_reset(PG_FUNCTION_ARGS);
+extern Datum twitter_fdw_export(PG_FUNCTION_ARGS);
 
 /*
  * FDW callback routines
@@ -137,9 +677,18 @@ static void twitterGetRelSize(PlannerInfo *root, RelOptInfo *baserel,
 							Oid foreigntableid);
 static void twitterGetPaths(PlannerInfo *root, RelOptInfo *baserel,
 							Oid foreigntableid);
+#if PG_VERSION_NUM >= 90500
+static ForeignScan *twitterGetPlan(PlannerInfo *root, RelOptInfo *baserel,
+							Oid foreigntableid, ForeignPath *best_path,
+							List *tlist, List *scan_clauses, Plan *outer_plan);
+#else
 static ForeignScan *twitterGetPlan(PlannerInfo *root, RelOptInfo *baserel,
 							Oid foreigntableid, ForeignPath *best_path,
 							List *tlist, List *scan_clauses);
+#endif
+static Path *twitter_path(PlannerInfo *root, RelOptInfo *baserel, double rows,
+						  Cost startup_cost, Cost total_cost,
+						  Relids required_outer, List *fdw_private);
 static bool twitterAnalyze(Relation relation, AcquireSampleRowsFunc *func,
 							BlockNumber *totalpages);
 #endif
@@ -150,18 +699,275 @@ static void twitterReScan(ForeignScanState *node);
 static void twitterEnd(ForeignScanState *node);
 
 static size_t write_data(void *buffer, size_t size, size_t nmemb, void *userp);
-static void *create_structure(int nesting, int is_object);
-static void *create_data(int type, const char *data, uint32_t length);
-static int append(void *structure, char *key, uint32_t key_length, void *obj);
+static int lookup_key(const char *key, uint32 length);
+static void tweet_set(Tweet *tweet, int key, json_event *event);
+static char *next_q(TwitterReply *reply, Tweet *tweet);
+static bool tweet_matches(const char *q, Tweet *tweet);
+static List *q_values(ForeignScanState *node, TwitterReply *reply);
+static List *q_batches(List *values, bool lookup);
+static void reply_start(ForeignScanState *node, TwitterReply *reply);
+static void reply_fetch(TwitterReply *reply);
+static TwitterColumn *plan_columns(TupleDesc tupdesc, List *slots);
+static bool convert_text(char *str, Datum *value);
+static bool convert_timestamp(char *str, Datum *value);
+static bool convert_timestamptz(char *str, Datum *value);
+static bool parse_created_at(char *str, Timestamp *result, bool utc);
+static void spool_drop(TwitterReply *reply);
+static void spool_start(TwitterReply *reply, List *key);
+static void spool_done(TwitterReply *reply);
+static void prefilter_compile(Prefilter *filter, List *item);
+static bool prefilter_match(Prefilter *filter, Tweet *tweet);
+
+static TwitterParser *parser_create(TwitterLimits *limits, List *paths,
+									 bool raw);
+static void *parser_calloc(size_t nmemb, size_t size);
+static void *parser_realloc(void *ptr, size_t size);
+static void parser_free(void *ptr);
+static ResultRoot *parser_start(TwitterParser *parser, char *url);
+static ResultArray *results_create(int size);
+static void results_append(ResultArray *array, Tweet *tweet);
+static Tweet *parse_tweet(TwitterParser *parser, TwitterScanStats *stats);
+static void parse_finish(TwitterParser *parser, TwitterScanStats *stats);
+static int	path_child(TwitterParser *parser, int node, const char *key,
+					   uint32 length);
+static void path_set(TwitterParser *parser, json_event *event);
+#if PG_VERSION_NUM >= 90400
+static void raw_event(TwitterParser *parser, json_event *event);
+#endif
+static ResultRoot *fetch_results(char *url, TwitterScanStats *stats,
+								 TwitterParser *parser);
+static TwitterFetch *fetch_open(char *url, TwitterScanStats *stats,
+								StringInfo body, Size max_size);
+static void fetch_pump(TwitterFetch *fetch);
+static bool fetch_finish(TwitterParser *parser, TwitterScanStats *stats,
+						 bool abort);
+static void fetch_close(TwitterFetch *fetch);
+static int fetch_wait(int events, pgsocket sock, long timeout);
+static int fetch_socket(CURL *easy, curl_socket_t sock, int what,
+						void *userp, void *socketp);
+static int fetch_timer(CURLM *multi, long timeout_ms, void *userp);
+static void fetch_release(ResourceReleasePhase phase, bool isCommit,
+						  bool isTopLevel, void *arg);
+#if PG_VERSION_NUM >= 90600
+static uint32 twitter_wait_event(void);
+#endif
+static void explain_scan_stats(TwitterScanStats *stats, ExplainState *es);
+static void twitter_shmem_request(void);
+static void twitter_shmem_startup(void);
+static bool is_valid_option(const char *option, Oid context);
+static char *twitter_endpoint(Oid foreigntableid, bool lookup);
+static void twitter_limits(Oid serverid, TwitterLimits *limits);
+static int	limit_value(DefElem *def);
+static List *json_path_keys(const char *path);
+static int flight_attach(const char *url, bool *leader);
+static ResultRoot *flight_lead(int slot, char *url, TwitterScanStats *stats,
+							   TwitterParser *parser);
+static ResultRoot *flight_follow(int slot);
+static void flight_land(int slot, int state);
+static void flight_detach(int slot);
+static void flight_shmem_exit(int code, Datum arg);
+static void flight_spill_path(char *path, int slot, uint32 generation);
+static void spill_string(FILE *file, const char *value);
+static bool load_string(FILE *file, char **value);
+static bool spill_results(int slot, uint32 generation, ResultRoot *root);
+static ResultRoot *load_results(int slot, uint32 generation);
+static void normalize_query(char *dest, const char *url);
+static int export_write(void *userdata, const char *s, uint32_t length);
+static void export_tweet(json_printer *printer, Tweet *tweet);
+static void export_shutdown(Datum arg);
+static void stats_accum(TwitterStatsKey *key, TwitterCounters *delta);
+static void counters_add(TwitterCounters *dest, TwitterCounters *src);
+static int latency_bucket(double msec);
+static double latency_percentile(TwitterCounters *counters, double fraction);
 
 
+/*
+ * Validate the generic options given to a FOREIGN DATA WRAPPER, SERVER,
+ * USER MAPPING or FOREIGN TABLE that uses twitter_fdw.
+ */
 PG_FUNCTION_INFO_V1(twitter_fdw_validator);
 Datum
 twitter_fdw_validator(PG_FUNCTION_ARGS)
 {
+	List	   *options_list = untransformRelOptions(PG_GETARG_DATUM(0));
+	Oid			catalog = PG_GETARG_OID(1);
+	ListCell   *cell;
+
+	foreach(cell, options_list)
+	{
+		DefElem	   *def = (DefElem *) lfirst(cell);
+
+		if (!is_valid_option(def->defname, catalog))
+		{
+			struct TwitterFdwOption *opt;
+			StringInfoData buf;
+
+			/*
+			 * Unknown option specified, complain about it. Provide a hint
+			 * with list of valid options for the object.
+			 */
+			initStringInfo(&buf);
+			for (opt = valid_options; opt->optname; opt++)
+			{
+				if (catalog == opt->optcontext)
+					appendStringInfo(&buf, "%s%s", (buf.len > 0) ? ", " : "",
+									 opt->optname);
+			}
+
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+					 errmsg("invalid option \"%s\"", def->defname),
+					 buf.len > 0
+					 ? errhint("Valid options in this context are: %s",
+							   buf.data)
+					 : errhint("There are no valid options in this context.")));
+		}
+
+		if (strcmp(def->defname, "endpoint") == 0 ||
+			strcmp(def->defname, "lookup_endpoint") == 0)
+		{
+			char	   *endpoint = defGetString(def);
+
+			if (strncmp(endpoint, "http://", 7) != 0 &&
+				strncmp(endpoint, "https://", 8) != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("%s must be an http or https URL",
+								def->defname)));
+		}
+		else if (strncmp(def->defname, "max_", 4) == 0)
+			(void) limit_value(def);
+		else if (strcmp(def->defname, "json_path") == 0)
+		{
+			char	   *path = defGetString(def);
+
+			if (json_path_keys(path) == NIL)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("invalid value for option \"%s\": \"%s\"",
+								def->defname, path),
+						 errhint("Give the keys leading to the value in a tweet, separated by dots.")));
+		}
+	}
+
 	PG_RETURN_BOOL(true);
 }
 
+/*
+ * Check if the provided option is one of the valid options.
+ * context is the Oid of the catalog holding the object the option is for.
+ */
+static bool
+is_valid_option(const char *option, Oid context)
+{
+	struct TwitterFdwOption *opt;
+
+	for (opt = valid_options; opt->optname; opt++)
+	{
+		if (context == opt->optcontext && strcmp(opt->optname, option) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * twitter_endpoint
+ *   The search URL to use for a foreign table, or with lookup that of the
+ *   lookup by id, from its server's options
+ */
+static char *
+twitter_endpoint(Oid foreigntableid, bool lookup)
+{
+	ForeignTable   *table = GetForeignTable(foreigntableid);
+	ForeignServer  *server = GetForeignServer(table->serverid);
+	const char	   *option = lookup ? "lookup_endpoint" : "endpoint";
+	ListCell	   *cell;
+
+	foreach(cell, server->options)
+	{
+		DefElem	   *def = (DefElem *) lfirst(cell);
+
+		if (strcmp(def->defname, option) == 0)
+			return defGetString(def);
+	}
+
+	return lookup ? LOOKUP_ENDPOINT : SEARCH_ENDPOINT;
+}
+
+/*
+ * twitter_limits
+ *   The limits on responses for a server: its options, else the GUCs
+ */
+static void
+twitter_limits(Oid serverid, TwitterLimits *limits)
+{
+	ForeignServer  *server = GetForeignServer(serverid);
+	ListCell	   *cell;
+
+	limits->max_response_size = twitter_max_response_size;
+	limits->max_token_size = twitter_max_token_size;
+	limits->max_nesting = twitter_max_nesting;
+
+	foreach(cell, server->options)
+	{
+		DefElem	   *def = (DefElem *) lfirst(cell);
+
+		if (strcmp(def->defname, "max_response_size") == 0)
+			limits->max_response_size = limit_value(def);
+		else if (strcmp(def->defname, "max_token_size") == 0)
+			limits->max_token_size = limit_value(def);
+		else if (strcmp(def->defname, "max_nesting") == 0)
+			limits->max_nesting = limit_value(def);
+	}
+}
+
+/*
+ * limit_value
+ *   Parse a max_* option as its GUC would be, sizes with a unit
+ */
+static int
+limit_value(DefElem *def)
+{
+	char	   *value = defGetString(def);
+	bool		size = (strcmp(def->defname, "max_nesting") != 0);
+	const char *hint = NULL;
+	int			result;
+
+	if (!parse_int(value, &result, size ? GUC_UNIT_KB : 0, &hint) ||
+		result < 0 || (size && result > MaxAllocSize / 1024))
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+				 errmsg("invalid value for option \"%s\": \"%s\"",
+						def->defname, value),
+				 hint ? errhint("%s", hint) : 0));
+	return result;
+}
+
+/*
+ * json_path_keys
+ *   The keys of a json_path option, as a list of String nodes, or NIL if
+ *   it is not a path: keys are separated by dots, and none may be empty
+ */
+static List *
+json_path_keys(const char *path)
+{
+	List	   *keys = NIL;
+	const char *dot;
+
+	for (;;)
+	{
+		dot = strchr(path, '.');
+		if (dot == path || *path == '\0')
+			return NIL;
+		if (dot == NULL)
+			break;
+		keys = lappend(keys, makeString(pnstrdup(path, dot - path)));
+		path = dot + 1;
+	}
+
+	return lappend(keys, makeString(pstrdup(path)));
+}
+
 PG_FUNCTION_INFO_V1(twitter_fdw_handler);
 Datum
 twitter_fdw_handler(PG_FUNCTION_ARGS)
@@ -179,7 +985,7 @@ twitter_fdw_handler(PG_FUNCTION_ARGS)
 	fdwroutine->GetForeignPaths = twitterGetPaths;
 	fdwroutine->GetForeignPlan = twitterGetPlan;
 	fdwroutine->AnalyzeForeignTable = twitterAnalyze;
-#endif;
+#endif
 	fdwroutine->ExplainForeignScan = twitterExplain;
 	fdwroutine->BeginForeignScan = twitterBegin;
 	fdwroutine->IterateForeignScan = twitterIterate;
@@ -189,569 +995,5005 @@ twitter_fdw_handler(PG_FUNCTION_ARGS)
 	PG_RETURN_POINTER(fdwroutine);
 }
 
-static char *
-percent_encode(unsigned char *s, int srclen)
+/*
+ * _PG_init
+ *   Define GUCs and, when preloaded, reserve shared memory for flights
+ */
+void
+_PG_init(void)
 {
-	unsigned char  *end;
-	StringInfoData  buf;
-	int				len;
+	DefineCustomBoolVariable("twitter_fdw.coalesce",
+							 "Coalesces identical concurrent API requests.",
+							 "Requires twitter_fdw in shared_preload_libraries.",
+							 &twitter_coalesce,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
 
-	initStringInfo(&buf);
+	DefineCustomIntVariable("twitter_fdw.batch_size",
+							"Sets the maximum number of values of q searched for in one request.",
+							"Values are ORed in one search while the API accepts its length.",
+							&twitter_batch_size,
+							20,
+							1,
+							100,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
 
-	if (srclen < 0)
-		srclen = strlen((char *) s);
+	DefineCustomIntVariable("twitter_fdw.rescan_cache",
+							"Sets the number of values of q whose rows a scan keeps for rescans.",
+							"Rescans for any of them read the rows again instead of searching. "
+							"Each keeps up to work_mem in memory and spills to disk past it.",
+							&twitter_rescan_cache,
+							0,
+							0,
+							100,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
 
-	end = s + srclen;
+	DefineCustomIntVariable("twitter_fdw.max_response_size",
+							"Sets the maximum size of an API response.",
+							"Longer responses are aborted as they are received. "
+							"0 means no limit.",
+							&twitter_max_response_size,
+							16384,
+							0,
+							MaxAllocSize / 1024,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
 
-	for (; s < end; s += len)
-	{
-		unsigned char  *utf;
-		int				ulen;
+	DefineCustomIntVariable("twitter_fdw.max_token_size",
+							"Sets the maximum size of a string, key or number in an API response.",
+							"0 means no limit.",
+							&twitter_max_token_size,
+							1024,
+							0,
+							MaxAllocSize / 1024,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
 
-		len = pg_mblen((const char *) s);
+	DefineCustomIntVariable("twitter_fdw.max_nesting",
+							"Sets the maximum nesting of arrays and objects in an API response.",
+							"0 means no limit.",
+							&twitter_max_nesting,
+							64,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
 
-		if (len == 1)
-		{
-			if (('0' <= s[0] && s[0] <= '9') ||
-				('A' <= s[0] && s[0] <= 'Z') ||
-				('a' <= s[0] && s[0] <= 'z') ||
-				(s[0] == '-') || (s[0] == '.') ||
-				(s[0] == '_') || (s[0] == '~'))
-			{
-				appendStringInfoChar(&buf, s[0]);
-				continue;
-			}
-		}
+	RegisterResourceReleaseCallback(fetch_release, NULL);
 
-		utf = pg_do_encoding_conversion(s, len, GetDatabaseEncoding(), PG_UTF8);
-		ulen = pg_encoding_mblen(PG_UTF8, (const char *) utf);
-		while(ulen--)
-		{
-			appendStringInfo(&buf, "%%%2X", *utf);
-			utf++;
-		}
+	/*
+	 * Postmaster variables can only be defined while preloading, so the
+	 * stats size is not even known to a library loaded later.
+	 */
+	if (!process_shared_preload_libraries_in_progress)
+	{
+		EmitWarningsOnPlaceholders("twitter_fdw");
+		return;
 	}
 
-	return buf.data;
+	DefineCustomIntVariable("twitter_fdw.stats_max",
+							"Sets the maximum number of queries tracked by pg_stat_twitter_fdw.",
+							NULL,
+							&twitter_stats_max,
+							1000,
+							100,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("twitter_fdw");
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = twitter_shmem_request;
+#else
+	twitter_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = twitter_shmem_startup;
 }
 
-static char *
-twitter_param(Node *node, TupleDesc tupdesc)
+/*
+ * _PG_fini
+ *   Uninstall hooks
+ */
+void
+_PG_fini(void)
 {
-	if (node == NULL)
-		return NULL;
+#if PG_VERSION_NUM >= 150000
+	shmem_request_hook = prev_shmem_request_hook;
+#endif
+	shmem_startup_hook = prev_shmem_startup_hook;
+	UnregisterResourceReleaseCallback(fetch_release, NULL);
+}
 
-	if (IsA(node, OpExpr))
+/*
+ * twitter_shmem_request
+ *   Reserve shared memory and locks for flights and stats
+ */
+static void
+twitter_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(add_size(MAXALIGN(sizeof(TwitterSharedState)),
+									hash_estimate_size(twitter_stats_max,
+													   sizeof(TwitterStatsEntry))));
+#if PG_VERSION_NUM >= 90600
+	RequestNamedLWLockTranche("twitter_fdw", 2);
+#else
+	RequestAddinLWLocks(2);
+#endif
+}
+
+static void
+twitter_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	twitter_shared = ShmemInitStruct("twitter_fdw",
+									 sizeof(TwitterSharedState), &found);
+	if (!found)
+	{
+		int			i;
+
+		memset(twitter_shared, 0, sizeof(TwitterSharedState));
+#if PG_VERSION_NUM >= 90600
+		twitter_shared->lock = &(GetNamedLWLockTranche("twitter_fdw"))[0].lock;
+		twitter_shared->stats_lock = &(GetNamedLWLockTranche("twitter_fdw"))[1].lock;
+#else
+		twitter_shared->lock = LWLockAssign();
+		twitter_shared->stats_lock = LWLockAssign();
+#endif
+		for (i = 0; i < TWITTER_MAX_FLIGHTS; i++)
+		{
+			twitter_shared->flights[i].state = FLIGHT_FREE;
+#if PG_VERSION_NUM >= 100000
+			ConditionVariableInit(&twitter_shared->flights[i].cv);
+#endif
+		}
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(TwitterStatsKey);
+	info.entrysize = sizeof(TwitterStatsEntry);
+#if PG_VERSION_NUM >= 90500
+	twitter_stats = ShmemInitHash("twitter_fdw stats",
+								  twitter_stats_max, twitter_stats_max,
+								  &info, HASH_ELEM | HASH_BLOBS);
+#else
+	info.hash = tag_hash;
+	twitter_stats = ShmemInitHash("twitter_fdw stats",
+								  twitter_stats_max, twitter_stats_max,
+								  &info, HASH_ELEM | HASH_FUNCTION);
+#endif
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+static char *
+percent_encode(unsigned char *s, int srclen)
+{
+	unsigned char  *end;
+	StringInfoData  buf;
+	int				len;
+
+	initStringInfo(&buf);
+
+	if (srclen < 0)
+		srclen = strlen((char *) s);
+
+	end = s + srclen;
+
+	for (; s < end; s += len)
+	{
+		unsigned char  *utf;
+		int				ulen;
+
+		len = pg_mblen((const char *) s);
+
+		if (len == 1)
+		{
+			if (('0' <= s[0] && s[0] <= '9') ||
+				('A' <= s[0] && s[0] <= 'Z') ||
+				('a' <= s[0] && s[0] <= 'z') ||
+				(s[0] == '-') || (s[0] == '.') ||
+				(s[0] == '_') || (s[0] == '~'))
+			{
+				appendStringInfoChar(&buf, s[0]);
+				continue;
+			}
+		}
+
+		utf = pg_do_encoding_conversion(s, len, GetDatabaseEncoding(), PG_UTF8);
+		ulen = pg_encoding_mblen(PG_UTF8, (const char *) utf);
+		while(ulen--)
+		{
+			appendStringInfo(&buf, "%%%2X", *utf);
+			utf++;
+		}
+	}
+
+	return buf.data;
+}
+
+static bool
+is_column(Node *node, TupleDesc tupdesc, const char *name)
+{
+	Index		varattno;
+
+	if (!IsA(node, Var))
+		return false;
+	varattno = ((Var *) node)->varattno;
+	if (varattno <= 0 || varattno > tupdesc->natts)
+		return false;
+
+	return strcmp(NameStr(TupleDescAttr(tupdesc, varattno - 1)->attname), name) == 0;
+}
+
+/*
+ * q_equal
+ *   The constant of a q = 'x' clause, or NULL for any other clause
+ */
+static char *
+q_equal(Node *node, TupleDesc tupdesc)
+{
+	OpExpr	   *op;
+	Node	   *right;
+
+	if (!IsA(node, OpExpr))
+		return NULL;
+	op = (OpExpr *) node;
+	if (op->opfuncid != PROCID_TEXTEQ || list_length(op->args) != 2 ||
+		!is_column(list_nth(op->args, 0), tupdesc, "q"))
+		return NULL;
+	right = list_nth(op->args, 1);
+	if (!IsA(right, Const) || ((Const *) right)->constisnull)
+		return NULL;
+
+	return TextDatumGetCString(((Const *) right)->constvalue);
+}
+
+static List *
+add_q(List *values, char *value)
+{
+	ListCell	   *l;
+
+	foreach(l, values)
+	{
+		if (strcmp(strVal(lfirst(l)), value) == 0)
+			return values;
+	}
+	return lappend(values, makeString(value));
+}
+
+/*
+ * twitter_q
+ *   The values of q a clause asks for: one for q = 'x', one for each
+ *   alternative of q = 'x' OR q = 'y' and of q IN ('x', 'y'), NIL for
+ *   any other clause
+ */
+static List *
+twitter_q(Node *node, TupleDesc tupdesc)
+{
+	List	   *values = NIL;
+
+	if (node == NULL)
+		return NIL;
+
+	if (IsA(node, OpExpr))
 	{
 		OpExpr	   *op = (OpExpr *) node;
-		Node	   *left, *right;
-		Index		varattno;
-		char	   *key, *val;
+		Node	   *right;
 
-		if (list_length(op->args) != 2)
-			return NULL;
-		left = list_nth(op->args, 0);
-		if (!IsA(left, Var))
-			return NULL;
-		varattno = ((Var *) left)->varattno;
-		Assert(0 < varattno && varattno <= tupdesc->natts);
-		key = NameStr(tupdesc->attrs[varattno - 1]->attname);
+		if (list_length(op->args) != 2 ||
+			!is_column(list_nth(op->args, 0), tupdesc, "q"))
+			return NIL;
+
+		right = list_nth(op->args, 1);
+		if (op->opfuncid != PROCID_TEXTEQ)
+			elog(ERROR, "invalid operator");
+		/* see clause_param() for the values known at run time */
+		if (!IsA(right, Const) || ((Const *) right)->constisnull)
+			return NIL;
+
+		values = add_q(values,
+					   TextDatumGetCString(((Const *) right)->constvalue));
+	}
+	else if (IsA(node, BoolExpr) && ((BoolExpr *) node)->boolop == OR_EXPR)
+	{
+		ListCell	   *l;
 
-		if (strcmp(key, "q") == 0)
+		foreach(l, ((BoolExpr *) node)->args)
 		{
-			right = list_nth(op->args, 1);
-			if (op->opfuncid != PROCID_TEXTEQ)
-				elog(ERROR, "invalid operator");
+			char	   *value = q_equal(lfirst(l), tupdesc);
 
-			if (IsA(right, Const))
-			{
-				StringInfoData	buf;
+			if (value == NULL)
+				return NIL;
+			values = add_q(values, value);
+		}
+	}
+	else if (IsA(node, ScalarArrayOpExpr))
+	{
+		ScalarArrayOpExpr  *op = (ScalarArrayOpExpr *) node;
+		Node			   *right;
+		Datum			   *elems;
+		bool			   *nulls;
+		int					nelems;
+		int					i;
 
-				initStringInfo(&buf);
-				val = TextDatumGetCString(((Const *) right)->constvalue);
-				appendStringInfo(&buf, "q=%s",
-					percent_encode((unsigned char *) val, -1));
-				return buf.data;
-			}
-			else
-				elog(ERROR, "twitter_fdw: parameter q must be a constant");
+		if (!op->useOr || op->opfuncid != PROCID_TEXTEQ ||
+			list_length(op->args) != 2 ||
+			!is_column(list_nth(op->args, 0), tupdesc, "q"))
+			return NIL;
+		right = list_nth(op->args, 1);
+		if (!IsA(right, Const) || ((Const *) right)->constisnull)
+			return NIL;
+
+		deconstruct_array(DatumGetArrayTypeP(((Const *) right)->constvalue),
+						  TEXTOID, -1, false, 'i', &elems, &nulls, &nelems);
+		for (i = 0; i < nelems; i++)
+		{
+			if (!nulls[i])
+				values = add_q(values, TextDatumGetCString(elems[i]));
 		}
 	}
 
-	return NULL;
+	return values;
+}
+
+/*
+ * id = value, for each integer type value may be of
+ */
+#define ID_EQUALITY(funcid) \
+	((funcid) == PROCID_INT8EQ || (funcid) == PROCID_INT84EQ || \
+	 (funcid) == PROCID_INT82EQ || (funcid) == PROCID_INT48EQ || \
+	 (funcid) == PROCID_INT28EQ)
+
+/*
+ * id_text
+ *   An id of an integer type, as the lookup endpoint takes it
+ */
+static char *
+id_text(Datum value, Oid type)
+{
+	int64		id;
+	char		buf[32];
+
+	if (type == INT2OID)
+		id = DatumGetInt16(value);
+	else if (type == INT4OID)
+		id = DatumGetInt32(value);
+	else
+		id = DatumGetInt64(value);
+	snprintf(buf, sizeof(buf), INT64_FORMAT, id);
+
+	return pstrdup(buf);
 }
 
 /*
- * @return fdw_private data
+ * twitter_ids
+ *   The ids a clause looks up: one for id = 1, one for each element of
+ *   id IN (1, 2), NIL for any other clause
  */
 static List *
-extract_twitter_conditions(List *conditions, TupleDesc tupdesc)
+twitter_ids(Node *node, TupleDesc tupdesc)
+{
+	List	   *values = NIL;
+	List	   *args;
+	Const	   *right;
+
+	if (node == NULL)
+		return NIL;
+
+	if (IsA(node, OpExpr) && ID_EQUALITY(((OpExpr *) node)->opfuncid))
+		args = ((OpExpr *) node)->args;
+	else if (IsA(node, ScalarArrayOpExpr) &&
+			 ((ScalarArrayOpExpr *) node)->useOr &&
+			 ID_EQUALITY(((ScalarArrayOpExpr *) node)->opfuncid))
+		args = ((ScalarArrayOpExpr *) node)->args;
+	else
+		return NIL;
+
+	if (list_length(args) != 2 || !is_column(list_nth(args, 0), tupdesc, "id"))
+		return NIL;
+	right = (Const *) list_nth(args, 1);
+	if (!IsA(right, Const) || right->constisnull)
+		return NIL;
+
+	if (IsA(node, OpExpr))
+		values = add_q(values, id_text(right->constvalue, right->consttype));
+	else
+	{
+		ArrayType  *array = DatumGetArrayTypeP(right->constvalue);
+		Oid			elemtype = ARR_ELEMTYPE(array);
+		int16		typlen;
+		bool		typbyval;
+		char		typalign;
+		Datum	   *elems;
+		bool	   *nulls;
+		int			nelems;
+		int			i;
+
+		get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+		deconstruct_array(array, elemtype, typlen, typbyval, typalign,
+						  &elems, &nulls, &nelems);
+		for (i = 0; i < nelems; i++)
+		{
+			if (!nulls[i])
+				values = add_q(values, id_text(elems[i], elemtype));
+		}
+	}
+
+	return values;
+}
+
+/*
+ * clause_param
+ *   The expression of a q = expr or q = ANY (expr) clause whose value is
+ *   only known at run time: a parameter, or columns of other relations in
+ *   a parameterized scan.  With lookup, that of id = expr or
+ *   id = ANY (expr) instead.  *is_array tells which form it is.  The
+ *   planner gives join clauses as written, so expr = q is taken too.
+ */
+static Expr *
+clause_param(Node *node, TupleDesc tupdesc, Index relid, bool lookup,
+			 bool *is_array)
+{
+	List	   *args;
+	Node	   *left;
+	Node	   *right;
+	Oid			funcid;
+	const char *column = lookup ? "id" : "q";
+
+	if (node == NULL)
+		return NULL;
+
+	if (IsA(node, OpExpr))
+	{
+		funcid = ((OpExpr *) node)->opfuncid;
+		args = ((OpExpr *) node)->args;
+		*is_array = false;
+	}
+	else if (IsA(node, ScalarArrayOpExpr) &&
+			 ((ScalarArrayOpExpr *) node)->useOr)
+	{
+		funcid = ((ScalarArrayOpExpr *) node)->opfuncid;
+		args = ((ScalarArrayOpExpr *) node)->args;
+		*is_array = true;
+	}
+	else
+		return NULL;
+
+	if (lookup ? !ID_EQUALITY(funcid) : funcid != PROCID_TEXTEQ)
+		return NULL;
+	if (list_length(args) != 2)
+		return NULL;
+	left = list_nth(args, 0);
+	right = list_nth(args, 1);
+	/* equality commutes, but the array of ANY is always on the right */
+	if (!is_column(left, tupdesc, column) || ((Var *) left)->varno != relid)
+	{
+		if (*is_array || !is_column(right, tupdesc, column) ||
+			((Var *) right)->varno != relid)
+			return NULL;
+		right = left;
+	}
+	if (IsA(right, Const) ||
+		bms_is_member(relid, pull_varnos(right)) ||
+		contain_volatile_functions(right))
+		return NULL;
+
+	return (Expr *) right;
+}
+
+/*
+ * q_mergeable
+ *   Can the values of q be searched for at once, as alternatives?  The
+ *   API binds OR tighter than the AND between words, so each must be a
+ *   single word, or operator, of its own.
+ */
+static bool
+q_mergeable(List *values)
 {
-	List		   *result;
 	ListCell	   *l;
-	StringInfoData	url;
-	char		   *param_q;
-	int			   *handle_clauses;
-	int				clause_count;
-	bool			param_first;
 
-	result = NIL;
-	initStringInfo(&url);
-	appendStringInfoString(&url, SEARCH_ENDPOINT);
-	param_q = NULL;
-	handle_clauses = (int *) palloc0(sizeof(int) * list_length(conditions));
-	clause_count = -1;
-	param_first = true;
-	foreach (l, conditions)
+	foreach(l, values)
 	{
-		RestrictInfo	   *cond = (RestrictInfo *) lfirst(l);
-		char	   *param;
+		char	   *value = strVal(lfirst(l));
+
+		if (value[0] == '\0' || value[0] == '-' ||
+			strcmp(value, "OR") == 0 || strpbrk(value, " \t\r\n") != NULL)
+			return false;
+	}
 
-		param = twitter_param((Node *) cond->clause, tupdesc);
-		if (param)
+	return true;
+}
+
+/*
+ * q_matches
+ *   Could the text of a tweet be what a search for q found?  Only plain
+ *   words, and hashtags and mentions, are checked; operators are not.
+ */
+static bool
+q_matches(const char *q, const char *text)
+{
+	const char *p;
+
+	if (text == NULL)
+		return true;
+
+	p = q;
+	while (*p)
+	{
+		const char *word;
+		const char *t;
+		int			len;
+
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+			p++;
+		if (*p == '#' || *p == '@')
+			p++;
+		word = p;
+		while (WORD_CHAR(*p))
+			p++;
+		len = p - word;
+		if (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
 		{
-			if (param_first)
-				appendStringInfoChar(&url, '?');
-			else
-				appendStringInfoChar(&url, '&');
-			appendStringInfoString(&url, param);
-			param_first = false;
-			if (param[0] == 'q' && param[1] == '=')
-			{
-				param_q = &param[2];
-			}
-			/* add more, if any */
+			/* not a plain word, we cannot tell */
+			while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+				p++;
+			continue;
+		}
+		if (len == 0)
+			continue;
+
+		for (t = text; *t; t++)
+		{
+			if (pg_strncasecmp(t, word, len) == 0 &&
+				(t == text || !WORD_CHAR(t[-1])) && !WORD_CHAR(t[len]))
+				break;
+		}
+		if (*t == '\0')
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * The search API matches whole words, ignoring case.  A pattern on the
+ * text column narrows the search by the words every match must contain:
+ * runs of letters and digits that the pattern bounds on both sides by an
+ * anchor or by a literal character that cannot be part of a word.  Any
+ * other construct, a wildcard for instance, may extend the word next to
+ * it, which then narrows nothing.
+ */
+enum
+{
+	PATTERN_CHAR,		/* a literal character */
+	PATTERN_BOUND,		/* an anchor or a word boundary */
+	PATTERN_ANY			/* anything else */
+};
+
+typedef struct PatternTerms
+{
+	StringInfoData	word;		/* letters and digits seen so far */
+	bool			bounded;	/* does the word follow a boundary? */
+	List		   *terms;
+} PatternTerms;
+
+static void
+add_term(List **terms, const char *term)
+{
+	ListCell	   *l;
+
+	foreach(l, *terms)
+	{
+		if (strcmp(lfirst(l), term) == 0)
+			return;
+	}
+	*terms = lappend(*terms, pstrdup(term));
+}
+
+static void
+pattern_start(PatternTerms *pt, bool anchored)
+{
+	initStringInfo(&pt->word);
+	pt->bounded = anchored;
+	pt->terms = NIL;
+}
+
+static void
+pattern_atom(PatternTerms *pt, int kind, char c)
+{
+	if (kind == PATTERN_CHAR)
+	{
+		if (WORD_CHAR(c))
+		{
+			appendStringInfoChar(&pt->word, pg_tolower((unsigned char) c));
+			return;
+		}
+		/* a multibyte character or '_' may belong to the word */
+		if (IS_HIGHBIT_SET(c) || c == '_')
+			kind = PATTERN_ANY;
+		else
+			kind = PATTERN_BOUND;
+	}
+
+	if (kind == PATTERN_BOUND && pt->bounded && pt->word.len > 0)
+		add_term(&pt->terms, pt->word.data);
+	resetStringInfo(&pt->word);
+	pt->bounded = (kind == PATTERN_BOUND);
+}
+
+/*
+ * like_terms
+ *   Words of a LIKE or ILIKE pattern, which is anchored at both ends
+ */
+static List *
+like_terms(const char *pattern)
+{
+	PatternTerms	pt;
+	const char	   *p;
+
+	pattern_start(&pt, true);
+	for (p = pattern; *p; p++)
+	{
+		if (*p == '%' || *p == '_')
+			pattern_atom(&pt, PATTERN_ANY, 0);
+		else if (*p == '\\')
+		{
+			if (*++p == '\0')
+				return NIL;
+			pattern_atom(&pt, PATTERN_CHAR, *p);
+		}
+		else
+			pattern_atom(&pt, PATTERN_CHAR, *p);
+	}
+	pattern_atom(&pt, PATTERN_BOUND, 0);
+
+	return pt.terms;
+}
+
+/*
+ * regex_skip
+ *   Return the last character of the bracket expression or group at p,
+ *   or NULL if it is not terminated
+ */
+static const char *
+regex_skip(const char *p)
+{
+	if (*p == '[')
+	{
+		p++;
+		if (*p == '^')
+			p++;
+		if (*p == ']')
+			p++;
+		for (; *p && *p != ']'; p++)
+		{
+			if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+			{
+				char	delim = p[1];
+
+				for (p += 2; *p && !(p[0] == delim && p[1] == ']'); p++)
+					;
+				if (*p == '\0')
+					return NULL;
+				p++;
+			}
+			else if (*p == '\\' && p[1])
+				p++;
+		}
+		return *p ? p : NULL;
+	}
+
+	Assert(*p == '(');
+	for (p++; *p && *p != ')'; p++)
+	{
+		if (*p == '[' || *p == '(')
+		{
+			if ((p = regex_skip(p)) == NULL)
+				return NULL;
+		}
+		else if (*p == '\\' && p[1])
+			p++;
+	}
+	return *p ? p : NULL;
+}
+
+/*
+ * regex_terms
+ *   Words of a POSIX regular expression, which is not anchored unless it
+ *   says so.  An alternation at the top level, or options that change
+ *   the syntax, leave nothing certain.
+ */
+static List *
+regex_terms(const char *pattern)
+{
+	PatternTerms	pt;
+	const char	   *p;
+
+	if (strncmp(pattern, "***", 3) == 0 || strncmp(pattern, "(?", 2) == 0)
+		return NIL;
+
+	pattern_start(&pt, false);
+	for (p = pattern; *p; p++)
+	{
+		int		kind;
+		char	c = *p;
+
+		switch (c)
+		{
+			case '^':
+			case '$':
+				kind = PATTERN_BOUND;
+				break;
+			case '[':
+			case '(':
+				if ((p = regex_skip(p)) == NULL)
+					return NIL;
+				kind = PATTERN_ANY;
+				break;
+			case '\\':
+				c = *++p;
+				if (c == 'm' || c == 'M' || c == 'y' || c == 'A' || c == 'Z')
+					kind = PATTERN_BOUND;
+				else if (c == '\0')
+					return NIL;
+				else if (WORD_CHAR(c))
+					kind = PATTERN_ANY;		/* class, backreference, ... */
+				else
+					kind = PATTERN_CHAR;
+				break;
+			case '.':
+				kind = PATTERN_ANY;
+				break;
+			case '|':
+			case ')':
+			case '*':
+			case '+':
+			case '?':
+			case '{':
+				return NIL;
+			default:
+				kind = PATTERN_CHAR;
+				break;
+		}
+
+		/* a quantified atom may repeat or vanish */
+		if (p[1] == '*' || p[1] == '+' || p[1] == '?' || p[1] == '{')
+		{
+			kind = PATTERN_ANY;
+			p++;
+			if (*p == '{' && (p = strchr(p, '}')) == NULL)
+				return NIL;
+			if (p[1] == '?')
+				p++;
+		}
+		pattern_atom(&pt, kind, c);
+	}
+	pattern_atom(&pt, PATTERN_ANY, 0);
+
+	return pt.terms;
+}
+
+/*
+ * tsquery_terms
+ *   Lexemes that every match of a tsquery contains
+ */
+static void
+tsquery_terms(QueryItem *item, char *operand, List **terms)
+{
+	check_stack_depth();
+
+	if (item->type == QI_VAL)
+	{
+		QueryOperand   *val = &item->qoperand;
+		char		   *lexeme;
+		int				i;
+
+		if (val->prefix)
+			return;
+		lexeme = pnstrdup(operand + val->distance, val->length);
+		for (i = 0; lexeme[i]; i++)
+		{
+			if (!WORD_CHAR(lexeme[i]))
+				return;
+		}
+		if (i > 0)
+			add_term(terms, lexeme);
+	}
+	else if (item->type == QI_OPR && (item->qoperator.oper == OP_AND
+#ifdef OP_PHRASE
+									  || item->qoperator.oper == OP_PHRASE
+#endif
+			 ))
+	{
+		tsquery_terms(item + 1, operand, terms);
+		tsquery_terms(item + item->qoperator.left, operand, terms);
+	}
+	/* either side of an OR, or a NOT, may match without any word */
+}
+
+/*
+ * twitter_terms
+ *   Add the search terms implied by a LIKE, regular expression or full
+ *   text search clause on the text column, and tell if there were any.
+ *   Full text search is only understood with the simple configuration,
+ *   whose lexemes are the words themselves.
+ */
+static bool
+twitter_terms(Node *node, TupleDesc tupdesc, List **terms)
+{
+	OpExpr	   *op;
+	Node	   *left, *right;
+	List	   *found;
+	ListCell   *l;
+
+	if (node == NULL)
+		return false;
+
+	/*
+	 * A match of an OR contains a word of one of its arms: search for the
+	 * first word of each, as alternatives.  A match of an AND contains the
+	 * words of all of its arms.
+	 */
+	if (IsA(node, BoolExpr) && ((BoolExpr *) node)->boolop == OR_EXPR)
+	{
+		StringInfoData	group;
+
+		found = NIL;
+		foreach(l, ((BoolExpr *) node)->args)
+		{
+			List	   *arm = NIL;
+
+			if (!twitter_terms(lfirst(l), tupdesc, &arm))
+				return false;
+			add_term(&found, linitial(arm));
+		}
+
+		initStringInfo(&group);
+		foreach(l, found)
+		{
+			if (group.len > 0)
+				appendStringInfoString(&group, " OR ");
+			appendStringInfoString(&group, lfirst(l));
+		}
+		add_term(terms, group.data);
+		return true;
+	}
+	if (IsA(node, BoolExpr) && ((BoolExpr *) node)->boolop == AND_EXPR)
+	{
+		bool		any = false;
+
+		foreach(l, ((BoolExpr *) node)->args)
+		{
+			if (twitter_terms(lfirst(l), tupdesc, terms))
+				any = true;
+		}
+		return any;
+	}
+
+	if (!IsA(node, OpExpr))
+		return false;
+	op = (OpExpr *) node;
+	if (list_length(op->args) != 2)
+		return false;
+	left = list_nth(op->args, 0);
+	right = list_nth(op->args, 1);
+	if (op->opfuncid == PROCID_TS_MATCH_QV)
+	{
+		Node	   *tmp = left;
+
+		left = right;
+		right = tmp;
+	}
+	if (!IsA(right, Const) || ((Const *) right)->constisnull)
+		return false;
+
+	found = NIL;
+	switch (op->opfuncid)
+	{
+		case PROCID_TEXTLIKE:
+		case PROCID_TEXTICLIKE:
+			if (is_column(left, tupdesc, "text"))
+				found = like_terms(TextDatumGetCString(((Const *) right)->constvalue));
+			break;
+		case PROCID_TEXTREGEXEQ:
+		case PROCID_TEXTICREGEXEQ:
+			if (is_column(left, tupdesc, "text"))
+				found = regex_terms(TextDatumGetCString(((Const *) right)->constvalue));
+			break;
+		case PROCID_TS_MATCH_VQ:
+		case PROCID_TS_MATCH_QV:
+			if (IsA(left, FuncExpr) &&
+				((FuncExpr *) left)->funcid == PROCID_TO_TSVECTOR_BYID)
+			{
+				FuncExpr   *func = (FuncExpr *) left;
+				Node	   *config = list_nth(func->args, 0);
+
+				if (IsA(config, Const) &&
+					!((Const *) config)->constisnull &&
+					DatumGetObjectId(((Const *) config)->constvalue) == TSCONFIG_SIMPLE &&
+					is_column(list_nth(func->args, 1), tupdesc, "text"))
+				{
+					TSQuery		query;
+
+					query = DatumGetTSQuery(((Const *) right)->constvalue);
+					if (query->size > 0)
+						tsquery_terms(GETQUERY(query), GETOPERAND(query), &found);
+				}
+			}
+			break;
+		default:
+			break;
+	}
+
+	foreach(l, found)
+		add_term(terms, lfirst(l));
+
+	return found != NIL;
+}
+
+/*
+ * prefilter_clause
+ *   A condition on a text field of tweets that can be checked on the field
+ *   as parsed, before a row is formed: = or LIKE a constant pattern of
+ *   literal characters between optional leading and trailing %s, or ILIKE
+ *   such a pattern in ASCII.  Returns NIL for any other condition, or else
+ *   the flags, field offset, pattern and a description for EXPLAIN.
+ *   *exact tells whether the check settles the condition; ILIKE is
+ *   rechecked, as locales may fold other letters to ASCII ones.
+ */
+static List *
+prefilter_clause(Node *node, TupleDesc tupdesc, bool *exact)
+{
+	OpExpr		   *op;
+	Node		   *left;
+	Const		   *right;
+	const char	   *opname;
+	char		   *value;
+	char		   *c;
+	StringInfoData	pattern;
+	StringInfoData	desc;
+	int				flags = 0;
+	int				field;
+
+	if (!IsA(node, OpExpr))
+		return NIL;
+	op = (OpExpr *) node;
+	if (list_length(op->args) != 2)
+		return NIL;
+	left = list_nth(op->args, 0);
+	right = (Const *) list_nth(op->args, 1);
+	if (!IsA(right, Const) || right->constisnull ||
+		right->consttype != TEXTOID)
+		return NIL;
+
+	/* bytes compare as the collation does in deterministic ones only */
+	if (op->inputcollid != DEFAULT_COLLATION_OID &&
+		op->inputcollid != C_COLLATION_OID)
+		return NIL;
+
+	for (field = 0; text_fields[field].name; field++)
+	{
+		if (is_column(left, tupdesc, text_fields[field].name))
+			break;
+	}
+	if (text_fields[field].name == NULL ||
+		TupleDescAttr(tupdesc, ((Var *) left)->varattno - 1)->atttypid != TEXTOID)
+		return NIL;
+
+	value = TextDatumGetCString(right->constvalue);
+	initStringInfo(&pattern);
+	switch (op->opfuncid)
+	{
+		case PROCID_TEXTEQ:
+			opname = "=";
+			flags = PREFILTER_START | PREFILTER_END;
+			appendStringInfoString(&pattern, value);
+			break;
+		case PROCID_TEXTLIKE:
+		case PROCID_TEXTICLIKE:
+			if (op->opfuncid == PROCID_TEXTLIKE)
+				opname = "LIKE";
+			else
+			{
+				opname = "ILIKE";
+				flags |= PREFILTER_ICASE;
+			}
+
+			c = value;
+			if (*c != '%')
+				flags |= PREFILTER_START;
+			while (*c == '%')
+				c++;
+			for (; *c && *c != '%'; c++)
+			{
+				if (*c == '_' || (*c == '\\' && *++c == '\0'))
+					return NIL;
+				/* bytes that may be part of a character are not matched */
+				if (IS_HIGHBIT_SET(*c))
+					return NIL;
+				if (flags & PREFILTER_ICASE)
+					appendStringInfoChar(&pattern, pg_tolower(*c));
+				else
+					appendStringInfoChar(&pattern, *c);
+			}
+			if (*c == '\0')
+				flags |= PREFILTER_END;
+			while (*c == '%')
+				c++;
+			if (*c != '\0')
+				return NIL;		/* % in the middle */
+			break;
+		default:
+			return NIL;
+	}
+
+	initStringInfo(&desc);
+	appendStringInfo(&desc, "%s %s %s", text_fields[field].name, opname,
+					 quote_literal_cstr(value));
+	*exact = !(flags & PREFILTER_ICASE);
+
+	return list_make4(makeInteger(flags),
+					  makeInteger(text_fields[field].offset),
+					  makeString(pattern.data),
+					  makeString(desc.data));
+}
+
+/*
+ * build_url
+ *   The search URL for values of q, ORed, and words narrowing the search.
+ *   The API ANDs words and binds OR tighter, so the words narrow all the
+ *   alternatives.  Words that would make q longer than the API accepts
+ *   are left out; lengths are counted encoded, which errs on the short
+ *   side.  With runtime_q, q is shown as $q, for EXPLAIN.
+ */
+static char *
+build_url(const char *endpoint, List *values, bool runtime_q, List *terms)
+{
+	StringInfoData	url;
+	ListCell	   *l;
+	int				qlen = 0;
+
+	initStringInfo(&url);
+	appendStringInfoString(&url, endpoint);
+	if (values == NIL && !runtime_q && terms == NIL)
+		return url.data;
+
+	appendStringInfoChar(&url, (strchr(endpoint, '?') == NULL) ? '?' : '&');
+	appendStringInfoString(&url, "q=");
+	if (runtime_q)
+	{
+		appendStringInfoString(&url, "$q");
+		qlen += 2;
+	}
+	foreach (l, values)
+	{
+		char	   *value;
+
+		value = percent_encode((unsigned char *) strVal(lfirst(l)), -1);
+		if (qlen > 0)
+		{
+			appendStringInfoString(&url, "%20OR%20");
+			qlen += 8;
+		}
+		appendStringInfoString(&url, value);
+		qlen += strlen(value);
+	}
+	foreach (l, terms)
+	{
+		char	   *term = strVal(lfirst(l));
+		char	   *c;
+		int			len;
+
+		/* letters, digits and the spaces of ORs only */
+		len = strlen(term);
+		for (c = term; *c; c++)
+		{
+			if (*c == ' ')
+				len += 2;
+		}
+		if (qlen + 3 + len > SEARCH_QUERY_MAX)
+			break;
+
+		if (qlen > 0)
+		{
+			appendStringInfoString(&url, "%20");
+			qlen += 3;
+		}
+		for (c = term; *c; c++)
+		{
+			if (*c == ' ')
+				appendStringInfoString(&url, "%20");
+			else
+				appendStringInfoChar(&url, *c);
+		}
+		qlen += len;
+	}
+
+	return url.data;
+}
+
+/*
+ * lookup_url
+ *   The lookup URL for ids, separated by commas.  With runtime_id, the
+ *   ids are shown as $id, for EXPLAIN.
+ */
+static char *
+lookup_url(const char *endpoint, List *ids, bool runtime_id)
+{
+	StringInfoData	url;
+	ListCell	   *l;
+
+	initStringInfo(&url);
+	appendStringInfo(&url, "%s%cid=", endpoint,
+					 (strchr(endpoint, '?') == NULL) ? '?' : '&');
+	if (runtime_id)
+		appendStringInfoString(&url, "$id");
+	foreach (l, ids)
+	{
+		if (l != list_head(ids))
+			appendStringInfoChar(&url, ',');
+		appendStringInfoString(&url, strVal(lfirst(l)));
+	}
+
+	return url.data;
+}
+
+/*
+ * @return fdw_private data, followed by the expression of q if it is only
+ * known at run time (see FDW_PATH_Q_EXPR).  With lookup, the values are
+ * ids to look up instead; NIL if a condition on q asks for a search.
+ */
+static List *
+extract_twitter_conditions(List *conditions, TupleDesc tupdesc,
+						   const char *endpoint, List *paths, bool raw,
+						   bool lookup, Index relid)
+{
+	List		   *result;
+	ListCell	   *l;
+	List		   *param_q;
+	Expr		   *q_expr;
+	bool			q_array;
+	List		   *terms;
+	List		   *term_values;
+	List		   *prefilters;
+	int			   *handle_clauses;
+	int				clause_count;
+
+	result = NIL;
+	param_q = NIL;
+	q_expr = NULL;
+	q_array = false;
+	terms = NIL;
+	prefilters = NIL;
+	handle_clauses = (int *) palloc0(sizeof(int) * list_length(conditions));
+	clause_count = -1;
+	foreach (l, conditions)
+	{
+		RestrictInfo	   *cond = (RestrictInfo *) lfirst(l);
+		List			   *values;
+		List			   *filter;
+		Expr			   *expr = NULL;
+		bool				is_array = false;
+		bool				exact = false;
+
+		/* a tweet looked up has no q to check */
+		if (lookup && twitter_q((Node *) cond->clause, tupdesc) != NIL)
+			return NIL;
+#ifndef OLD_FDW_API
+		if (lookup && clause_param((Node *) cond->clause, tupdesc, relid,
+								   false, &is_array) != NULL)
+			return NIL;
+#endif
+
+		if (lookup)
+			values = twitter_ids((Node *) cond->clause, tupdesc);
+		else
+			values = twitter_q((Node *) cond->clause, tupdesc);
+#ifndef OLD_FDW_API
+		if (values == NIL)
+			expr = clause_param((Node *) cond->clause, tupdesc, relid, lookup,
+								&is_array);
+#endif
+		if (values != NIL && param_q == NIL && q_expr == NULL)
+		{
+			param_q = values;
+
+			/*
+			 * Tweets found for one of several values are attributed to
+			 * the values they match, which the clause then checks; values
+			 * that cannot be ORed are searched for one by one, see
+			 * q_batches().  Ids come back as asked for.
+			 */
+			if (lookup || list_length(values) == 1)
+				handle_clauses[++clause_count] = PUSHDOWN;
+			else
+				handle_clauses[++clause_count] = BOTH;
+		}
+		else if (expr != NULL && param_q == NIL && q_expr == NULL)
+		{
+			q_expr = expr;
+			q_array = is_array;
+			if (is_array && !lookup)
+				handle_clauses[++clause_count] = BOTH;
+			else
+				handle_clauses[++clause_count] = PUSHDOWN;
+		}
+		else if (!lookup &&
+				 twitter_terms((Node *) cond->clause, tupdesc, &terms))
+			handle_clauses[++clause_count] = BOTH;
+		else
+			handle_clauses[++clause_count] = FILTER_LOCALLY;
+
+		/* checked on the tweets as parsed, and no more later if exact */
+		if (handle_clauses[clause_count] != PUSHDOWN &&
+			(filter = prefilter_clause((Node *) cond->clause, tupdesc,
+									   &exact)) != NIL)
+		{
+			prefilters = lappend(prefilters, filter);
+			if (exact)
+				handle_clauses[clause_count] = PUSHDOWN;
+		}
+	}
+
+	term_values = NIL;
+	foreach (l, terms)
+		term_values = lappend(term_values, makeString(lfirst(l)));
+
+	if (lookup)
+		result = lappend(result, lookup_url(endpoint, param_q,
+											q_expr != NULL));
+	else if (list_length(param_q) > 1 && !q_mergeable(param_q))
+	{
+		StringInfoData	urls;
+
+		/* a search per value */
+		initStringInfo(&urls);
+		foreach (l, param_q)
+		{
+			if (urls.len > 0)
+				appendStringInfoString(&urls, ", ");
+			appendStringInfoString(&urls,
+								   build_url(endpoint, list_make1(lfirst(l)),
+											 false, term_values));
+		}
+		result = lappend(result, urls.data);
+	}
+	else
+		result = lappend(result, build_url(endpoint, param_q, q_expr != NULL,
+										   term_values));
+	result = lappend(result, handle_clauses);
+	result = lappend(result, param_q);
+	result = lappend(result, makeString(pstrdup(endpoint)));
+	result = lappend(result, term_values);
+	result = lappend(result, makeInteger(q_array));
+	result = lappend(result, prefilters);
+	result = lappend(result, paths);
+	result = lappend(result, makeInteger(raw));
+	result = lappend(result, makeInteger(lookup));
+	Assert(list_length(result) == FDW_PRIVATE_LAST);
+	result = lappend(result, q_expr);
+
+	return result;
+}
+
+/*
+ * remove_pushdown
+ *   The scan clauses left to evaluate locally.  handle_clauses follows the
+ *   order of the conditions the plan was made from, not that of
+ *   scan_clauses, which the planner may have sorted by cost.
+ */
+static List *
+remove_pushdown(List *scan_clauses, List *conditions, int *handle_clauses)
+{
+	List	   *keep_clauses;
+
+	if (handle_clauses != NULL)
+	{
+		List		   *pushed;
+		int				i;
+		ListCell	   *l;
+
+		i = 0;
+		pushed = NIL;
+		foreach(l, conditions)
+		{
+			if (handle_clauses[i] == PUSHDOWN)
+				pushed = lappend(pushed, lfirst(l));
+			i++;
+		}
+
+		keep_clauses = NIL;
+		foreach(l, scan_clauses)
+		{
+			RestrictInfo	   *condition = lfirst(l);
+
+			if (!list_member_ptr(pushed, condition))
+				keep_clauses = lappend(keep_clauses, condition);
+		}
+	}
+	else
+		keep_clauses = scan_clauses;
+
+	return keep_clauses;
+}
+
+#ifndef OLD_FDW_API
+/*
+ * twitter_paths
+ *   Compile the json_path options of the columns of relation into the
+ *   trie parse_tweet() follows, each path ending in a slot of Tweet.paths.
+ *   Returns the trie, as a list of (key, parent, slot) nodes the first of
+ *   which is the tweet, and the slot of each column, -1 for none; or NIL
+ *   if no column has a path.
+ */
+static List *
+twitter_paths(Relation relation)
+{
+	TupleDesc	tupdesc = relation->rd_att;
+	List	   *nodes;
+	List	   *slots = NIL;
+	bool		found = false;
+	int			nslots = 0;
+	int			i;
+
+	nodes = list_make1(list_make3(makeString(""), makeInteger(-1),
+								  makeInteger(-1)));
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		List	   *keys = NIL;
+		List	   *leaf;
+		ListCell   *l;
+		int			node = 0;
+
+		if (!TupleDescAttr(tupdesc, i)->attisdropped)
+		{
+			foreach(l, GetForeignColumnOptions(RelationGetRelid(relation), i + 1))
+			{
+				DefElem	   *def = (DefElem *) lfirst(l);
+
+				if (strcmp(def->defname, "json_path") == 0)
+					keys = json_path_keys(defGetString(def));
+			}
+		}
+		if (keys == NIL)
+		{
+			slots = lappend_int(slots, -1);
+			continue;
+		}
+
+		/* follow the path down the trie, growing it where it ends */
+		foreach(l, keys)
+		{
+			char	   *key = strVal(lfirst(l));
+			ListCell   *n;
+			int			child = 0;
+
+			foreach(n, nodes)
+			{
+				List	   *item = (List *) lfirst(n);
+
+				if (intVal(lsecond(item)) == node &&
+					strcmp(strVal(linitial(item)), key) == 0)
+					break;
+				child++;
+			}
+			if (n == NULL)
+				nodes = lappend(nodes, list_make3(lfirst(l), makeInteger(node),
+												  makeInteger(-1)));
+			node = child;
+		}
+
+		/* columns of the same path share its slot */
+		leaf = (List *) list_nth(nodes, node);
+		if (intVal(lthird(leaf)) < 0)
+			intVal(lthird(leaf)) = nslots++;
+		slots = lappend_int(slots, intVal(lthird(leaf)));
+		found = true;
+	}
+
+	return found ? list_make2(nodes, slots) : NIL;
+}
+
+/*
+ * path_tupdesc
+ *   The columns as conditions on them see them: one given a json_path no
+ *   longer stands for the field of its name, so it is left nameless
+ */
+static TupleDesc
+path_tupdesc(TupleDesc tupdesc, List *paths)
+{
+	ListCell   *l;
+	int			i = 0;
+
+	if (paths == NIL)
+		return tupdesc;
+
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	foreach(l, (List *) lsecond(paths))
+	{
+		if (lfirst_int(l) >= 0)
+			NameStr(TupleDescAttr(tupdesc, i)->attname)[0] = '\0';
+		i++;
+	}
+
+	return tupdesc;
+}
+
+/*
+ * raw_needed
+ *   Whether the query reads the raw column, in its target list or its
+ *   conditions; tweets are only kept as jsonb then
+ */
+static bool
+raw_needed(RelOptInfo *baserel, TupleDesc tupdesc)
+{
+#if PG_VERSION_NUM >= 90400
+	Bitmapset  *attrs = NULL;
+	ListCell   *l;
+	int			i;
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute	attr = TupleDescAttr(tupdesc, i);
+
+		if (!attr->attisdropped && attr->atttypid == JSONBOID &&
+			strcmp(NameStr(attr->attname), "raw") == 0)
+			break;
+	}
+	if (i == tupdesc->natts)
+		return false;
+
+#if PG_VERSION_NUM >= 90600
+	pull_varattnos((Node *) baserel->reltarget->exprs, baserel->relid, &attrs);
+#else
+	pull_varattnos((Node *) baserel->reltargetlist, baserel->relid, &attrs);
+#endif
+	foreach(l, baserel->baserestrictinfo)
+		pull_varattnos((Node *) ((RestrictInfo *) lfirst(l))->clause,
+					   baserel->relid, &attrs);
+
+	/* a whole-row reference reads every column */
+	return bms_is_member(i + 1 - FirstLowInvalidHeapAttributeNumber, attrs) ||
+		bms_is_member(0 - FirstLowInvalidHeapAttributeNumber, attrs);
+#else
+	return false;
+#endif
+}
+#endif
+
+#ifdef OLD_FDW_API
+/*
+ * twitterPlan
+ *   Create a FdwPlan, which is empty for now.
+ */
+static FdwPlan *
+twitterPlan(Oid foreigntableid, PlannerInfo *root, RelOptInfo *baserel)
+{
+	FdwPlan	   *fdwplan;
+	Relation	relation;
+	TupleDesc	tupdesc;
+	int		   *handle_clauses;
+
+	fdwplan = makeNode(FdwPlan);
+	relation = relation_open(foreigntableid, AccessShareLock);
+	tupdesc = relation->rd_att;
+	/* columns have no options before 9.2, nor is there jsonb */
+	fdwplan->fdw_private = extract_twitter_conditions(baserel->baserestrictinfo, tupdesc,
+													  twitter_endpoint(foreigntableid, false),
+													  NIL, false, false, baserel->relid);
+	fdwplan->fdw_private = list_truncate(fdwplan->fdw_private, FDW_PRIVATE_LAST);
+	relation_close(relation, AccessShareLock);
+
+	handle_clauses = list_nth(fdwplan->fdw_private, FDW_PRIVATE_CLAUSES);
+	baserel->baserestrictinfo =
+		remove_pushdown(baserel->baserestrictinfo, baserel->baserestrictinfo,
+						handle_clauses);
+
+	return fdwplan;
+}
+
+#else
+
+static void
+twitterGetRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
+{
+	Relation	relation;
+	List	   *paths;
+	TupleDesc	tupdesc;
+	ListCell   *l;
+
+	/* API returns at most 15 results by default */
+	baserel->rows = 15;
+
+	/* and a lookup one per id */
+	relation = relation_open(foreigntableid, AccessShareLock);
+	paths = twitter_paths(relation);
+	tupdesc = path_tupdesc(relation->rd_att, paths);
+	foreach(l, baserel->baserestrictinfo)
+	{
+		RestrictInfo   *rinfo = (RestrictInfo *) lfirst(l);
+		List		   *ids = twitter_ids((Node *) rinfo->clause, tupdesc);
+
+		if (ids != NIL)
+		{
+			baserel->rows = list_length(ids);
+			break;
+		}
+	}
+	relation_close(relation, AccessShareLock);
+
+	/* the json_path options, for twitterGetPaths() */
+	baserel->fdw_private = paths;
+}
+
+#if PG_VERSION_NUM >= 90300
+static bool
+ec_member_is_q(PlannerInfo *root, RelOptInfo *rel, EquivalenceClass *ec,
+			   EquivalenceMember *em, void *arg)
+{
+	return is_column((Node *) em->em_expr, (TupleDesc) arg, "q");
+}
+
+static bool
+ec_member_is_id(PlannerInfo *root, RelOptInfo *rel, EquivalenceClass *ec,
+				EquivalenceMember *em, void *arg)
+{
+	return is_column((Node *) em->em_expr, (TupleDesc) arg, "id");
+}
+#endif
+
+/*
+ * join_outers
+ *   The sets of other relations q, or with lookup id, is joined to, each
+ *   of which makes a parameterized path: the scan then searches for the q
+ *   or looks up the id of every outer row in turn.  It is only given one
+ *   outer row at a time, so only the values of an array parameter can be
+ *   batched.
+ */
+static List *
+join_outers(PlannerInfo *root, RelOptInfo *baserel, TupleDesc tupdesc,
+			bool lookup)
+{
+	List	   *clauses;
+	List	   *outers;
+	ListCell   *l;
+
+	clauses = NIL;
+	foreach(l, baserel->joininfo)
+	{
+		RestrictInfo   *rinfo = (RestrictInfo *) lfirst(l);
+
+#if PG_VERSION_NUM >= 90500
+		if (join_clause_is_movable_to(rinfo, baserel))
+#else
+		if (join_clause_is_movable_to(rinfo, baserel->relid))
+#endif
+			clauses = lappend(clauses, rinfo);
+	}
+#if PG_VERSION_NUM >= 90300
+	/* q = other.column lives in an equivalence class rather than joininfo */
+	if (baserel->has_eclass_joins)
+		clauses = list_concat(clauses,
+							  generate_implied_equalities_for_column(root, baserel,
+																	 lookup ? ec_member_is_id : ec_member_is_q,
+																	 (void *) tupdesc,
+																	 baserel->lateral_referencers));
+#endif
+
+	outers = NIL;
+	foreach(l, clauses)
+	{
+		RestrictInfo   *rinfo = (RestrictInfo *) lfirst(l);
+		Relids			required_outer;
+		bool			is_array;
+		ListCell	   *o;
+
+		if (clause_param((Node *) rinfo->clause, tupdesc, baserel->relid,
+						 lookup, &is_array) == NULL)
+			continue;
+		required_outer = bms_difference(rinfo->clause_relids, baserel->relids);
+		if (bms_is_empty(required_outer))
+			continue;
+
+		foreach(o, outers)
+		{
+			if (bms_equal(lfirst(o), required_outer))
+				break;
+		}
+		if (o == NULL)
+			outers = lappend(outers, required_outer);
+	}
+
+	return outers;
+}
+
+/*
+ * twitter_path
+ *   A foreign path of the scan, unordered, whose arguments have grown
+ *   from release to release
+ */
+static Path *
+twitter_path(PlannerInfo *root, RelOptInfo *baserel, double rows,
+			 Cost startup_cost, Cost total_cost, Relids required_outer,
+			 List *fdw_private)
+{
+#if PG_VERSION_NUM >= 170000
+	return (Path *) create_foreignscan_path(root, baserel, NULL, rows,
+											startup_cost, total_cost, NIL,
+											required_outer, NULL, NIL,
+											fdw_private);
+#elif PG_VERSION_NUM >= 90600
+	return (Path *) create_foreignscan_path(root, baserel, NULL, rows,
+											startup_cost, total_cost, NIL,
+											required_outer, NULL,
+											fdw_private);
+#elif PG_VERSION_NUM >= 90500
+	return (Path *) create_foreignscan_path(root, baserel, rows,
+											startup_cost, total_cost, NIL,
+											required_outer, NULL,
+											fdw_private);
+#else
+	return (Path *) create_foreignscan_path(root, baserel, rows,
+											startup_cost, total_cost, NIL,
+											required_outer, fdw_private);
+#endif
+}
+
+/*
+ * add_join_paths
+ *   Add a parameterized path for each set of relations in outers, which
+ *   give q to the scan, or with lookup ids
+ */
+static void
+add_join_paths(PlannerInfo *root, RelOptInfo *baserel, TupleDesc tupdesc,
+			   List *outers, const char *endpoint, List *paths, bool raw,
+			   bool lookup)
+{
+	ListCell   *l;
+
+	foreach(l, outers)
+	{
+		Relids			required_outer = (Relids) lfirst(l);
+		ParamPathInfo  *param_info;
+		List		   *conditions;
+		List		   *fdw_private;
+
+		param_info = get_baserel_parampathinfo(root, baserel, required_outer);
+		conditions = list_concat(list_copy(baserel->baserestrictinfo),
+								 list_copy(param_info->ppi_clauses));
+		fdw_private = extract_twitter_conditions(conditions, tupdesc,
+												 endpoint, paths, raw, lookup,
+												 baserel->relid);
+		if (fdw_private == NIL ||
+			list_nth(fdw_private, FDW_PATH_Q_EXPR) == NULL)
+			continue;
+
+		/*
+		 * A request per rescan, that is per outer row of a nested loop;
+		 * a lookup returns the tweet of that row.
+		 */
+		add_path(baserel,
+				 twitter_path(root, baserel, lookup ? 1 : baserel->rows, 10,
+							  10 + (lookup ? LOOKUP_COST : SEARCH_COST),
+							  required_outer, fdw_private));
+	}
+}
+
+static void
+twitterGetPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
+{
+	Relation	relation;
+	TupleDesc	tupdesc;
+	char	   *endpoint;
+	char	   *lookup_endpoint;
+	List	   *paths = (List *) baserel->fdw_private;
+	bool		raw;
+	List	   *fdw_private;
+	List	   *lookup;
+	List	   *outers;
+	List	   *lookup_outers = NIL;
+	bool		has_q;
+	bool		has_ids = false;
+	Cost		total_cost;
+
+	relation = relation_open(foreigntableid, AccessShareLock);
+	tupdesc = path_tupdesc(relation->rd_att, paths);
+	raw = raw_needed(baserel, tupdesc);
+	endpoint = twitter_endpoint(foreigntableid, false);
+	fdw_private = extract_twitter_conditions(baserel->baserestrictinfo, tupdesc,
+											 endpoint, paths, raw, false,
+											 baserel->relid);
+	has_q = list_nth(fdw_private, FDW_PRIVATE_PARAM_Q) != NIL ||
+		list_nth(fdw_private, FDW_PATH_Q_EXPR) != NULL;
+	outers = join_outers(root, baserel, tupdesc, false);
+
+	/* ids to look up, as long as q does not ask for a search */
+	lookup_endpoint = twitter_endpoint(foreigntableid, true);
+	lookup = extract_twitter_conditions(baserel->baserestrictinfo, tupdesc,
+										lookup_endpoint, paths, raw, true,
+										baserel->relid);
+	if (lookup != NIL)
+	{
+		has_ids = list_nth(lookup, FDW_PRIVATE_PARAM_Q) != NIL ||
+			list_nth(lookup, FDW_PATH_Q_EXPR) != NULL;
+		lookup_outers = join_outers(root, baserel, tupdesc, true);
+	}
+
+	/*
+	 * A search per batch of the values of q.  A scan without q searches
+	 * for nothing a join on q could use, nor for the tweets of given ids:
+	 * rule it out when the tweets can be looked up instead, and count
+	 * the requests a join can make before it when the join can give q,
+	 * or id, to the scan.
+	 */
+	total_cost = 10 + SEARCH_COST *
+		Max(list_length(q_batches(list_nth(fdw_private,
+										   FDW_PRIVATE_PARAM_Q), false)), 1);
+	if (!has_q && has_ids)
+		total_cost += disable_cost;
+	else if (!has_q && outers != NIL)
+		total_cost += SEARCH_COST * JOIN_MAX_REQUESTS;
+	else if (!has_q && lookup_outers != NIL)
+		total_cost += LOOKUP_COST * JOIN_MAX_REQUESTS;
+
+	/* Create a ForeignPath node and add it as only possible path */
+	add_path(baserel,
+			 twitter_path(root, baserel, baserel->rows, 10, total_cost,
+						  NULL, fdw_private));
+
+	/* and one per set of relations q is joined to */
+	add_join_paths(root, baserel, tupdesc, outers, endpoint, paths, raw,
+				   false);
+
+	/*
+	 * Lookups make a request per batch of ids, each much cheaper than a
+	 * search, and per outer row when id is joined to other relations.
+	 */
+	if (has_ids)
+	{
+		List	   *ids = list_nth(lookup, FDW_PRIVATE_PARAM_Q);
+		int			nrequests = 1;
+
+		if (ids != NIL)
+			nrequests = (list_length(ids) + twitter_batch_size - 1) /
+				twitter_batch_size;
+		add_path(baserel,
+				 twitter_path(root, baserel, baserel->rows, 10,
+							  10 + LOOKUP_COST * nrequests, NULL, lookup));
+	}
+	add_join_paths(root, baserel, tupdesc, lookup_outers, lookup_endpoint,
+				   paths, raw, true);
+	relation_close(relation, AccessShareLock);
+}
+
+static ForeignScan *
+#if PG_VERSION_NUM >= 90500
+twitterGetPlan(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid,
+			   ForeignPath *best_path, List *tlist, List *scan_clauses,
+			   Plan *outer_plan)
+#else
+twitterGetPlan(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid,
+			   ForeignPath *best_path, List *tlist, List *scan_clauses)
+#endif
+{
+	List	   *fdw_private = best_path->fdw_private;
+	List	   *conditions;
+	List	   *keep_clauses;
+	List	   *fdw_exprs;
+	Expr	   *q_expr;
+	int		   *handle_clauses;
+
+	/* the conditions the path was made from, in the same order */
+	conditions = baserel->baserestrictinfo;
+	if (best_path->path.param_info)
+		conditions = list_concat(list_copy(conditions),
+								 list_copy(best_path->path.param_info->ppi_clauses));
+
+	handle_clauses = list_nth(fdw_private, FDW_PRIVATE_CLAUSES);
+	keep_clauses = remove_pushdown(scan_clauses, conditions, handle_clauses);
+
+	/* remove the RestrictInfo node from all remaining clauses */
+	keep_clauses = extract_actual_clauses(keep_clauses, false);
+
+	/* the executor sets up outer columns in fdw_exprs as parameters */
+	fdw_exprs = NIL;
+	q_expr = list_nth(fdw_private, FDW_PATH_Q_EXPR);
+	if (q_expr != NULL)
+		fdw_exprs = list_make1(q_expr);
+	fdw_private = list_truncate(list_copy(fdw_private), FDW_PRIVATE_LAST);
+
+#if PG_VERSION_NUM >= 90600
+	return make_foreignscan(tlist, keep_clauses, baserel->relid, fdw_exprs,
+							fdw_private, NIL, NIL, outer_plan);
+#elif PG_VERSION_NUM >= 90500
+	return make_foreignscan(tlist, keep_clauses, baserel->relid, fdw_exprs,
+							fdw_private, NIL);
+#else
+	return make_foreignscan(tlist, keep_clauses, baserel->relid, fdw_exprs,
+							fdw_private);
+#endif
+}
+
+static bool
+twitterAnalyze(Relation relation, AcquireSampleRowsFunc *func, BlockNumber *totalpages)
+{
+	*totalpages = 42;
+	return true;
+}
+
+#endif   /* OLD_FDW_API */
+
+/*
+ * twitterExplain
+ *   Produce extra output for EXPLAIN
+ */
+static void
+twitterExplain(ForeignScanState *node, ExplainState *es)
+{
+#ifdef OLD_FDW_API
+	List		   *fdw_private =
+		((FdwPlan *) ((ForeignScan *) node->ss.ps.plan)->fdwplan)->fdw_private;
+#else
+	List		   *fdw_private =
+		((ForeignScan *)node->ss.ps.plan)->fdw_private;
+#endif
+	StringInfoData	api;
+	List		   *prefilters;
+	TwitterReply   *reply = (TwitterReply *) node->fdw_state;
+
+	/* the URLs of alternatives searched one by one can be long */
+	initStringInfo(&api);
+	appendStringInfo(&api, "%s: %s",
+					 intVal(list_nth(fdw_private, FDW_PRIVATE_LOOKUP)) ? "Lookup" : "Search",
+					 (char *) list_nth(fdw_private, FDW_PRIVATE_URL));
+	ExplainPropertyText("Twitter API", api.data, es);
+
+	prefilters = list_nth(fdw_private, FDW_PRIVATE_PREFILTERS);
+	if (prefilters != NIL)
+	{
+		StringInfoData	str;
+		ListCell	   *l;
+
+		initStringInfo(&str);
+		foreach(l, prefilters)
+		{
+			if (str.len > 0)
+				appendStringInfoString(&str, " AND ");
+			appendStringInfoString(&str, strVal(lfourth((List *) lfirst(l))));
+		}
+		ExplainPropertyText("Twitter Prefilter", str.data, es);
+	}
+
+	if (es->analyze && reply)
+		explain_scan_stats(&reply->stats, es);
+}
+
+/*
+ * explain_scan_stats
+ *   Show where the time of a scan went, in the style of buffer usage:
+ *   one line per group for text, one property per counter otherwise
+ */
+static void
+explain_scan_stats(TwitterScanStats *stats, ExplainState *es)
+{
+	double		parse_ms = INSTR_TIME_GET_MILLISEC(stats->parse_time);
+	double		convert_ms = INSTR_TIME_GET_MILLISEC(stats->convert_time);
+
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		appendStringInfoSpaces(es->str, es->indent * 2);
+		appendStringInfo(es->str,
+						 "Twitter Requests: %ld  Pages: %ld  Coalesced: %ld  Cache Hits: %ld  Retries: %ld  Bytes: %ld\n",
+						 stats->requests, stats->pages, stats->coalesced,
+						 stats->cache_hits, stats->retries, stats->bytes);
+		if (stats->requests > 0)
+		{
+			appendStringInfoSpaces(es->str, es->indent * 2);
+			appendStringInfo(es->str,
+							 "Twitter Network: dns=%.3f connect=%.3f tls=%.3f wait=%.3f transfer=%.3f ms\n",
+							 stats->dns_time * 1000.0,
+							 stats->connect_time * 1000.0,
+							 stats->tls_time * 1000.0,
+							 stats->wait_time * 1000.0,
+							 stats->transfer_time * 1000.0);
+		}
+		if (stats->timing)
+		{
+			appendStringInfoSpaces(es->str, es->indent * 2);
+			appendStringInfo(es->str,
+							 "Twitter CPU: parse=%.3f convert=%.3f ms\n",
+							 parse_ms, convert_ms);
+		}
+		if (stats->prefiltered > 0)
+		{
+			appendStringInfoSpaces(es->str, es->indent * 2);
+			appendStringInfo(es->str, "Rows Removed by Twitter Prefilter: %ld\n",
+							 stats->prefiltered);
+		}
+		if (stats->completed_in)
+		{
+			appendStringInfoSpaces(es->str, es->indent * 2);
+			appendStringInfo(es->str, "Twitter Completed In: %s s\n",
+							 stats->completed_in);
+		}
+	}
+	else
+	{
+		ExplainPropertyLong("Twitter Requests", stats->requests, es);
+		ExplainPropertyLong("Twitter Pages", stats->pages, es);
+		ExplainPropertyLong("Twitter Coalesced", stats->coalesced, es);
+		ExplainPropertyLong("Twitter Cache Hits", stats->cache_hits, es);
+		ExplainPropertyLong("Twitter Retries", stats->retries, es);
+		ExplainPropertyLong("Twitter Bytes", stats->bytes, es);
+		ExplainPropertyFloat("Twitter DNS Time", stats->dns_time * 1000.0, 3, es);
+		ExplainPropertyFloat("Twitter Connect Time", stats->connect_time * 1000.0, 3, es);
+		ExplainPropertyFloat("Twitter TLS Time", stats->tls_time * 1000.0, 3, es);
+		ExplainPropertyFloat("Twitter Wait Time", stats->wait_time * 1000.0, 3, es);
+		ExplainPropertyFloat("Twitter Transfer Time", stats->transfer_time * 1000.0, 3, es);
+		if (stats->timing)
+		{
+			ExplainPropertyFloat("Twitter Parse Time", parse_ms, 3, es);
+			ExplainPropertyFloat("Twitter Convert Time", convert_ms, 3, es);
+		}
+		ExplainPropertyLong("Rows Removed by Twitter Prefilter",
+							stats->prefiltered, es);
+		if (stats->completed_in)
+			ExplainPropertyText("Twitter Completed In", stats->completed_in, es);
+	}
+}
+
+/*
+ * twitterBegin
+ *   Set up the scan; the search is made on the first row asked for, once
+ *   the parameters giving q have their values
+ */
+static void
+twitterBegin(ForeignScanState *node, int eflags)
+{
+#ifdef OLD_FDW_API
+	List		   *fdw_private =
+		((FdwPlan *) ((ForeignScan *) node->ss.ps.plan)->fdwplan)->fdw_private;
+#else
+	List		   *fdw_private =
+		((ForeignScan *)node->ss.ps.plan)->fdw_private;
+	List		   *fdw_exprs =
+		((ForeignScan *)node->ss.ps.plan)->fdw_exprs;
+#endif
+	Relation		rel;
+	TwitterReply   *reply;
+	TwitterLimits	limits;
+	List		   *prefilters;
+	List		   *paths;
+	bool			raw;
+	ListCell	   *l;
+	int				i = 0;
+
+	/*
+	 * Do nothing in EXPLAIN
+	 */
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	Assert(list_length(fdw_private) == FDW_PRIVATE_LAST);
+
+	reply = (TwitterReply *) palloc0(sizeof(TwitterReply));
+	/* time parsing and conversion only under EXPLAIN ANALYZE and the like */
+	reply->stats.timing = (node->ss.ps.instrument != NULL);
+
+	reply->endpoint = strVal(list_nth(fdw_private, FDW_PRIVATE_ENDPOINT));
+	reply->terms = list_nth(fdw_private, FDW_PRIVATE_TERMS);
+	reply->param_q = list_nth(fdw_private, FDW_PRIVATE_PARAM_Q);
+	reply->q_array = intVal(list_nth(fdw_private, FDW_PRIVATE_Q_ARRAY));
+	reply->lookup = intVal(list_nth(fdw_private, FDW_PRIVATE_LOOKUP));
+#ifndef OLD_FDW_API
+	if (fdw_exprs != NIL)
+	{
+		reply->q_state = ExecInitExpr((Expr *) linitial(fdw_exprs),
+									  (PlanState *) node);
+		reply->q_type = exprType((Node *) linitial(fdw_exprs));
+	}
+#endif
+	reply->batch_cxt = AllocSetContextCreate(CurrentMemoryContext,
+											 "twitter_fdw batches",
+											 ALLOCSET_DEFAULT_MINSIZE,
+											 ALLOCSET_DEFAULT_INITSIZE,
+											 ALLOCSET_DEFAULT_MAXSIZE);
+
+	rel = node->ss.ss_currentRelation;
+	reply->stats.key.dbid = MyDatabaseId;
+	reply->stats.key.serverid =
+		GetForeignTable(RelationGetRelid(rel))->serverid;
+	twitter_limits(reply->stats.key.serverid, &limits);
+	paths = list_nth(fdw_private, FDW_PRIVATE_PATHS);
+	raw = intVal(list_nth(fdw_private, FDW_PRIVATE_RAW));
+	reply->parser = parser_create(&limits, paths, raw);
+	/* only tweets parsed into the same values can be shared */
+	if (paths != NIL || raw)
+	{
+		StringInfoData	buf;
+
+		initStringInfo(&buf);
+		if (paths != NIL)
+			appendStringInfoString(&buf, nodeToString(linitial(paths)));
+		if (raw)
+			appendStringInfoString(&buf, " raw");
+		reply->parse_key = buf.data;
+	}
+
+	prefilters = list_nth(fdw_private, FDW_PRIVATE_PREFILTERS);
+	reply->nprefilters = list_length(prefilters);
+	if (reply->nprefilters > 0)
+	{
+		reply->prefilters = (Prefilter *)
+			palloc(sizeof(Prefilter) * reply->nprefilters);
+		foreach(l, prefilters)
+			prefilter_compile(&reply->prefilters[i++], lfirst(l));
+	}
+
+	/*
+	 * Rows are kept when the scan is to be read again as is, or for
+	 * other values of q that may come back.
+	 */
+	reply->spooling = (eflags & EXEC_FLAG_REWIND) != 0 ||
+		(reply->q_state != NULL && twitter_rescan_cache > 0);
+	if (reply->spooling)
+	{
+		reply->spool_cxt = AllocSetContextCreate(CurrentMemoryContext,
+												 "twitter_fdw spools",
+												 ALLOCSET_DEFAULT_MINSIZE,
+												 ALLOCSET_DEFAULT_INITSIZE,
+												 ALLOCSET_DEFAULT_MAXSIZE);
+#if PG_VERSION_NUM >= 120000
+		/* a tuplestore gives minimal tuples, which a heap slot won't take */
+		reply->spool_slot =
+			MakeSingleTupleTableSlot(RelationGetDescr(node->ss.ss_currentRelation),
+									 &TTSOpsMinimalTuple);
+#endif
+	}
+
+	reply->attinmeta = TupleDescGetAttInMetadata(rel->rd_att);
+	reply->columns = plan_columns(rel->rd_att,
+								  paths != NIL ? lsecond(paths) : NIL);
+	reply->started = false;
+	node->fdw_state = (void *) reply;
+}
+
+/*
+ * q_values
+ *   Evaluate the expression giving q, or the ids to look up, into the
+ *   batch context
+ */
+static List *
+q_values(ForeignScanState *node, TwitterReply *reply)
+{
+	ExprContext	   *econtext = node->ss.ps.ps_ExprContext;
+	MemoryContext	oldcontext;
+	List		   *values = NIL;
+	Datum			value;
+	bool			isnull;
+
+	ResetExprContext(econtext);
+	oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+#if PG_VERSION_NUM >= 100000
+	value = ExecEvalExpr(reply->q_state, econtext, &isnull);
+#else
+	value = ExecEvalExpr(reply->q_state, econtext, &isnull, NULL);
+#endif
+
+	MemoryContextSwitchTo(reply->batch_cxt);
+	if (isnull)
+		values = NIL;
+	else if (!reply->q_array)
+		values = add_q(NIL, reply->lookup ? id_text(value, reply->q_type) :
+					   TextDatumGetCString(value));
+	else
+	{
+		ArrayType  *array = DatumGetArrayTypeP(value);
+		Oid			elemtype = ARR_ELEMTYPE(array);
+		int16		typlen;
+		bool		typbyval;
+		char		typalign;
+		Datum	   *elems;
+		bool	   *nulls;
+		int			nelems;
+		int			i;
+
+		get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+		deconstruct_array(array, elemtype, typlen, typbyval, typalign,
+						  &elems, &nulls, &nelems);
+		for (i = 0; i < nelems; i++)
+		{
+			if (nulls[i])
+				continue;
+			values = add_q(values, reply->lookup ?
+						   id_text(elems[i], elemtype) :
+						   TextDatumGetCString(elems[i]));
+		}
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	return values;
+}
+
+/*
+ * q_batches
+ *   Split values of q into the searches to make, each for up to
+ *   twitter_fdw.batch_size of them ORed, within the length the API
+ *   accepts.  Values that cannot be ORed are searched for one by one.
+ *   Ids to look up always go up to twitter_fdw.batch_size at a time.
+ */
+static List *
+q_batches(List *values, bool lookup)
+{
+	List	   *batches = NIL;
+	List	   *batch = NIL;
+	bool		merge = lookup || q_mergeable(values);
+	int			qlen = 0;
+	ListCell   *l;
+
+	foreach(l, values)
+	{
+		int			len;
+
+		len = strlen(percent_encode((unsigned char *) strVal(lfirst(l)), -1));
+		if (batch != NIL &&
+			(!merge || list_length(batch) >= twitter_batch_size ||
+			 (!lookup && qlen + 8 + len > SEARCH_QUERY_MAX)))
+		{
+			batches = lappend(batches, batch);
+			batch = NIL;
+			qlen = 0;
+		}
+		qlen += (batch != NIL ? 8 : 0) + len;
+		batch = lappend(batch, lfirst(l));
+	}
+	if (batch != NIL)
+		batches = lappend(batches, batch);
+
+	return batches;
+}
+
+/*
+ * reply_start
+ *   Work out the searches for the values of q, and make the first one
+ */
+static void
+reply_start(ForeignScanState *node, TwitterReply *reply)
+{
+	MemoryContext	oldcontext;
+	List		   *values;
+
+	parse_finish(reply->parser, &reply->stats);
+	reply->root = NULL;
+	MemoryContextReset(reply->batch_cxt);
+
+	values = reply->param_q;
+	if (reply->q_state)
+		values = q_values(node, reply);
+
+	reply->started = true;
+	if (reply->spooling)
+	{
+		ListCell   *l;
+
+		/* read the rows again if these values of q were searched for */
+		reply->replay = false;
+		if (reply->q_state && reply->spool && reply->spool->complete &&
+			equal(reply->spool->key, values))
+			reply->replay = true;
+		else if (reply->q_state)
+		{
+			foreach(l, reply->spools)
+			{
+				TwitterSpool   *spool = (TwitterSpool *) lfirst(l);
+
+				if (equal(spool->key, values))
+				{
+					spool_drop(reply);
+					oldcontext = MemoryContextSwitchTo(reply->spool_cxt);
+					reply->spools = lcons(spool,
+										  list_delete_ptr(reply->spools, spool));
+					MemoryContextSwitchTo(oldcontext);
+					reply->spool = spool;
+					reply->replay = true;
+					break;
+				}
+			}
+		}
+		if (reply->replay)
+		{
+			reply->stats.cache_hits++;
+			tuplestore_rescan(reply->spool->store);
+			reply->batches = NIL;
+			return;
+		}
+		spool_start(reply, values);
+	}
+
+	oldcontext = MemoryContextSwitchTo(reply->batch_cxt);
+	if (values == NIL && reply->q_state == NULL)
+		reply->batches = list_make1(NIL);		/* a search without q */
+	else
+		reply->batches = q_batches(values, reply->lookup);
+	MemoryContextSwitchTo(oldcontext);
+
+	reply->batchno = 0;
+	if (reply->batches != NIL)
+		reply_fetch(reply);
+}
+
+/*
+ * spool_drop
+ *   Let the current spool go, unless it is kept for rescans
+ */
+static void
+spool_drop(TwitterReply *reply)
+{
+	if (reply->spool && !list_member_ptr(reply->spools, reply->spool))
+	{
+		tuplestore_end(reply->spool->store);
+		pfree(reply->spool);
+	}
+	reply->spool = NULL;
+}
+
+/*
+ * spool_start
+ *   Keep the rows of the scan starting for values of q in a new spool
+ */
+static void
+spool_start(TwitterReply *reply, List *key)
+{
+	MemoryContext	oldcontext;
+
+	spool_drop(reply);
+	oldcontext = MemoryContextSwitchTo(reply->spool_cxt);
+	reply->spool = (TwitterSpool *) palloc0(sizeof(TwitterSpool));
+	reply->spool->key = copyObject(key);
+	reply->spool->store = tuplestore_begin_heap(false, false, work_mem);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * spool_done
+ *   The scan has returned all its rows.  Keep the spool among the
+ *   twitter_fdw.rescan_cache latest ones, and let the tweets go: rescans
+ *   read the spool from now on.
+ */
+static void
+spool_done(TwitterReply *reply)
+{
+	TwitterSpool   *spool = reply->spool;
+	MemoryContext	oldcontext;
+
+	if (spool == NULL || spool->complete)
+		return;
+	spool->complete = true;
+
+	/* rows are fetched in a per-tuple context, but the list lasts */
+	if (reply->q_state && twitter_rescan_cache > 0)
+	{
+		oldcontext = MemoryContextSwitchTo(reply->spool_cxt);
+		reply->spools = lcons(spool, reply->spools);
+		while (list_length(reply->spools) > twitter_rescan_cache)
+		{
+			TwitterSpool   *oldest = (TwitterSpool *) llast(reply->spools);
+
+			reply->spools = list_delete_ptr(reply->spools, oldest);
+			tuplestore_end(oldest->store);
+			pfree(oldest);
+		}
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	parse_finish(reply->parser, &reply->stats);
+	MemoryContextReset(reply->parser->results_cxt);
+	reply->root = NULL;
+}
+
+/*
+ * reply_fetch
+ *   Make the search for the current batch of values of q, or the lookup
+ *   of the current batch of ids
+ */
+static void
+reply_fetch(TwitterReply *reply)
+{
+	MemoryContext	oldcontext;
+	ResultRoot	   *root;
+	char		   *url;
+	char		   *flight_key;
+	int				slot;
+	bool			leader;
+	long			coalesced = reply->stats.coalesced;
+	TwitterCounters	delta;
+
+	/* count the rows of the previous search under its own query */
+	parse_finish(reply->parser, &reply->stats);
+
+	oldcontext = MemoryContextSwitchTo(reply->batch_cxt);
+	reply->q = list_nth(reply->batches, reply->batchno);
+	if (reply->lookup)
+		url = lookup_url(reply->endpoint, reply->q, false);
+	else
+		url = build_url(reply->endpoint, reply->q, false, reply->terms);
+	normalize_query(reply->stats.key.query, url);
+
+	/*
+	 * Share the request with any other backend fetching the same URL.
+	 * If the leader fails we fall back to fetching by ourselves.
+	 */
+	root = NULL;
+	flight_key = url;
+	if (reply->parse_key)
+	{
+		StringInfoData	buf;
+
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "%s %s", url, reply->parse_key);
+		flight_key = buf.data;
+	}
+	slot = flight_attach(flight_key, &leader);
+	if (slot < 0)
+		root = fetch_results(url, &reply->stats, reply->parser);
+	else if (leader)
+		root = flight_lead(slot, url, &reply->stats, reply->parser);
+	else if ((root = flight_follow(slot)) != NULL)
+		reply->stats.coalesced++;
+	else
+	{
+		reply->stats.retries++;
+		root = fetch_results(url, &reply->stats, reply->parser);
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	memset(&delta, 0, sizeof(delta));
+	if (reply->stats.coalesced > coalesced)
+		delta.cache_hits = 1;
+	else
+		delta.cache_misses = 1;
+	stats_accum(&reply->stats.key, &delta);
+
+	if (root && root->completed_in)
+		reply->stats.completed_in = root->completed_in;
+
+	reply->root = root;
+	reply->rownum = 0;
+	reply->qindex = 0;
+}
+
+/*
+ * libjson's allocator hooks take no argument, so they allocate in the
+ * context of the parser in use; one backend parses one response at a time.
+ */
+static MemoryContext parser_cxt = NULL;
+
+/*
+ * parser_create
+ *   Set up the parser of a scan in a context of its own, to enforce limits
+ */
+static TwitterParser *
+parser_create(TwitterLimits *limits, List *paths, bool raw)
+{
+	TwitterParser  *parser;
+	json_config		config;
+	MemoryContext	oldcontext;
+	ListCell	   *l;
+	int				i;
+
+	parser = (TwitterParser *) palloc0(sizeof(TwitterParser));
+	parser->cxt = AllocSetContextCreate(CurrentMemoryContext,
+										"twitter_fdw parser",
+										ALLOCSET_DEFAULT_MINSIZE,
+										ALLOCSET_DEFAULT_INITSIZE,
+										ALLOCSET_DEFAULT_MAXSIZE);
+	parser_cxt = parser->cxt;
+	parser->results_cxt = AllocSetContextCreate(parser->cxt,
+												"twitter_fdw results",
+												ALLOCSET_DEFAULT_MINSIZE,
+												ALLOCSET_DEFAULT_INITSIZE,
+												ALLOCSET_DEFAULT_MAXSIZE);
+	parser->limits = *limits;
+	parser->raw = raw;
+
+	memset(&config, 0, sizeof(json_config));
+	config.zero_copy = 1;
+	config.typed_numbers = 1;
+	config.max_data = limits->max_token_size * 1024;
+	config.max_nesting = limits->max_nesting;
+	config.user_calloc = parser_calloc;
+	config.user_realloc = parser_realloc;
+	config.user_free = parser_free;
+	if (json_parser_init_pull(&parser->parser, &config) != 0)
+		elog(ERROR, "could not initialize json parser");
+
+	oldcontext = MemoryContextSwitchTo(parser->cxt);
+	initStringInfo(&parser->body);
+	if (paths != NIL)
+	{
+		List	   *nodes = (List *) linitial(paths);
+
+		parser->paths = (PathNode *) palloc(sizeof(PathNode) * list_length(nodes));
+		i = 0;
+		foreach(l, nodes)
+		{
+			List	   *item = (List *) lfirst(l);
+			PathNode   *node = &parser->paths[i++];
+
+			node->key = strVal(linitial(item));
+			node->len = strlen(node->key);
+			node->parent = intVal(lsecond(item));
+			node->slot = intVal(lthird(item));
+			node->child = -1;
+			node->sibling = -1;
+			parser->nslots = Max(parser->nslots, node->slot + 1);
+		}
+		/* link children backwards, so that they stay in order */
+		for (i--; i > 0; i--)
+		{
+			PathNode   *parent = &parser->paths[parser->paths[i].parent];
+
+			parser->paths[i].sibling = parent->child;
+			parent->child = i;
+		}
+	}
+	MemoryContextSwitchTo(oldcontext);
+	parser->done = true;
+
+	return parser;
+}
+
+static void *
+parser_calloc(size_t nmemb, size_t size)
+{
+	return MemoryContextAllocZero(parser_cxt, nmemb * size);
+}
+
+static void *
+parser_realloc(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return MemoryContextAlloc(parser_cxt, size);
+	return repalloc(ptr, size);
+}
+
+static void
+parser_free(void *ptr)
+{
+	pfree(ptr);
+}
+
+/*
+ * fetch_results
+ *   Request url and set up the parser on the first part of the response;
+ *   the rest is received as parse_tweet() gets to it.  Returns NULL if
+ *   nothing usable came back.
+ */
+static ResultRoot *
+fetch_results(char *url, TwitterScanStats *stats, TwitterParser *parser)
+{
+	resetStringInfo(&parser->body);
+	parser->done = true;
+	parser->url = url;
+
+	elog(DEBUG1, "requesting %s", url);
+	parser->fetch = fetch_open(url, stats, &parser->body,
+							   (Size) parser->limits.max_response_size * 1024);
+	fetch_pump(parser->fetch);
+	if (parser->body.len > 0)
+	{
+		stats->pages++;
+		return parser_start(parser, url);
+	}
+
+	fetch_finish(parser, stats, false);
+	return NULL;
+}
+
+/*
+ * fetch_finish
+ *   Account for the request of the parser once it is over, or given up on
+ *   with abort, and release it.  Returns whether the whole response came
+ *   in; a request that failed is reported, one that went beyond
+ *   max_response_size is an error.
+ */
+static bool
+fetch_finish(TwitterParser *parser, TwitterScanStats *stats, bool abort)
+{
+	TwitterFetch   *fetch = parser->fetch;
+	double			namelookup, connect, appconnect, starttransfer, total;
+	CURLcode		res = fetch->result;
+	long			status = 0;
+	bool			too_large;
+	bool			failed;
+	TwitterCounters	delta;
+
+	/*
+	 * curl reports each phase as elapsed time since the start of the
+	 * request; turn those into durations of the individual phases.
+	 */
+	curl_easy_getinfo(fetch->curl, CURLINFO_NAMELOOKUP_TIME, &namelookup);
+	curl_easy_getinfo(fetch->curl, CURLINFO_CONNECT_TIME, &connect);
+	curl_easy_getinfo(fetch->curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+	curl_easy_getinfo(fetch->curl, CURLINFO_STARTTRANSFER_TIME, &starttransfer);
+	curl_easy_getinfo(fetch->curl, CURLINFO_TOTAL_TIME, &total);
+	curl_easy_getinfo(fetch->curl, CURLINFO_RESPONSE_CODE, &status);
+	/* curl gives up by itself when the advertised length is too large */
+	too_large = fetch->too_large || res == CURLE_FILESIZE_EXCEEDED;
+	failed = !abort && (res != CURLE_OK || fetch->received == 0);
+
+	memset(&delta, 0, sizeof(delta));
+	delta.requests = 1;
+	delta.bytes = fetch->received;
+	parser->fetch = NULL;
+	fetch_close(fetch);
+
+	stats->requests++;
+	stats->dns_time += namelookup;
+	stats->connect_time += Max(connect - namelookup, 0);
+	if (appconnect > 0)
+	{
+		stats->tls_time += Max(appconnect - connect, 0);
+		connect = appconnect;
+	}
+	stats->wait_time += Max(starttransfer - connect, 0);
+	stats->transfer_time += Max(total - starttransfer, 0);
+
+	if (failed && !too_large)
+		elog(INFO, "Failed fetching response from %s", parser->url);
+
+	if (failed && res != CURLE_OK && !too_large)
+		delta.transport_errors = 1;
+	else if (status >= 500)
+		delta.http_5xx = 1;
+	else if (status >= 400)
+		delta.http_4xx = 1;
+	/* 420 "Enhance Your Calm" is how the search API says slow down */
+	if (status == 420 || status == 429)
+		delta.throttled = 1;
+	if (failed || status >= 400)
+		delta.failures = 1;
+	delta.total_time = delta.max_time = total * 1000.0;
+	delta.latency[latency_bucket(delta.total_time)] = 1;
+	stats_accum(&stats->key, &delta);
+
+	if (too_large)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("response from %s is too large", parser->url),
+				 errdetail("The limit is %d kB.",
+						   (parser->limits.max_response_size > 0)
+						   ? parser->limits.max_response_size
+						   : (int) (MaxAllocSize / 1024)),
+				 errhint("Raise twitter_fdw.max_response_size or the "
+						 "max_response_size option of the server.")));
+
+	return !failed;
+}
+
+/*
+ * results_create
+ *   An empty array of tweets with room for size of them, in the current
+ *   memory context
+ */
+static ResultArray *
+results_create(int size)
+{
+	ResultArray	   *array = (ResultArray *) palloc(sizeof(ResultArray));
+
+	array->index = 0;
+	array->size = Max(size, 1);
+	array->elements = (Tweet **) palloc(sizeof(Tweet *) * array->size);
+
+	return array;
+}
+
+/*
+ * results_append
+ *   Add a tweet to an array, doubling it when full; repalloc keeps it in
+ *   the context it was created in
+ */
+static void
+results_append(ResultArray *array, Tweet *tweet)
+{
+	if (array->index >= array->size)
+	{
+		if ((Size) array->size * 2 > MaxAllocSize / sizeof(Tweet *))
+			elog(ERROR, "too many tweets in one response");
+		array->size *= 2;
+		array->elements = (Tweet **) repalloc(array->elements,
+											  sizeof(Tweet *) * array->size);
+	}
+	array->elements[array->index++] = tweet;
+}
+
+/*
+ * parser_start
+ *   Set up the parser to go through the response in parser->body
+ */
+static ResultRoot *
+parser_start(TwitterParser *parser, char *url)
+{
+	MemoryContext	oldcontext;
+	ResultRoot	   *root;
+
+	/* the tweets of the previous response are done with */
+	MemoryContextReset(parser->results_cxt);
+	oldcontext = MemoryContextSwitchTo(parser->results_cxt);
+	root = (ResultRoot *) palloc0(sizeof(ResultRoot));
+	root->results = results_create(64);
+	MemoryContextSwitchTo(oldcontext);
+
+	json_parser_reset(&parser->parser);
+	json_parser_feed(&parser->parser, parser->body.data, parser->body.len);
+	parser->url = url;
+	parser->root = root;
+	parser->tweet = NULL;
+	parser->depth = 0;
+	parser->tweet_depth = 3;
+	parser->key = -1;
+	parser->in_results = false;
+	parser->done = false;
+	parser->path_next = -1;
+
+	return root;
+}
+
+/*
+ * parse_tweet
+ *   Parse the response up to the end of its next tweet, add it to the
+ *   results and return it, or NULL once there are no more
+ */
+static Tweet *
+parse_tweet(TwitterParser *parser, TwitterScanStats *stats)
+{
+	ResultRoot	   *root = parser->root;
+	Tweet		   *tweet = NULL;
+	MemoryContext	oldcontext;
+	json_event		event;
+	instr_time		start, end;
+	int				ret;
+
+	if (parser->done)
+		return NULL;
+
+	INSTR_TIME_SET_ZERO(start);
+	if (stats->timing)
+		INSTR_TIME_SET_CURRENT(start);
+	parser_cxt = parser->cxt;
+	oldcontext = MemoryContextSwitchTo(parser->results_cxt);
+
+	while (tweet == NULL)
+	{
+		ret = json_parser_next(&parser->parser, &event);
+		if (ret == 0 && event.type == JSON_NONE && parser->fetch)
+		{
+			/* all received so far is parsed, wait for the rest */
+			if (stats->timing)
+			{
+				INSTR_TIME_SET_CURRENT(end);
+				INSTR_TIME_ACCUM_DIFF(stats->parse_time, end, start);
+			}
+			resetStringInfo(&parser->body);
+			fetch_pump(parser->fetch);
+			if (stats->timing)
+				INSTR_TIME_SET_CURRENT(start);
+
+			if (parser->body.len > 0)
+			{
+				json_parser_feed(&parser->parser, parser->body.data,
+								 parser->body.len);
+				continue;
+			}
+
+			/* a response cut short ends with the tweets it had */
+			if (!fetch_finish(parser, stats, false))
+			{
+				parse_finish(parser, stats);
+				goto done;
+			}
+		}
+		if (ret == 0 && event.type == JSON_NONE &&
+			!json_parser_is_done(&parser->parser))
+			ret = -1;
+		if (ret != 0)
+		{
+			TwitterCounters	delta;
+
+			parser->done = true;
+			memset(&delta, 0, sizeof(delta));
+			delta.failures = 1;
+			stats_accum(&stats->key, &delta);
+			if (ret == JSON_ERROR_DATA_LIMIT)
+				ereport(ERROR,
+						(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+						 errmsg("value in response from %s is too long",
+								parser->url),
+						 errdetail("The limit is %d kB.",
+								   parser->limits.max_token_size),
+						 errhint("Raise twitter_fdw.max_token_size or the "
+								 "max_token_size option of the server.")));
+			if (ret == JSON_ERROR_NESTING_LIMIT)
+				ereport(ERROR,
+						(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+						 errmsg("response from %s is nested too deeply",
+								parser->url),
+						 errdetail("The limit is %d levels.",
+								   parser->limits.max_nesting),
+						 errhint("Raise twitter_fdw.max_nesting or the "
+								 "max_nesting option of the server.")));
+			elog(ERROR, "json_parser failed on response from %s", parser->url);
+		}
+
+#if PG_VERSION_NUM >= 90400
+		if (parser->raw && parser->tweet)
+			raw_event(parser, &event);
+#endif
+
+		switch (event.type)
+		{
+		case JSON_NONE:
+			parse_finish(parser, stats);
+			goto done;
+
+		case JSON_OBJECT_BEGIN:
+		case JSON_ARRAY_BEGIN:
+			/*
+			 * In a search response depth 1 is the root, 2 the results array
+			 * and 3 a tweet; a lookup response is the array of tweets.
+			 */
+			if (event.type == JSON_ARRAY_BEGIN && parser->depth == 1 &&
+				parser->key == KEY_RESULTS)
+				parser->in_results = true;
+			else if (event.type == JSON_ARRAY_BEGIN && parser->depth == 0)
+			{
+				parser->in_results = true;
+				parser->tweet_depth = 2;
+			}
+			else if (event.type == JSON_OBJECT_BEGIN && parser->in_results &&
+					 parser->depth == parser->tweet_depth - 1)
+			{
+				parser->tweet = (Tweet *) palloc0(sizeof(Tweet));
+				if (parser->paths)
+				{
+					parser->tweet->npaths = parser->nslots;
+					parser->tweet->paths = (char **)
+						palloc0(sizeof(char *) * parser->nslots);
+					parser->path_node = 0;
+					parser->path_depth = parser->tweet_depth;
+				}
+#if PG_VERSION_NUM >= 90400
+				if (parser->raw)
+				{
+					parser->raw_state = NULL;
+					raw_event(parser, &event);
+				}
+#endif
+			}
+			else if (event.type == JSON_OBJECT_BEGIN && parser->path_next >= 0)
+			{
+				/* one level further down some json_path */
+				parser->path_node = parser->path_next;
+				parser->path_depth = parser->depth + 1;
+			}
+			parser->depth++;
+			parser->key = -1;
+			parser->path_next = -1;
+			break;
+
+		case JSON_OBJECT_END:
+		case JSON_ARRAY_END:
+			if (parser->depth == parser->tweet_depth && parser->tweet)
+			{
+				tweet = parser->tweet;
+				results_append(root->results, tweet);
+				parser->tweet = NULL;
+			}
+			else if (parser->depth == parser->tweet_depth - 1)
+				parser->in_results = false;
+			else if (parser->tweet && parser->depth == parser->path_depth)
+			{
+				parser->path_node = parser->paths[parser->path_node].parent;
+				parser->path_depth--;
+			}
+			parser->depth--;
+			parser->key = -1;
+			parser->path_next = -1;
+			break;
+
+		case JSON_KEY:
+			if (parser->depth == 1 ||
+				(parser->depth == parser->tweet_depth && parser->tweet))
+				parser->key = lookup_key(event.data, event.length);
+			else
+				parser->key = -1;
+			if (parser->paths && parser->tweet &&
+				parser->depth == parser->path_depth)
+				parser->path_next = path_child(parser, parser->path_node,
+											   event.data, event.length);
+			break;
+
+		case JSON_NULL:
+		case JSON_TRUE:
+		case JSON_FALSE:
+			if (parser->path_next >= 0)
+				path_set(parser, &event);
+			parser->key = -1;
+			break;
+
+		default:
+			if (parser->path_next >= 0)
+				path_set(parser, &event);
+			if (parser->depth == parser->tweet_depth && parser->tweet &&
+				parser->key >= 0)
+				tweet_set(parser->tweet, parser->key, &event);
+			else if (parser->depth == 1 && parser->key == KEY_COMPLETED_IN)
+			{
+				root->completed_in = pnstrdup(event.data, event.length);
+				stats->completed_in = root->completed_in;
+			}
+			parser->key = -1;
+			break;
+		}
+	}
+
+done:
+	MemoryContextSwitchTo(oldcontext);
+	if (stats->timing)
+	{
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_ACCUM_DIFF(stats->parse_time, end, start);
+	}
+
+	return tweet;
+}
+
+/*
+ * path_child
+ *   The node under node of the trie that key leads to, or -1
+ */
+static int
+path_child(TwitterParser *parser, int node, const char *key, uint32 length)
+{
+	int			i;
+
+	for (i = parser->paths[node].child; i >= 0; i = parser->paths[i].sibling)
+	{
+		if (parser->paths[i].len == length &&
+			memcmp(parser->paths[i].key, key, length) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * path_set
+ *   Keep the scalar a json_path leads to as text, in its slot of the
+ *   tweet.  Objects and arrays it leads to are left null.
+ */
+static void
+path_set(TwitterParser *parser, json_event *event)
+{
+	int			slot = parser->paths[parser->path_next].slot;
+	char	  **value;
+
+	parser->path_next = -1;
+	if (slot < 0)
+		return;
+
+	value = &parser->tweet->paths[slot];
+	switch (event->type)
+	{
+	case JSON_NULL:
+		*value = NULL;
+		break;
+	case JSON_TRUE:
+		*value = "true";
+		break;
+	case JSON_FALSE:
+		*value = "false";
+		break;
+	default:
+		*value = pnstrdup(event->data, event->length);
+		break;
+	}
+}
+
+#if PG_VERSION_NUM >= 90400
+/*
+ * raw_event
+ *   Add an event of the tweet being parsed to its jsonb, which is built
+ *   from the values libjson has already tokenized rather than from text
+ */
+static void
+raw_event(TwitterParser *parser, json_event *event)
+{
+	JsonbValue		value;
+	JsonbValue	   *result;
+	char		   *str;
+
+	switch (event->type)
+	{
+	case JSON_OBJECT_BEGIN:
+		pushJsonbValue(&parser->raw_state, WJB_BEGIN_OBJECT, NULL);
+		return;
+	case JSON_ARRAY_BEGIN:
+		pushJsonbValue(&parser->raw_state, WJB_BEGIN_ARRAY, NULL);
+		return;
+	case JSON_OBJECT_END:
+	case JSON_ARRAY_END:
+		result = pushJsonbValue(&parser->raw_state,
+								(event->type == JSON_OBJECT_END)
+								? WJB_END_OBJECT : WJB_END_ARRAY, NULL);
+		/* that was the tweet itself */
+		if (parser->raw_state == NULL)
+			parser->tweet->raw = (struct varlena *) JsonbValueToJsonb(result);
+		return;
+	case JSON_KEY:
+	case JSON_STRING:
+		/* jsonb strings hold no NUL, so keep what comes before one */
+		str = pnstrdup(event->data, event->length);
+		value.type = jbvString;
+		value.val.string.val = str;
+		value.val.string.len = strlen(str);
+		if (event->type == JSON_KEY)
+		{
+			pushJsonbValue(&parser->raw_state, WJB_KEY, &value);
+			return;
+		}
+		break;
+	case JSON_INT:
+	case JSON_FLOAT:
+		value.type = jbvNumeric;
+		if (event->number && event->type == JSON_INT)
+			value.val.numeric = DatumGetNumeric(
+				DirectFunctionCall1(int8_numeric,
+									Int64GetDatum(event->number->int_value)));
+		else
+			value.val.numeric = DatumGetNumeric(
+				DirectFunctionCall3(numeric_in,
+									CStringGetDatum(pnstrdup(event->data,
+															 event->length)),
+									ObjectIdGetDatum(InvalidOid),
+									Int32GetDatum(-1)));
+		break;
+	case JSON_TRUE:
+	case JSON_FALSE:
+		value.type = jbvBool;
+		value.val.boolean = (event->type == JSON_TRUE);
+		break;
+	case JSON_NULL:
+		value.type = jbvNull;
+		break;
+	default:
+		return;
+	}
+
+	pushJsonbValue(&parser->raw_state,
+				   (parser->raw_state->contVal.type == jbvArray)
+				   ? WJB_ELEM : WJB_VALUE, &value);
+}
+#endif
+
+/*
+ * parse_finish
+ *   Stop parsing the response, counting the tweets taken from it.  The
+ *   rest of it is not waited for: nobody is going to read its tweets.
+ */
+static void
+parse_finish(TwitterParser *parser, TwitterScanStats *stats)
+{
+	TwitterCounters	delta;
+
+	if (parser->fetch)
+		fetch_finish(parser, stats, true);
+	if (parser->done)
+		return;
+	parser->done = true;
+
+	memset(&delta, 0, sizeof(delta));
+	delta.rows = parser->root->results->index;
+	stats_accum(&stats->key, &delta);
+}
+
+/*
+ * fetch_open
+ *   Set up a request for url, receiving the response into body
+ */
+static TwitterFetch *
+fetch_open(char *url, TwitterScanStats *stats, StringInfo body,
+		   Size max_size)
+{
+	TwitterFetch   *fetch;
+
+	/* outlives the query's memory if we error out, see fetch_release() */
+	fetch = (TwitterFetch *) MemoryContextAllocZero(TopMemoryContext,
+													sizeof(TwitterFetch));
+	fetch->body = body;
+	fetch->stats = stats;
+	/* enlargeStringInfo() wants room for the terminating nul, and then some */
+	fetch->max_size = (max_size > 0 && max_size < MaxAllocSize - 2)
+		? max_size : MaxAllocSize - 2;
+	fetch->timeout = -1;
+	fetch->owner = CurrentResourceOwner;
+	fetch->next = open_fetches;
+	open_fetches = fetch;
+
+	fetch->curl = curl_easy_init();
+	fetch->multi = curl_multi_init();
+	if (fetch->curl == NULL || fetch->multi == NULL)
+	{
+		fetch_close(fetch);
+		elog(ERROR, "could not initialize curl");
+	}
+
+	curl_easy_setopt(fetch->curl, CURLOPT_URL, url);
+	curl_easy_setopt(fetch->curl, CURLOPT_WRITEFUNCTION, write_data);
+	curl_easy_setopt(fetch->curl, CURLOPT_WRITEDATA, fetch);
+	curl_easy_setopt(fetch->curl, CURLOPT_MAXFILESIZE, (long) fetch->max_size);
+	curl_multi_setopt(fetch->multi, CURLMOPT_SOCKETFUNCTION, fetch_socket);
+	curl_multi_setopt(fetch->multi, CURLMOPT_SOCKETDATA, fetch);
+	curl_multi_setopt(fetch->multi, CURLMOPT_TIMERFUNCTION, fetch_timer);
+	curl_multi_setopt(fetch->multi, CURLMOPT_TIMERDATA, fetch);
+	curl_multi_add_handle(fetch->multi, fetch->curl);
+	fetch->result = CURLE_FAILED_INIT;
+
+	/* get the request going, fetch_pump() takes it from there */
+	curl_multi_socket_action(fetch->multi, CURL_SOCKET_TIMEOUT, 0,
+							 &fetch->running);
+
+	return fetch;
+}
+
+/*
+ * fetch_pump
+ *   Run the request until more of the response is in the body, or it is
+ *   over, sleeping on curl's socket and our latch in between so that a
+ *   query cancel or statement_timeout is served right away
+ */
+static void
+fetch_pump(TwitterFetch *fetch)
+{
+	int			len = fetch->body->len;
+	CURLMsg	   *msg;
+	int			nmsgs;
+
+	while (fetch->running && fetch->body->len == len)
+	{
+		int			events = WL_LATCH_SET | WL_POSTMASTER_DEATH;
+		long		timeout = fetch->timeout;
+		pgsocket	sock = PGINVALID_SOCKET;
+		int			rc;
+
+		if (fetch->nsockets == 1)
+		{
+			sock = fetch->sockets[0];
+			if (fetch->events[0] & CURL_POLL_IN)
+				events |= WL_SOCKET_READABLE;
+			if (fetch->events[0] & CURL_POLL_OUT)
+				events |= WL_SOCKET_WRITEABLE;
+		}
+		else
+		{
+			/* the latch watches one socket at most; poll the rest */
+			if (timeout < 0 || timeout > FETCH_POLL_INTERVAL)
+				timeout = FETCH_POLL_INTERVAL;
+		}
+		if (timeout >= 0)
+			events |= WL_TIMEOUT;
+
+		rc = fetch_wait(events, sock, timeout);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+		if (rc & WL_LATCH_SET)
+		{
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		if (rc & (WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE))
+		{
+			int			mask = 0;
+
+			if (rc & WL_SOCKET_READABLE)
+				mask |= CURL_CSELECT_IN;
+			if (rc & WL_SOCKET_WRITEABLE)
+				mask |= CURL_CSELECT_OUT;
+			curl_multi_socket_action(fetch->multi, sock, mask,
+									 &fetch->running);
+		}
+		else if (rc & WL_TIMEOUT)
+		{
+			curl_socket_t	sockets[FETCH_MAX_SOCKETS];
+			int				nsockets = fetch->nsockets;
+			int				i;
+
+			/* let curl check the sockets itself, then run its timers */
+			memcpy(sockets, fetch->sockets, sizeof(sockets));
+			for (i = 0; i < nsockets; i++)
+				curl_multi_socket_action(fetch->multi, sockets[i], 0,
+										 &fetch->running);
+			curl_multi_socket_action(fetch->multi, CURL_SOCKET_TIMEOUT, 0,
+									 &fetch->running);
+		}
+	}
+
+	if (fetch->running)
+		return;
+	while ((msg = curl_multi_info_read(fetch->multi, &nmsgs)) != NULL)
+	{
+		if (msg->msg == CURLMSG_DONE)
+			fetch->result = msg->data.result;
+	}
+}
+
+/*
+ * fetch_close
+ *   Release the curl handles of a fetch
+ */
+static void
+fetch_close(TwitterFetch *fetch)
+{
+	TwitterFetch  **prev;
+
+	for (prev = &open_fetches; *prev != NULL; prev = &(*prev)->next)
+	{
+		if (*prev == fetch)
+		{
+			*prev = fetch->next;
+			break;
+		}
+	}
+
+	if (fetch->multi)
+	{
+		if (fetch->curl)
+			curl_multi_remove_handle(fetch->multi, fetch->curl);
+		curl_multi_cleanup(fetch->multi);
+	}
+	if (fetch->curl)
+		curl_easy_cleanup(fetch->curl);
+	pfree(fetch);
+}
+
+/*
+ * fetch_wait
+ *   Sleep until an event, reporting it as our wait event where supported
+ */
+static int
+fetch_wait(int events, pgsocket sock, long timeout)
+{
+#if PG_VERSION_NUM >= 90600
+	return WaitLatchOrSocket(MyLatch, events, sock, timeout,
+							 twitter_wait_event());
+#elif PG_VERSION_NUM >= 90200
+	return WaitLatchOrSocket(MyLatch, events, sock, timeout);
+#else
+	CHECK_FOR_INTERRUPTS();
+	pg_usleep(FETCH_POLL_INTERVAL * 1000L);
+	return WL_TIMEOUT;
+#endif
+}
+
+/*
+ * fetch_socket
+ *   curl callback, tells which sockets to wait on and for what
+ */
+static int
+fetch_socket(CURL *easy, curl_socket_t sock, int what,
+			 void *userp, void *socketp)
+{
+	TwitterFetch   *fetch = (TwitterFetch *) userp;
+	int				i;
+
+	for (i = 0; i < fetch->nsockets; i++)
+	{
+		if (fetch->sockets[i] == sock)
+			break;
+	}
+
+	if (what == CURL_POLL_REMOVE)
+	{
+		if (i < fetch->nsockets)
+		{
+			fetch->nsockets--;
+			fetch->sockets[i] = fetch->sockets[fetch->nsockets];
+			fetch->events[i] = fetch->events[fetch->nsockets];
+		}
+	}
+	else if (i < fetch->nsockets)
+		fetch->events[i] = what;
+	else if (i < FETCH_MAX_SOCKETS)
+	{
+		fetch->sockets[i] = sock;
+		fetch->events[i] = what;
+		fetch->nsockets++;
+	}
+	else
+		return -1;
+
+	return 0;
+}
+
+/*
+ * fetch_timer
+ *   curl callback, sets when curl wants to be called back without I/O
+ */
+static int
+fetch_timer(CURLM *multi, long timeout_ms, void *userp)
+{
+	TwitterFetch   *fetch = (TwitterFetch *) userp;
+
+	fetch->timeout = timeout_ms;
+
+	return 0;
+}
+
+/*
+ * fetch_release
+ *   Resource owner callback, closes fetches an error left open
+ */
+static void
+fetch_release(ResourceReleasePhase phase, bool isCommit,
+			  bool isTopLevel, void *arg)
+{
+	TwitterFetch   *fetch;
+	TwitterFetch   *next;
+
+	if (phase != RESOURCE_RELEASE_AFTER_LOCKS)
+		return;
+
+	for (fetch = open_fetches; fetch != NULL; fetch = next)
+	{
+		next = fetch->next;
+		if (fetch->owner == CurrentResourceOwner)
+			fetch_close(fetch);
+	}
+}
+
+#if PG_VERSION_NUM >= 90600
+/*
+ * twitter_wait_event
+ *   What pg_stat_activity shows while we wait for the API; 9.6 takes a
+ *   wait event but has none for extensions
+ */
+static uint32
+twitter_wait_event(void)
+{
+#if PG_VERSION_NUM >= 170000
+	static uint32 wait_event = 0;
+
+	if (wait_event == 0)
+		wait_event = WaitEventExtensionNew("TwitterFetch");
+	return wait_event;
+#elif PG_VERSION_NUM >= 100000
+	return PG_WAIT_EXTENSION;
+#else
+	return 0;
+#endif
+}
+#endif
+
+/*
+ * plan_columns
+ *   Work out where each column takes its value from, and how to convert
+ *   it: types with a known wire format get a converter of their own.
+ *   slots gives those of columns with a json_path, see twitter_paths().
+ */
+static TwitterColumn *
+plan_columns(TupleDesc tupdesc, List *slots)
+{
+	TwitterColumn  *columns;
+	int				i;
+	int				j;
+
+	columns = (TwitterColumn *) palloc0(sizeof(TwitterColumn) * tupdesc->natts);
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute	attr = TupleDescAttr(tupdesc, i);
+		const char		   *attname = NameStr(attr->attname);
+		TwitterColumn	   *column = &columns[i];
+
+		if (attr->attisdropped)
+		{
+			column->source = COLUMN_DROPPED;
+			continue;
+		}
+
+		column->source = COLUMN_NONE;
+		if (slots != NIL && list_nth_int(slots, i) >= 0)
+		{
+			column->source = COLUMN_PATH;
+			column->offset = list_nth_int(slots, i);
+		}
+		else if (strcmp(attname, "id") == 0)
+		{
+			column->source = COLUMN_ID;
+			column->offset = offsetof(Tweet, id);
+		}
+		else if (strcmp(attname, "from_user_id") == 0)
+		{
+			column->source = COLUMN_ID;
+			column->offset = offsetof(Tweet, from_user_id);
+		}
+		else if (strcmp(attname, "to_user_id") == 0)
+		{
+			column->source = COLUMN_ID;
+			column->offset = offsetof(Tweet, to_user_id);
+		}
+		else if (strcmp(attname, "q") == 0)
+			column->source = COLUMN_Q;
+#if PG_VERSION_NUM >= 90400
+		else if (strcmp(attname, "raw") == 0 && attr->atttypid == JSONBOID)
+			column->source = COLUMN_RAW;
+#endif
+		else
+		{
+			for (j = 0; text_fields[j].name; j++)
+			{
+				if (strcmp(attname, text_fields[j].name) == 0)
+				{
+					column->source = COLUMN_TEXT;
+					column->offset = text_fields[j].offset;
+					break;
+				}
+			}
+		}
+		if (column->source == COLUMN_NONE)
+			continue;
+
+		switch (attr->atttypid)
+		{
+			case INT8OID:
+				column->int8 = true;
+				break;
+			case TEXTOID:
+				column->convert = convert_text;
+				break;
+			case TIMESTAMPOID:
+				column->convert = convert_timestamp;
+				break;
+			case TIMESTAMPTZOID:
+				column->convert = convert_timestamptz;
+				break;
+			default:
+				break;
+		}
+	}
+
+	return columns;
+}
+
+/*
+ * convert_text
+ *   What textin() does, without a function call
+ */
+static bool
+convert_text(char *str, Datum *value)
+{
+	*value = PointerGetDatum(cstring_to_text(str));
+	return true;
+}
+
+/*
+ * convert_timestamp
+ *   created_at to timestamp, as written; timestamp_in() ignores the zone
+ *   too.  Anything but the format of the API is left to timestamp_in().
+ */
+static bool
+convert_timestamp(char *str, Datum *value)
+{
+	Timestamp	result;
+
+	if (!parse_created_at(str, &result, false))
+		return false;
+	*value = TimestampGetDatum(result);
+	return true;
+}
+
+/*
+ * convert_timestamptz
+ *   created_at to timestamptz, at its own offset from UTC
+ */
+static bool
+convert_timestamptz(char *str, Datum *value)
+{
+	TimestampTz	result;
+
+	if (!parse_created_at(str, &result, true))
+		return false;
+	*value = TimestampTzGetDatum(result);
+	return true;
+}
+
+/*
+ * parse_created_at
+ *   Parse a date in the RFC 2822 form of the API, as in
+ *   "Wed, 08 Apr 2009 19:22:10 +0000", into a timestamp: in UTC with utc,
+ *   as written otherwise.  Returns false for anything else, and for dates
+ *   out of range.  Neither DateStyle nor TimeZone matter.
+ */
+static bool
+parse_created_at(char *str, Timestamp *result, bool utc)
+{
+	static const char *const days[] = {
+		"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+	};
+	static const char *const months[] = {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+	};
+	struct pg_tm tm;
+	char	   *c = str;
+	int			tz;
+	int			sign;
+	int			i;
+
+#define DIGITS(n, field) \
+	do { \
+		int		_k; \
+		(field) = 0; \
+		for (_k = 0; _k < (n); _k++, c++) \
+		{ \
+			if (*c < '0' || *c > '9') \
+				return false; \
+			(field) = (field) * 10 + (*c - '0'); \
+		} \
+	} while (0)
+
+	memset(&tm, 0, sizeof(tm));
+
+	/* the day of the week, which says nothing more */
+	for (i = 0; i < lengthof(days); i++)
+	{
+		if (strncmp(c, days[i], 3) == 0)
+			break;
+	}
+	if (i == lengthof(days) || c[3] != ',' || c[4] != ' ')
+		return false;
+	c += 5;
+
+	DIGITS(2, tm.tm_mday);
+	if (*c++ != ' ')
+		return false;
+	for (i = 0; i < lengthof(months); i++)
+	{
+		if (strncmp(c, months[i], 3) == 0)
+			break;
+	}
+	if (i == lengthof(months) || c[3] != ' ')
+		return false;
+	tm.tm_mon = i + 1;
+	c += 4;
+	DIGITS(4, tm.tm_year);
+	if (*c++ != ' ')
+		return false;
+	DIGITS(2, tm.tm_hour);
+	if (*c++ != ':')
+		return false;
+	DIGITS(2, tm.tm_min);
+	if (*c++ != ':')
+		return false;
+	DIGITS(2, tm.tm_sec);
+	if (*c++ != ' ' || (*c != '+' && *c != '-'))
+		return false;
+	sign = (*c++ == '-') ? -1 : 1;
+	DIGITS(4, tz);
+	if (*c != '\0')
+		return false;
+#undef DIGITS
+
+	if (tm.tm_year < 1 || tm.tm_mday < 1 ||
+		tm.tm_mday > day_tab[isleap(tm.tm_year)][tm.tm_mon - 1] ||
+		tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 59 ||
+		tz % 100 > 59)
+		return false;
+
+	/* PostgreSQL counts zones in seconds west of UTC */
+	tz = -sign * ((tz / 100) * SECS_PER_HOUR + (tz % 100) * SECS_PER_MINUTE);
+
+	return tm2timestamp(&tm, 0, utc ? &tz : NULL, result) == 0;
+}
+
+/*
+ * twitterIterate
+ *   Return a twitter per call
+ */
+static TupleTableSlot *
+twitterIterate(ForeignScanState *node)
+{
+	TupleTableSlot	   *slot = node->ss.ss_ScanTupleSlot;
+	TwitterReply	   *reply = (TwitterReply *) node->fdw_state;
+	ResultRoot		   *root;
+	Tweet			   *tweet;
+	char			   *q = NULL;
+	HeapTuple			tuple;
+	Relation			rel = node->ss.ss_currentRelation;
+	AttInMetadata	   *attinmeta = reply->attinmeta;
+	int					i, natts;
+	Datum			   *values;
+	bool			   *nulls;
+	MemoryContext		oldcontext;
+	instr_time			start, end;
+
+	if (!reply->started)
+		reply_start(node, reply);
+
+	/* rows of an earlier scan for the same search */
+	if (reply->replay)
+	{
+#if PG_VERSION_NUM >= 120000
+		if (tuplestore_gettupleslot(reply->spool->store, true, false,
+									reply->spool_slot))
+			return ExecCopySlot(slot, reply->spool_slot);
+#else
+		if (tuplestore_gettupleslot(reply->spool->store, true, false, slot))
+			return slot;
+#endif
+		return ExecClearTuple(slot);
+	}
+
+	for (;;)
+	{
+		root = reply->root;
+
+		/* parse no further than the row asked for */
+		if (root && root->results && reply->rownum == root->results->index)
+			parse_tweet(reply->parser, &reply->stats);
+
+		if (!root || !(root->results && reply->rownum < root->results->index))
+		{
+			/* on to the search for the next batch of values of q */
+			if (reply->batchno + 1 < list_length(reply->batches))
+			{
+				reply->batchno++;
+				reply_fetch(reply);
+				continue;
+			}
+			if (reply->spooling)
+				spool_done(reply);
+			ExecClearTuple(slot);
+			return slot;
+		}
+		tweet = root->results->elements[reply->rownum];
+
+		/* rejected tweets need no row, for any value of q */
+		for (i = 0; i < reply->nprefilters; i++)
+		{
+			if (!prefilter_match(&reply->prefilters[i], tweet))
+				break;
+		}
+		if (i < reply->nprefilters)
+			reply->stats.prefiltered++;
+		else if (reply->lookup || reply->q == NIL ||
+				 (q = next_q(reply, tweet)) != NULL)
+			break;
+
+		/* done with the values of q this tweet matches */
+		reply->rownum++;
+		reply->qindex = 0;
+	}
+	natts = rel->rd_att->natts;
+	if (reply->stats.timing)
+		INSTR_TIME_SET_CURRENT(start);
+	/* converted in the per-tuple context we are called in */
+	values = (Datum *) palloc(sizeof(Datum) * natts);
+	nulls = (bool *) palloc(sizeof(bool) * natts);
+	for (i = 0; i < natts; i++)
+	{
+		TwitterColumn	   *column = &reply->columns[i];
+		TweetId			   *id;
+		char			   *str = NULL;
+		char				buf[32];
+
+		values[i] = (Datum) 0;
+		nulls[i] = true;
+		switch (column->source)
+		{
+			case COLUMN_DROPPED:
+				continue;
+			case COLUMN_TEXT:
+				str = TEXT_FIELD(tweet, column->offset);
+				break;
+			case COLUMN_ID:
+				id = (TweetId *) ((char *) tweet + column->offset);
+				/* ids parsed by libjson need no conversion for int8 columns */
+				if (id->valid && column->int8)
+				{
+					values[i] = Int64GetDatum(id->value);
+					nulls[i] = false;
+					continue;
+				}
+				if (id->valid)
+				{
+					snprintf(buf, sizeof(buf), INT64_FORMAT, id->value);
+					str = buf;
+				}
+				else
+					str = id->text;
+				break;
+			case COLUMN_PATH:
+				if (column->offset < tweet->npaths)
+					str = tweet->paths[column->offset];
+				break;
+			case COLUMN_RAW:
+				/* only there if the plan found the column read */
+				if (tweet->raw)
+				{
+					values[i] = PointerGetDatum(tweet->raw);
+					nulls[i] = false;
+				}
+				continue;
+			case COLUMN_Q:
+				str = q;
+				break;
+		}
+
+		if (column->convert)
+		{
+			if (str == NULL)
+				continue;
+			if (column->convert(str, &values[i]))
+			{
+				nulls[i] = false;
+				continue;
+			}
+		}
+
+		/* as BuildTupleFromCStrings() does */
+		values[i] = InputFunctionCall(&attinmeta->attinfuncs[i], str,
+									  attinmeta->attioparams[i],
+									  attinmeta->atttypmods[i]);
+		nulls[i] = (str == NULL);
+	}
+	/* the slot frees the tuple, which must outlive the per-tuple context */
+	oldcontext = MemoryContextSwitchTo(node->ss.ps.ps_ExprContext->ecxt_per_query_memory);
+	tuple = heap_form_tuple(attinmeta->tupdesc, values, nulls);
+	MemoryContextSwitchTo(oldcontext);
+	if (reply->stats.timing)
+	{
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_ACCUM_DIFF(reply->stats.convert_time, end, start);
+	}
+	ExecStoreTuple(tuple, slot, InvalidBuffer, true);
+	if (reply->spooling)
+		tuplestore_puttupleslot(reply->spool->store, slot);
+	/* a tweet looked up is its one row, q being left unknown */
+	if (reply->lookup || reply->qindex >= list_length(reply->q))
+	{
+		reply->rownum++;
+		reply->qindex = 0;
+	}
+
+	return slot;
+}
+
+/*
+ * next_q
+ *   The next of the values of q searched for that the tweet matches.  A
+ *   tweet that matches none of several values ORed cannot be attributed
+ *   to any of them, and is dropped rather than given one it would then
+ *   pass the recheck of.
+ */
+static char *
+next_q(TwitterReply *reply, Tweet *tweet)
+{
+	int			nvalues = list_length(reply->q);
+
+	while (reply->qindex < nvalues)
+	{
+		char	   *value = strVal(list_nth(reply->q, reply->qindex++));
+
+		if (nvalues == 1 || tweet_matches(value, tweet))
+			return value;
+	}
+
+	return NULL;
+}
+
+/*
+ * tweet_matches
+ *   Could a tweet be what a search for a single word, or operator, of q
+ *   found?  The API matches words in the text and in the names of the
+ *   users, and from: and to: against the names alone.
+ */
+static bool
+tweet_matches(const char *q, Tweet *tweet)
+{
+	if (pg_strncasecmp(q, "from:", 5) == 0)
+		return tweet->from_user != NULL &&
+			pg_strcasecmp(q + 5, tweet->from_user) == 0;
+	if (pg_strncasecmp(q, "to:", 3) == 0)
+		return tweet->to_user != NULL &&
+			pg_strcasecmp(q + 3, tweet->to_user) == 0;
+
+	return q_matches(q, tweet->text) ||
+		(tweet->from_user != NULL && q_matches(q, tweet->from_user)) ||
+		(tweet->to_user != NULL && q_matches(q, tweet->to_user));
+}
+
+/*
+ * prefilter_compile
+ *   Set up a prefilter from its plan form, see prefilter_clause()
+ */
+static void
+prefilter_compile(Prefilter *filter, List *item)
+{
+	int			i;
+
+	filter->flags = intVal(linitial(item));
+	filter->offset = intVal(lsecond(item));
+	filter->pattern = strVal(lthird(item));
+	filter->len = strlen(filter->pattern);
+
+	for (i = 0; i < 256; i++)
+		filter->skip[i] = filter->len;
+	for (i = 0; i < filter->len - 1; i++)
+		filter->skip[(unsigned char) filter->pattern[i]] = filter->len - 1 - i;
+}
+
+#define FOLD(filter, c) \
+	(((filter)->flags & PREFILTER_ICASE) ? pg_tolower(c) : (c))
+
+/*
+ * prefilter_match
+ *   Can the tweet pass the condition of the prefilter?  A null field never
+ *   does.  With PREFILTER_ICASE, fields that are not all ASCII do, as
+ *   their case is the collation's business; the condition is rechecked.
+ */
+static bool
+prefilter_match(Prefilter *filter, Tweet *tweet)
+{
+	char	   *field = TEXT_FIELD(tweet, filter->offset);
+	int			m = filter->len;
+	int			n;
+	int			i;
+	int			j;
+
+	if (field == NULL)
+		return false;
+	n = strlen(field);
+	if (n < m)
+		return false;
+
+	if (filter->flags & PREFILTER_ICASE)
+	{
+		for (i = 0; i < n; i++)
+		{
+			if (IS_HIGHBIT_SET(field[i]))
+				return true;
+		}
+	}
+
+	if ((filter->flags & PREFILTER_START) && (filter->flags & PREFILTER_END))
+	{
+		if (n != m)
+			return false;
+	}
+	else if (filter->flags & PREFILTER_END)
+		field += n - m;
+	else if (!(filter->flags & PREFILTER_START))
+	{
+		/* Horspool: compare from the end, shift by the last character */
+		for (i = m - 1; i < n; i += filter->skip[(unsigned char) FOLD(filter, field[i])])
+		{
+			for (j = 0; j < m; j++)
+			{
+				if (FOLD(filter, field[i - j]) != filter->pattern[m - 1 - j])
+					break;
+			}
+			if (j == m)
+				return true;
+		}
+		return m == 0;
+	}
+
+	for (i = 0; i < m; i++)
+	{
+		if (FOLD(filter, field[i]) != filter->pattern[i])
+			return false;
+	}
+	return true;
+}
+
+/*
+ * twitterReScan
+ */
+static void
+twitterReScan(ForeignScanState *node)
+{
+	TwitterReply	   *reply = (TwitterReply *) node->fdw_state;
+
+	/*
+	 * Other values of q may have to be searched for; reply_start() reads
+	 * the rows again if they are the same, or were kept.  Otherwise the
+	 * rows of a complete scan are read from its spool, and the search is
+	 * made again only when earlier batches are gone.  Parameters that
+	 * only local conditions use don't change what the scan returns.
+	 */
+	if (reply->q_state && node->ss.ps.chgParam != NULL)
+		reply->started = false;
+	else if (reply->spool && reply->spool->complete)
+	{
+		reply->stats.cache_hits++;
+		tuplestore_rescan(reply->spool->store);
+		reply->replay = true;
+		return;
+	}
+	else if (list_length(reply->batches) > 1)
+		reply->started = false;
+	else if (reply->spool)
+		tuplestore_clear(reply->spool->store);
+	if (reply->started)
+		reply->stats.cache_hits++;		/* the tweets are read again */
+	reply->replay = false;
+	reply->rownum = 0;
+	reply->qindex = 0;
+}
+
+static void
+twitterEnd(ForeignScanState *node)
+{
+	TwitterReply	   *reply = (TwitterReply *) node->fdw_state;
+
+	/* it would go with the query's memory anyway, but let it go early */
+	if (reply && reply->spool_cxt)
+	{
+		ListCell   *l;
+
+		spool_drop(reply);
+		foreach(l, reply->spools)
+			tuplestore_end(((TwitterSpool *) lfirst(l))->store);
+		MemoryContextDelete(reply->spool_cxt);
+		reply->spool_cxt = NULL;
+		reply->spools = NIL;
+		if (reply->spool_slot)
+			ExecDropSingleTupleTableSlot(reply->spool_slot);
+	}
+	if (reply && reply->parser)
+	{
+		parse_finish(reply->parser, &reply->stats);
+		MemoryContextDelete(reply->parser->cxt);
+		reply->parser = NULL;
+	}
+}
+
+/*
+ * flight_attach
+ *   Join the flight in progress for url, or start a new one as leader.
+ *   Returns the flight slot, or -1 if requests cannot be coalesced now.
+ */
+static int
+flight_attach(const char *url, bool *leader)
+{
+	static bool		exit_registered = false;
+	TwitterFlight  *flight;
+	int				slot = -1;
+	int				free_slot = -1;
+	int				i;
+
+	*leader = false;
+	if (!twitter_shared || !twitter_coalesce ||
+		strlen(url) >= TWITTER_MAX_URL)
+		return -1;
+
+	if (!exit_registered)
+	{
+		on_shmem_exit(flight_shmem_exit, (Datum) 0);
+		exit_registered = true;
+	}
+
+	LWLockAcquire(twitter_shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < TWITTER_MAX_FLIGHTS; i++)
+	{
+		flight = &twitter_shared->flights[i];
+
+		if (flight->state == FLIGHT_INFLIGHT && strcmp(flight->url, url) == 0)
+		{
+			slot = i;
+			break;
+		}
+		if (flight->state == FLIGHT_FREE && free_slot < 0)
+			free_slot = i;
+	}
+
+	if (slot >= 0)
+		twitter_shared->flights[slot].refcount++;
+	else if (free_slot >= 0)
+	{
+		slot = free_slot;
+		flight = &twitter_shared->flights[slot];
+		flight->state = FLIGHT_INFLIGHT;
+		flight->refcount = 1;
+		flight->generation++;
+		strcpy(flight->url, url);
+		*leader = true;
+	}
+	LWLockRelease(twitter_shared->lock);
+
+	my_flight = slot;
+	my_flight_leader = *leader;
+
+	return slot;
+}
+
+/*
+ * flight_lead
+ *   Fetch url on behalf of every backend attached to the flight
+ */
+static ResultRoot *
+flight_lead(int slot, char *url, TwitterScanStats *stats,
+			TwitterParser *parser)
+{
+	TwitterFlight	   *flight = &twitter_shared->flights[slot];
+	ResultRoot *volatile root = NULL;
+
+	PG_TRY();
+	{
+		uint32		generation;
+		bool		published;
+
+		root = fetch_results(url, stats, parser);
+
+		LWLockAcquire(twitter_shared->lock, LW_EXCLUSIVE);
+		if (root == NULL || flight->refcount > 1)
+		{
+			/* from now on nobody else may join */
+			flight->state = FLIGHT_PUBLISHING;
+			generation = flight->generation;
+			LWLockRelease(twitter_shared->lock);
+
+			/* followers get every tweet, so parse them all now */
+			if (root != NULL)
+				while (parse_tweet(parser, stats) != NULL)
+					;
+			published = root != NULL && spill_results(slot, generation, root);
+			flight_land(slot, published ? FLIGHT_DONE : FLIGHT_FAILED);
+		}
+		else
+		{
+			/* nobody joined, so there is nothing to share */
+			flight->state = FLIGHT_FREE;
+			flight->refcount = 0;
+			my_flight = -1;
+			LWLockRelease(twitter_shared->lock);
+		}
+	}
+	PG_CATCH();
+	{
+		if (my_flight >= 0)
+			flight_land(slot, FLIGHT_FAILED);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	return root;
+}
+
+/*
+ * flight_follow
+ *   Wait for the leader and read its results.  Returns NULL if the
+ *   leader failed, in which case the caller fetches by itself.
+ */
+static ResultRoot *
+flight_follow(int slot)
+{
+	TwitterFlight	   *flight = &twitter_shared->flights[slot];
+	ResultRoot *volatile root = NULL;
+
+	PG_TRY();
+	{
+		int			state;
+		uint32		generation;
+
+#if PG_VERSION_NUM >= 100000
+		ConditionVariablePrepareToSleep(&flight->cv);
+#endif
+		for (;;)
+		{
+			LWLockAcquire(twitter_shared->lock, LW_SHARED);
+			state = flight->state;
+			generation = flight->generation;
+			LWLockRelease(twitter_shared->lock);
+
+			if (state == FLIGHT_DONE || state == FLIGHT_FAILED)
+				break;
+
+#if PG_VERSION_NUM >= 100000
+			ConditionVariableSleep(&flight->cv, twitter_wait_event());
+#else
+			CHECK_FOR_INTERRUPTS();
+			pg_usleep(FLIGHT_POLL_INTERVAL);
+#endif
+		}
+#if PG_VERSION_NUM >= 100000
+		ConditionVariableCancelSleep();
+#endif
+
+		if (state == FLIGHT_DONE)
+			root = load_results(slot, generation);
+	}
+	PG_CATCH();
+	{
+		flight_detach(slot);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	flight_detach(slot);
+
+	return root;
+}
+
+/*
+ * flight_land
+ *   Leader publishes the outcome and wakes up followers
+ */
+static void
+flight_land(int slot, int state)
+{
+	LWLockAcquire(twitter_shared->lock, LW_EXCLUSIVE);
+	twitter_shared->flights[slot].state = state;
+	LWLockRelease(twitter_shared->lock);
+
+#if PG_VERSION_NUM >= 100000
+	ConditionVariableBroadcast(&twitter_shared->flights[slot].cv);
+#endif
+
+	flight_detach(slot);
+}
+
+/*
+ * flight_detach
+ *   Drop our reference; the last one out frees the slot and spill file
+ */
+static void
+flight_detach(int slot)
+{
+	TwitterFlight  *flight = &twitter_shared->flights[slot];
+	bool			remove_spill = false;
+	uint32			generation;
+
+	LWLockAcquire(twitter_shared->lock, LW_EXCLUSIVE);
+	generation = flight->generation;
+	if (--flight->refcount == 0)
+	{
+		remove_spill = (flight->state == FLIGHT_DONE);
+		flight->state = FLIGHT_FREE;
+	}
+	LWLockRelease(twitter_shared->lock);
+
+	my_flight = -1;
+
+	if (remove_spill)
+	{
+		char		path[MAXPGPATH];
+
+		flight_spill_path(path, slot, generation);
+		unlink(path);
+	}
+}
+
+/*
+ * flight_shmem_exit
+ *   Don't leave followers waiting on a backend that is gone
+ */
+static void
+flight_shmem_exit(int code, Datum arg)
+{
+	if (my_flight < 0)
+		return;
+
+	if (my_flight_leader)
+		flight_land(my_flight, FLIGHT_FAILED);
+	else
+		flight_detach(my_flight);
+}
+
+/*
+ * Spill files live with the server's own temporary files, so that
+ * anything left behind by a crash is removed at restart.
+ */
+static void
+flight_spill_path(char *path, int slot, uint32 generation)
+{
+	snprintf(path, MAXPGPATH, "base/%s/%stwitter_fdw.%d.%u",
+			 PG_TEMP_FILES_DIR, PG_TEMP_FILE_PREFIX, slot, generation);
+}
+
+/* Tweet members in spill file order */
+static const size_t tweet_fields[] = {
+	offsetof(Tweet, id.text),
+	offsetof(Tweet, text),
+	offsetof(Tweet, from_user),
+	offsetof(Tweet, from_user_id.text),
+	offsetof(Tweet, to_user),
+	offsetof(Tweet, to_user_id.text),
+	offsetof(Tweet, iso_language_code),
+	offsetof(Tweet, source),
+	offsetof(Tweet, profile_image_url),
+	offsetof(Tweet, created_at)
+};
+
+#define TWEET_FIELD(tweet, i) \
+	(*(char **) ((char *) (tweet) + tweet_fields[i]))
+
+/*
+ * followed by the parsed ids, the values of json_path options and the jsonb
+ * of the tweet
+ */
+static const size_t tweet_ids[] = {
+	offsetof(Tweet, id),
+	offsetof(Tweet, from_user_id),
+	offsetof(Tweet, to_user_id)
+};
+
+#define TWEET_ID(tweet, i) \
+	((TweetId *) ((char *) (tweet) + tweet_ids[i]))
+
+/*
+ * Strings are spilled with a length prefix, -1 standing for NULL
+ */
+static void
+spill_string(FILE *file, const char *value)
+{
+	int32		len = value ? strlen(value) : -1;
+
+	fwrite(&len, sizeof(int32), 1, file);
+	if (len > 0)
+		fwrite(value, 1, len, file);
+}
+
+static bool
+load_string(FILE *file, char **value)
+{
+	int32		len;
+
+	*value = NULL;
+	if (fread(&len, sizeof(int32), 1, file) != 1)
+		return false;
+	if (len < 0)
+		return true;
+
+	*value = (char *) palloc(len + 1);
+	if (len > 0 && fread(*value, 1, len, file) != len)
+		return false;
+	(*value)[len] = '\0';
+
+	return true;
+}
+
+/*
+ * spill_results
+ *   Write parsed tweets for followers.  Returns false on any I/O failure.
+ */
+static bool
+spill_results(int slot, uint32 generation, ResultRoot *root)
+{
+	char		path[MAXPGPATH];
+	FILE	   *file;
+	int32		ntweets;
+	int32		rawlen;
+	int			i, j;
+	bool		ok;
+
+	snprintf(path, MAXPGPATH, "base/%s", PG_TEMP_FILES_DIR);
+	if (mkdir(path, S_IRWXU) < 0 && errno != EEXIST)
+		return false;
+
+	flight_spill_path(path, slot, generation);
+	file = AllocateFile(path, PG_BINARY_W);
+	if (file == NULL)
+	{
+		elog(DEBUG1, "could not create spill file \"%s\": %m", path);
+		return false;
+	}
+
+	spill_string(file, root->completed_in);
+	ntweets = root->results ? root->results->index : 0;
+	fwrite(&ntweets, sizeof(int32), 1, file);
+	for (i = 0; i < ntweets; i++)
+	{
+		Tweet	   *tweet = root->results->elements[i];
+
+		for (j = 0; j < lengthof(tweet_fields); j++)
+			spill_string(file, TWEET_FIELD(tweet, j));
+		for (j = 0; j < lengthof(tweet_ids); j++)
+		{
+			fwrite(&TWEET_ID(tweet, j)->valid, sizeof(bool), 1, file);
+			fwrite(&TWEET_ID(tweet, j)->value, sizeof(int64), 1, file);
+		}
+		fwrite(&tweet->npaths, sizeof(int32), 1, file);
+		for (j = 0; j < tweet->npaths; j++)
+			spill_string(file, tweet->paths[j]);
+		rawlen = tweet->raw ? VARSIZE(tweet->raw) : -1;
+		fwrite(&rawlen, sizeof(int32), 1, file);
+		if (rawlen > 0)
+			fwrite(tweet->raw, 1, rawlen, file);
+	}
+
+	ok = !ferror(file);
+	if (FreeFile(file) != 0)
+		ok = false;
+
+	return ok;
+}
+
+/*
+ * load_results
+ *   Read back what spill_results() wrote, or NULL if we cannot
+ */
+static ResultRoot *
+load_results(int slot, uint32 generation)
+{
+	char			path[MAXPGPATH];
+	FILE		   *file;
+	ResultRoot	   *root;
+	ResultArray	   *array;
+	int32			ntweets;
+	int32			rawlen;
+	int				i, j;
+
+	flight_spill_path(path, slot, generation);
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+		return NULL;
+
+	root = (ResultRoot *) palloc0(sizeof(ResultRoot));
+
+	if (!load_string(file, &root->completed_in) ||
+		fread(&ntweets, sizeof(int32), 1, file) != 1 ||
+		ntweets < 0 || ntweets > MaxAllocSize / sizeof(Tweet *))
+		goto bad_file;
+	array = results_create(ntweets);
+	root->results = array;
+
+	for (i = 0; i < ntweets; i++)
+	{
+		Tweet	   *tweet = (Tweet *) palloc0(sizeof(Tweet));
+
+		for (j = 0; j < lengthof(tweet_fields); j++)
+		{
+			if (!load_string(file, &TWEET_FIELD(tweet, j)))
+				goto bad_file;
+		}
+		for (j = 0; j < lengthof(tweet_ids); j++)
+		{
+			if (fread(&TWEET_ID(tweet, j)->valid, sizeof(bool), 1, file) != 1 ||
+				fread(&TWEET_ID(tweet, j)->value, sizeof(int64), 1, file) != 1)
+				goto bad_file;
+		}
+		if (fread(&tweet->npaths, sizeof(int32), 1, file) != 1 ||
+			tweet->npaths < 0 || tweet->npaths > MaxAllocSize / sizeof(char *))
+			goto bad_file;
+		if (tweet->npaths > 0)
+			tweet->paths = (char **) palloc(sizeof(char *) * tweet->npaths);
+		for (j = 0; j < tweet->npaths; j++)
+		{
+			if (!load_string(file, &tweet->paths[j]))
+				goto bad_file;
+		}
+		if (fread(&rawlen, sizeof(int32), 1, file) != 1 ||
+			(rawlen >= 0 && (rawlen < VARHDRSZ || rawlen > MaxAllocSize)))
+			goto bad_file;
+		if (rawlen >= 0)
+		{
+			tweet->raw = (struct varlena *) palloc(rawlen);
+			if (fread(tweet->raw, 1, rawlen, file) != rawlen)
+				goto bad_file;
+		}
+		results_append(array, tweet);
+	}
+
+	FreeFile(file);
+	return root;
+
+bad_file:
+	elog(DEBUG1, "could not read spill file \"%s\"", path);
+	FreeFile(file);
+	return NULL;
+}
+
+/*
+ * normalize_query
+ *   Derive the pg_stat_twitter_fdw query string from a request url: the
+ *   parameters only, case-folded except for percent escapes, since the
+ *   search API does not distinguish case
+ */
+static void
+normalize_query(char *dest, const char *url)
+{
+	const char *src = strchr(url, '?');
+	int			escape = 0;
+	int			i;
+
+	if (src == NULL)
+	{
+		dest[0] = '\0';
+		return;
+	}
+
+	src++;
+	for (i = 0; src[i] && i < TWITTER_STATS_QUERY_LEN - 1; i++)
+	{
+		if (src[i] == '%')
+			escape = 2;
+		else if (escape > 0)
+			escape--;
+		else if ('A' <= src[i] && src[i] <= 'Z')
+		{
+			dest[i] = src[i] + ('a' - 'A');
+			continue;
+		}
+		dest[i] = src[i];
+	}
+	dest[i] = '\0';
+}
+
+/*
+ * stats_accum
+ *   Add delta to the shared statistics entry for key, creating it if needed.
+ *   key must be zero padded, as the whole struct is hashed.
+ */
+static void
+stats_accum(TwitterStatsKey *key, TwitterCounters *delta)
+{
+	TwitterStatsEntry  *entry;
+	TwitterStatsKey		other;
+	bool				found;
+
+	if (!twitter_shared || !twitter_stats)
+		return;
+
+	LWLockAcquire(twitter_shared->stats_lock, LW_SHARED);
+	entry = (TwitterStatsEntry *) hash_search(twitter_stats, key,
+											  HASH_FIND, NULL);
+	if (!entry)
+	{
+		/* need exclusive lock to make a new entry */
+		LWLockRelease(twitter_shared->stats_lock);
+		LWLockAcquire(twitter_shared->stats_lock, LW_EXCLUSIVE);
+
+		if (hash_get_num_entries(twitter_stats) >= twitter_stats_max &&
+			!hash_search(twitter_stats, key, HASH_FIND, NULL))
+		{
+			memset(&other, 0, sizeof(other));
+			other.dbid = key->dbid;
+			other.serverid = key->serverid;
+			strcpy(other.query, TWITTER_STATS_OTHER);
+			key = &other;
+		}
+
+		entry = (TwitterStatsEntry *) hash_search(twitter_stats, key,
+												  HASH_ENTER_NULL, &found);
+		if (!entry)
+		{
+			/* out of shared memory; drop the sample */
+			LWLockRelease(twitter_shared->stats_lock);
+			return;
+		}
+		if (!found)
+		{
+			memset(&entry->counters, 0, sizeof(TwitterCounters));
+			SpinLockInit(&entry->mutex);
+		}
+	}
+
+	{
+		volatile TwitterStatsEntry *e = (volatile TwitterStatsEntry *) entry;
+
+		SpinLockAcquire(&e->mutex);
+		counters_add((TwitterCounters *) &e->counters, delta);
+		SpinLockRelease(&e->mutex);
+	}
+
+	LWLockRelease(twitter_shared->stats_lock);
+}
+
+static void
+counters_add(TwitterCounters *dest, TwitterCounters *src)
+{
+	int			i;
+
+	dest->requests += src->requests;
+	dest->failures += src->failures;
+	dest->http_4xx += src->http_4xx;
+	dest->http_5xx += src->http_5xx;
+	dest->transport_errors += src->transport_errors;
+	dest->throttled += src->throttled;
+	dest->bytes += src->bytes;
+	dest->rows += src->rows;
+	dest->cache_hits += src->cache_hits;
+	dest->cache_misses += src->cache_misses;
+	dest->total_time += src->total_time;
+	dest->max_time = Max(dest->max_time, src->max_time);
+	for (i = 0; i < TWITTER_LATENCY_BUCKETS; i++)
+		dest->latency[i] += src->latency[i];
+}
+
+/*
+ * Bucket 0 holds latencies under 1ms, bucket i those in [2^(i-1), 2^i) ms,
+ * and the last one everything longer.
+ */
+static int
+latency_bucket(double msec)
+{
+	int			bucket = 0;
 
-			handle_clauses[++clause_count] = PUSHDOWN;
-		}
-		else
-			handle_clauses[++clause_count] = FILTER_LOCALLY;
+	while (msec >= 1.0 && bucket < TWITTER_LATENCY_BUCKETS - 1)
+	{
+		msec /= 2.0;
+		bucket++;
 	}
 
-	result = lappend(result, url.data);
-	result = lappend(result, handle_clauses);
-	result = lappend(result, param_q);
-	Assert(list_length(result) == FDW_PRIVATE_LAST);
-
-	return result;
+	return bucket;
 }
 
-static List *
-remove_pushdown(List *scan_clauses, int *handle_clauses)
+/*
+ * latency_percentile
+ *   Estimate a latency percentile from the histogram, interpolating
+ *   linearly within the bucket it falls in
+ */
+static double
+latency_percentile(TwitterCounters *counters, double fraction)
 {
-	List	   *keep_clauses;
+	int64		total = 0;
+	int64		seen = 0;
+	double		rank;
+	int			i;
 
-	if (handle_clauses != NULL)
+	for (i = 0; i < TWITTER_LATENCY_BUCKETS; i++)
+		total += counters->latency[i];
+	rank = fraction * total;
+
+	for (i = 0; i < TWITTER_LATENCY_BUCKETS; i++)
 	{
-		int				i;
-		ListCell	   *l;
+		int64		count = counters->latency[i];
 
-		i = 0;
-		keep_clauses = NIL;
-		foreach(l, scan_clauses)
+		if (count > 0 && seen + count >= rank)
 		{
-			RestrictInfo	   *condition = lfirst(l);
-
-			if (handle_clauses[i] != PUSHDOWN)
-				keep_clauses = lappend(keep_clauses, condition);
+			double		lo = (i == 0) ? 0.0 : (double) (1 << (i - 1));
+			double		hi = (i == TWITTER_LATENCY_BUCKETS - 1) ?
+				counters->max_time : (double) (1 << i);
 
-			i++;
+			hi = Min(hi, counters->max_time);
+			lo = Min(lo, hi);
+			return lo + (hi - lo) * (rank - seen) / count;
 		}
+		seen += count;
 	}
-	else
-		keep_clauses = scan_clauses;
 
-	return keep_clauses;
+	return counters->max_time;
 }
 
-#ifdef OLD_FDW_API
+#define TWITTER_FDW_STATS_COLS	19
+
 /*
- * twitterPlan
- *   Create a FdwPlan, which is empty for now.
+ * twitter_fdw_stats
+ *   Return the statistics, per query or summed up per server
  */
-static FdwPlan *
-twitterPlan(Oid foreigntableid, PlannerInfo *root, RelOptInfo *baserel)
+PG_FUNCTION_INFO_V1(twitter_fdw_stats);
+Datum
+twitter_fdw_stats(PG_FUNCTION_ARGS)
 {
-	FdwPlan	   *fdwplan;
-	Relation	relation;
-	TupleDesc	tupdesc;
-	int		   *handle_clauses;
+	bool				per_server = PG_GETARG_BOOL(0);
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	HASH_SEQ_STATUS		hash_seq;
+	TwitterStatsEntry  *entry;
+	TwitterStatsEntry  *entries;
+	int					nentries;
+	int					i, j;
 
-	fdwplan = makeNode(FdwPlan);
-	relation = relation_open(foreigntableid, AccessShareLock);
-	tupdesc = relation->rd_att;
-	fdwplan->fdw_private = extract_twitter_conditions(baserel->baserestrictinfo, tupdesc);
-	relation_close(relation, AccessShareLock);
+	if (!twitter_shared || !twitter_stats)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("twitter_fdw must be loaded via shared_preload_libraries")));
 
-	handle_clauses = list_nth(fdwplan->fdw_private, FDW_PRIVATE_CLAUSES);
-	baserel->baserestrictinfo =
-		remove_pushdown(baserel->baserestrictinfo, handle_clauses);
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
 
-	return fdwplan;
-}
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 
-#else
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
 
-static void
-twitterGetRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
-{
-	/* API returns at most 15 results by default */
-	baserel->rows = 15;
-	baserel->fdw_private = NULL;
-}
+	/* take a snapshot so as not to hold the lock while building tuples */
+	LWLockAcquire(twitter_shared->stats_lock, LW_SHARED);
+	entries = (TwitterStatsEntry *)
+		palloc(Max(hash_get_num_entries(twitter_stats), 1) *
+			   sizeof(TwitterStatsEntry));
+	nentries = 0;
+	hash_seq_init(&hash_seq, twitter_stats);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		volatile TwitterStatsEntry *e = (volatile TwitterStatsEntry *) entry;
+		TwitterStatsEntry *copy;
 
-static void
-twitterGetPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
-{
-	Relation	relation;
-	TupleDesc	tupdesc;
+		/* fold per-query entries into the first one seen for the server */
+		copy = NULL;
+		if (per_server)
+		{
+			for (j = 0; j < nentries; j++)
+			{
+				if (entries[j].key.dbid == entry->key.dbid &&
+					entries[j].key.serverid == entry->key.serverid)
+				{
+					copy = &entries[j];
+					break;
+				}
+			}
+		}
+		if (copy == NULL)
+		{
+			copy = &entries[nentries++];
+			copy->key = entry->key;
+			memset(&copy->counters, 0, sizeof(TwitterCounters));
+		}
 
-	relation = relation_open(foreigntableid, AccessShareLock);
-	tupdesc = relation->rd_att;
-	baserel->fdw_private = extract_twitter_conditions(baserel->baserestrictinfo, tupdesc);
-	relation_close(relation, AccessShareLock);
+		SpinLockAcquire(&e->mutex);
+		counters_add(&copy->counters, (TwitterCounters *) &e->counters);
+		SpinLockRelease(&e->mutex);
+	}
+	LWLockRelease(twitter_shared->stats_lock);
 
-	/* Create a ForeignPath node and add it as only possible path */
-	add_path(baserel,
-		(Path *)create_foreignscan_path(root, baserel, baserel->rows,
-				10, 1000, NIL, NULL, NIL));
-}
+	for (i = 0; i < nentries; i++)
+	{
+		TwitterCounters *c = &entries[i].counters;
+		Datum		values[TWITTER_FDW_STATS_COLS];
+		bool		nulls[TWITTER_FDW_STATS_COLS];
 
-static ForeignScan *
-twitterGetPlan(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid,
-			   ForeignPath *bast_path, List *tlist, List *scan_clauses)
-{
-	List	   *keep_clauses;
-	int		   *handle_clauses;
+		memset(nulls, 0, sizeof(nulls));
+		j = 0;
+		values[j++] = ObjectIdGetDatum(entries[i].key.dbid);
+		values[j++] = ObjectIdGetDatum(entries[i].key.serverid);
+		if (per_server)
+			nulls[j++] = true;
+		else
+			values[j++] = CStringGetTextDatum(entries[i].key.query);
+		values[j++] = Int64GetDatum(c->requests);
+		values[j++] = Int64GetDatum(c->failures);
+		values[j++] = Int64GetDatum(c->http_4xx);
+		values[j++] = Int64GetDatum(c->http_5xx);
+		values[j++] = Int64GetDatum(c->transport_errors);
+		values[j++] = Int64GetDatum(c->throttled);
+		values[j++] = Int64GetDatum(c->bytes);
+		values[j++] = Int64GetDatum(c->rows);
+		values[j++] = Int64GetDatum(c->cache_hits);
+		values[j++] = Int64GetDatum(c->cache_misses);
+		values[j++] = Float8GetDatum(c->total_time);
+		if (c->requests > 0)
+		{
+			values[j++] = Float8GetDatum(c->total_time / c->requests);
+			values[j++] = Float8GetDatum(latency_percentile(c, 0.50));
+			values[j++] = Float8GetDatum(latency_percentile(c, 0.95));
+			values[j++] = Float8GetDatum(latency_percentile(c, 0.99));
+			values[j++] = Float8GetDatum(c->max_time);
+		}
+		else
+		{
+			/* no latency without a request */
+			while (j < TWITTER_FDW_STATS_COLS)
+				nulls[j++] = true;
+		}
+		Assert(j == TWITTER_FDW_STATS_COLS);
 
-	handle_clauses = list_nth(baserel->fdw_private, FDW_PRIVATE_CLAUSES);
-	keep_clauses = remove_pushdown(scan_clauses, handle_clauses);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
 
-	/* remove the RestrictInfo node from all remaining clauses */
-	keep_clauses = extract_actual_clauses(keep_clauses, false);
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
 
-	return make_foreignscan(tlist, keep_clauses, baserel->relid, NIL, baserel->fdw_private);
+	return (Datum) 0;
 }
 
-static bool
-twitterAnalyze(Relation relation, AcquireSampleRowsFunc *func, BlockNumber *totalpages)
+/*
+ * twitter_fdw_stats_reset
+ *   Discard all statistics
+ */
+PG_FUNCTION_INFO_V1(twitter_fdw_stats_reset);
+Datum
+twitter_fdw_stats_reset(PG_FUNCTION_ARGS)
 {
-	*totalpages = 42;
-	return true;
+	HASH_SEQ_STATUS		hash_seq;
+	TwitterStatsEntry  *entry;
+
+	if (!twitter_shared || !twitter_stats)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("twitter_fdw must be loaded via shared_preload_libraries")));
+
+	LWLockAcquire(twitter_shared->stats_lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, twitter_stats);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(twitter_stats, &entry->key, HASH_REMOVE, NULL);
+	LWLockRelease(twitter_shared->stats_lock);
+
+	PG_RETURN_VOID();
 }
 
-#endif   /* OLD_FDW_API */
+/*
+ * State of twitter_fdw_export() between calls.  Only the response being
+ * gone through and the tweet being returned are kept in memory.
+ */
+typedef struct TwitterExport
+{
+	TwitterParser  *parser;
+	TwitterScanStats stats;
+	ResultRoot	   *root;
+	json_printer	printer;
+	StringInfoData	buf;			/* text of the row being returned */
+	bool			ndjson;			/* one object per row, no array */
+	bool			finished;
+} TwitterExport;
 
 /*
- * twitterExplain
- *   Produce extra output for EXPLAIN
+ * export_done
+ *   The export ran to completion.  Its state goes with the memory of the
+ *   function call, so export_shutdown() must not be called on it later.
  */
 static void
-twitterExplain(ForeignScanState *node, ExplainState *es)
+export_done(FunctionCallInfo fcinfo, TwitterExport *export)
 {
-#ifdef OLD_FDW_API
-	List		   *fdw_private =
-		((FdwPlan *) ((ForeignScan *) node->ss.ps.plan)->fdwplan)->fdw_private;
-#else
-	List		   *fdw_private =
-		((ForeignScan *)node->ss.ps.plan)->fdw_private;
-#endif
-	char		   *url;
-	char			buf[256];
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 
-	url = list_nth(fdw_private, FDW_PRIVATE_URL);
-	snprintf(buf, 256, "Search: %s", url);
-	ExplainPropertyText("Twitter API", buf, es);
+	UnregisterExprContextCallback(rsinfo->econtext, export_shutdown,
+								  PointerGetDatum(export));
 }
 
 /*
- * twitterBegin
- *   Query search API and setup result
+ * twitter_fdw_export
+ *   Return the tweets found for q through a foreign table as JSON text, one
+ *   row per tweet.  The table only gives the endpoint and limits of its
+ *   server; see export_tweet() for what is printed.  Rows of the array
+ *   format are pieces of one JSON array, valid only once all of them are
+ *   concatenated; those of ndjson are objects of their own.
  */
-static void
-twitterBegin(ForeignScanState *node, int eflags)
+PG_FUNCTION_INFO_V1(twitter_fdw_export);
+Datum
+twitter_fdw_export(PG_FUNCTION_ARGS)
 {
-#ifdef OLD_FDW_API
-	List		   *fdw_private =
-		((FdwPlan *) ((ForeignScan *) node->ss.ps.plan)->fdwplan)->fdw_private;
+	FuncCallContext	   *funcctx;
+	TwitterExport	   *export;
+	Tweet			   *tweet;
+	text			   *result;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		Oid				foreigntableid = PG_GETARG_OID(0);
+		char		   *q = text_to_cstring(PG_GETARG_TEXT_PP(1));
+		char		   *format = text_to_cstring(PG_GETARG_TEXT_PP(2));
+		ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+		MemoryContext	oldcontext;
+		AclResult		aclresult;
+		TwitterLimits	limits;
+		StringInfoData	url;
+		char		   *endpoint;
+
+		if (get_rel_relkind(foreigntableid) != RELKIND_FOREIGN_TABLE)
+			ereport(ERROR,
+					(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+					 errmsg("\"%s\" is not a foreign table",
+							get_rel_name(foreigntableid))));
+		aclresult = pg_class_aclcheck(foreigntableid, GetUserId(), ACL_SELECT);
+		if (aclresult != ACLCHECK_OK)
+#if PG_VERSION_NUM >= 110000
+			aclcheck_error(aclresult, OBJECT_FOREIGN_TABLE,
+						   get_rel_name(foreigntableid));
 #else
-	List		   *fdw_private =
-		((ForeignScan *)node->ss.ps.plan)->fdw_private;
+			aclcheck_error(aclresult, ACL_KIND_CLASS,
+						   get_rel_name(foreigntableid));
 #endif
-	CURL		   *curl;
-	int				ret;
-	json_parser		parser;
-	json_parser_dom helper;
-	ResultRoot	   *root;
-	Relation		rel;
-	AttInMetadata  *attinmeta;
-	TwitterReply   *reply;
-	char		   *url;
-	char		   *param_q = NULL;
 
-	/*
-	 * Do nothing in EXPLAIN
-	 */
-	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
-		return;
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
-	Assert(list_length(fdw_private) == FDW_PRIVATE_LAST);
-	url = list_nth(fdw_private, FDW_PRIVATE_URL);
-	param_q = list_nth(fdw_private, FDW_PRIVATE_PARAM_Q);
+		export = (TwitterExport *) palloc0(sizeof(TwitterExport));
+		if (strcmp(format, "array") == 0)
+			export->ndjson = false;
+		else if (strcmp(format, "ndjson") == 0)
+			export->ndjson = true;
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid export format \"%s\"", format),
+					 errhint("Valid formats are \"array\" and \"ndjson\".")));
 
-	json_parser_dom_init(&helper, create_structure, create_data, append);
-	json_parser_init(&parser, NULL, json_parser_dom_callback, &helper);
+		/* the URL the scan of WHERE q = ... would request */
+		endpoint = twitter_endpoint(foreigntableid, false);
+		initStringInfo(&url);
+		appendStringInfo(&url, "%s%cq=%s", endpoint,
+						 (strchr(endpoint, '?') == NULL) ? '?' : '&',
+						 percent_encode((unsigned char *) q, -1));
 
-	elog(DEBUG1, "requesting %s", url);
-	curl = curl_easy_init();
-	curl_easy_setopt(curl, CURLOPT_URL, url);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &parser);
-	ret = curl_easy_perform(curl);
-	curl_easy_cleanup(curl);
+		export->stats.key.dbid = MyDatabaseId;
+		export->stats.key.serverid = GetForeignTable(foreigntableid)->serverid;
+		normalize_query(export->stats.key.query, url.data);
+		twitter_limits(export->stats.key.serverid, &limits);
+		export->parser = parser_create(&limits, NIL, false);
+		export->root = fetch_results(url.data, &export->stats, export->parser);
 
-	rel = node->ss.ss_currentRelation;
-	attinmeta = TupleDescGetAttInMetadata(rel->rd_att);
+		initStringInfo(&export->buf);
+		json_print_init(&export->printer, export_write, &export->buf);
 
-	root = (ResultRoot *) helper.root_structure;
+		/* count the tweets returned, even if we are not run to completion */
+		RegisterExprContextCallback(rsinfo->econtext, export_shutdown,
+									PointerGetDatum(export));
+		funcctx->user_fctx = export;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	export = (TwitterExport *) funcctx->user_fctx;
+	if (export->finished)
+	{
+		export_done(fcinfo, export);
+		SRF_RETURN_DONE(funcctx);
+	}
 
-	/* status != 200, or other similar error */
-	if (!root)
-		elog(INFO, "Failed fetching response from %s", url);
+	tweet = NULL;
+	if (export->root)
+		tweet = parse_tweet(export->parser, &export->stats);
 
-#ifdef NOT_USE
-	if (root->results)
+	resetStringInfo(&export->buf);
+	if (tweet != NULL)
 	{
-		int i;
-		for(i = 0; i < root->results->index; i++)
+		/* a printer of its own for every object, or one for the array */
+		if (export->ndjson)
+			json_print_init(&export->printer, export_write, &export->buf);
+		else if (funcctx->call_cntr == 0)
+			json_print_raw(&export->printer, JSON_ARRAY_BEGIN, NULL, 0);
+		export_tweet(&export->printer, tweet);
+	}
+	else
+	{
+		export->finished = true;
+		parse_finish(export->parser, &export->stats);
+		if (export->ndjson)
 		{
-			Tweet *tweet = root->results->elements[i];
-			printf("%02d[%s]: %s\n", (i + 1), tweet->from_user, tweet->text);
+			export_done(fcinfo, export);
+			SRF_RETURN_DONE(funcctx);
 		}
+		if (funcctx->call_cntr == 0)
+			json_print_raw(&export->printer, JSON_ARRAY_BEGIN, NULL, 0);
+		json_print_raw(&export->printer, JSON_ARRAY_END, NULL, 0);
 	}
-#endif
+	json_print_flush(&export->printer);
 
-	reply = (TwitterReply *) palloc(sizeof(TwitterReply));
-	reply->root = root;
-	reply->attinmeta = attinmeta;
-	reply->rownum = 0;
-	reply->q = param_q;
-	node->fdw_state = (void *) reply;
+	result = cstring_to_text_with_len(export->buf.data, export->buf.len);
+	SRF_RETURN_NEXT(funcctx, PointerGetDatum(result));
+}
 
-	json_parser_free(&parser);
+static int
+export_write(void *userdata, const char *s, uint32_t length)
+{
+	appendBinaryStringInfo((StringInfo) userdata, s, length);
+	return 0;
 }
 
 /*
- * twitterIterate
- *   Return a twitter per call
+ * export_tweet
+ *   Print a tweet as an object with the search fields a Tweet keeps, in
+ *   the order of the columns of the default twitter table.  The columns of
+ *   the table exported through, their json_path options and a raw column
+ *   make no difference.
  */
-static TupleTableSlot *
-twitterIterate(ForeignScanState *node)
+static void
+export_tweet(json_printer *printer, Tweet *tweet)
 {
-	TupleTableSlot	   *slot = node->ss.ss_ScanTupleSlot;
-	TwitterReply	   *reply = (TwitterReply *) node->fdw_state;
-	ResultRoot		   *root = reply->root;
-	Tweet			   *tweet;
-	HeapTuple			tuple;
-	Relation			rel = node->ss.ss_currentRelation;
-	int					i, natts;
-	char			  **values;
-	MemoryContext		oldcontext;
+	char		buf[32];
+	int			i;
 
-	if (!root || !(root->results && reply->rownum < root->results->index))
-	{
-		ExecClearTuple(slot);
-		return slot;
-	}
-	tweet = root->results->elements[reply->rownum];
-	natts = rel->rd_att->natts;
-	values = (char **) palloc(sizeof(char *) * natts);
-	for (i = 0; i < natts; i++)
+	json_print_raw(printer, JSON_OBJECT_BEGIN, NULL, 0);
+	for (i = KEY_ID; i <= KEY_CREATED_AT; i++)
 	{
-		Name	attname = &rel->rd_att->attrs[i]->attname;
-
-		if (namestrcmp(attname, "id") == 0 && tweet->id)
-			values[i] = tweet->id;
-		else if (namestrcmp(attname, "text") == 0 && tweet->text)
-			values[i] = tweet->text;
-		else if (namestrcmp(attname, "from_user") == 0 && tweet->from_user)
-			values[i] = tweet->from_user;
-		else if (namestrcmp(attname, "from_user_id") == 0 && tweet->from_user_id)
-			values[i] = tweet->from_user_id;
-		else if (namestrcmp(attname, "to_user") == 0 && tweet->to_user)
-			values[i] = tweet->to_user;
-		else if (namestrcmp(attname, "to_user_id") == 0 && tweet->to_user_id)
-			values[i] = tweet->to_user_id;
-		else if (namestrcmp(attname, "iso_language_code") == 0 && tweet->iso_language_code)
-			values[i] = tweet->iso_language_code;
-		else if (namestrcmp(attname, "source") == 0 && tweet->source)
-			values[i] = tweet->source;
-		else if (namestrcmp(attname, "profile_image_url") == 0 && tweet->profile_image_url)
-			values[i] = tweet->profile_image_url;
-		else if (namestrcmp(attname, "created_at") == 0 && tweet->created_at)
-			values[i] = tweet->created_at;
-		else if (namestrcmp(attname, "q") == 0)
-			values[i] = reply->q;
+		TweetId	   *id = NULL;
+		char	   *value = NULL;
+
+		switch (i)
+		{
+			case KEY_ID: id = &tweet->id; break;
+			case KEY_TEXT: value = tweet->text; break;
+			case KEY_FROM_USER: value = tweet->from_user; break;
+			case KEY_FROM_USER_ID: id = &tweet->from_user_id; break;
+			case KEY_TO_USER: value = tweet->to_user; break;
+			case KEY_TO_USER_ID: id = &tweet->to_user_id; break;
+			case KEY_ISO_LANGUAGE_CODE: value = tweet->iso_language_code; break;
+			case KEY_SOURCE: value = tweet->source; break;
+			case KEY_PROFILE_IMAGE_URL: value = tweet->profile_image_url; break;
+			case KEY_CREATED_AT: value = tweet->created_at; break;
+		}
+
+		json_print_raw(printer, JSON_KEY, known_keys[i], strlen(known_keys[i]));
+		if (id && id->valid)
+		{
+			snprintf(buf, sizeof(buf), INT64_FORMAT, id->value);
+			json_print_raw(printer, JSON_INT, buf, strlen(buf));
+			continue;
+		}
+
+		/* ids that are not an int8 are given as they came, in a string */
+		if (id)
+			value = id->text;
+		if (value)
+			json_print_raw(printer, JSON_STRING, value, strlen(value));
 		else
-			values[i] = NULL;
+			json_print_raw(printer, JSON_NULL, NULL, 0);
 	}
-	oldcontext = MemoryContextSwitchTo(node->ss.ps.ps_ExprContext->ecxt_per_query_memory);
-	tuple = BuildTupleFromCStrings(reply->attinmeta, values);
-	MemoryContextSwitchTo(oldcontext);
-	ExecStoreTuple(tuple, slot, InvalidBuffer, true);
-	reply->rownum++;
-
-	return slot;
+	json_print_raw(printer, JSON_OBJECT_END, NULL, 0);
 }
 
 /*
- * twitterReScan
+ * export_shutdown
+ *   Count the tweets of an export that was not run to completion
  */
 static void
-twitterReScan(ForeignScanState *node)
+export_shutdown(Datum arg)
 {
-	TwitterReply	   *reply = (TwitterReply *) node->fdw_state;
-
-	reply->rownum = 0;
-}
+	TwitterExport  *export = (TwitterExport *) DatumGetPointer(arg);
 
-static void
-twitterEnd(ForeignScanState *node)
-{
-	/* intentionally left blank */
+	parse_finish(export->parser, &export->stats);
 }
 
 static size_t
 write_data(void *buffer, size_t size, size_t nmemb, void *userp)
 {
 	int			segsize = size * nmemb;
-	json_parser *parser = (json_parser *) userp;
-	int			ret;
+	TwitterFetch *fetch = (TwitterFetch *) userp;
 
-	ret = json_parser_string(parser, buffer, segsize, NULL);
-	if (ret){
-		elog(ERROR, "json_parser failed");
+	fetch->stats->bytes += segsize;
+
+	/*
+	 * Don't elog() here, that would longjmp through libcurl.  Returning
+	 * short makes curl abort the transfer, and fetch_finish() reports.
+	 */
+	if ((Size) segsize > fetch->max_size - fetch->received)
+	{
+		fetch->too_large = true;
+		return 0;
 	}
+	fetch->received += segsize;
+
+	/* parsed later, as rows are asked for */
+	appendBinaryStringInfo(fetch->body, buffer, segsize);
 
 	return segsize;
 }
 
 /*
- * since create_structure() raise error on returning NULL,
- * dummy pointer will be returned if the result can be discarded.
+ * lookup_key
+ *   Return the KEY_* of a key of the response, or -1 if we don't need it
  */
-static void *dummy_p = (void *) "dummy";
-
-static void *
-create_structure(int nesting, int is_object)
+static int
+lookup_key(const char *key, uint32 length)
 {
-	if (is_object)
-	{
-		if (nesting == 0)
-		{
-			ResultRoot	   *root;
-
-			root = (ResultRoot *) palloc0(sizeof(ResultRoot));
-			return (void *) root;
-		}
-		else if (nesting == 2)
-		{
-			Tweet	   *tweet;
+	int			i;
 
-			tweet = (Tweet *) palloc0(sizeof(Tweet));
-			return (void *) tweet;
-		}
-		return dummy_p;
-	}
-	else
+	for (i = 0; i < lengthof(known_keys); i++)
 	{
-		if (nesting == 1)
-		{
-			ResultArray	   *array;
-
-			array = (ResultArray *) palloc(sizeof(ResultArray));
-			array->index = 0;
-			return array;
-		}
+		if (strlen(known_keys[i]) == length &&
+			memcmp(known_keys[i], key, length) == 0)
+			return i;
 	}
-
-	return dummy_p;
+	return -1;
 }
 
-static void *
-create_data(int type, const char *data, uint32_t length)
-{
-	switch(type)
-	{
-	case JSON_STRING:
-	case JSON_INT:
-	case JSON_FLOAT:
-		return (void *) data;
-
-	case JSON_NULL:
-	case JSON_TRUE:
-	case JSON_FALSE:
-		break;
-	}
-
-	return NULL;
-}
+/*
+ * The parser runs in zero copy mode, so event data points into the
+ * response and is not nul terminated; tweets keep a copy.
+ */
+#define TWEETCOPY(tweet, key, event) \
+do{ \
+	if ((event)->length > 0) \
+		(tweet)->key = pnstrdup((event)->data, (event)->length); \
+} while(0)
 
-#define TWEETCOPY(structure, key, obj) \
+#define TWEETID(tweet, key, event) \
 do{ \
-	Tweet  *tweet = (Tweet *) (structure); \
-	int		len = strlen((char *) (obj)); \
-	if (len > 0) \
+	if ((event)->number && (event)->type == JSON_INT) \
 	{ \
-		tweet->key = (char *) palloc(sizeof(char) * (len + 1)); \
-		strcpy(tweet->key, (obj)); \
+		(tweet)->key.valid = true; \
+		(tweet)->key.value = (event)->number->int_value; \
 	} \
+	else if ((event)->length > 0) \
+		(tweet)->key.text = pnstrdup((event)->data, (event)->length); \
 } while(0)
 
-static int
-append(void *structure, char *key, uint32_t key_length, void *obj)
-{
-	if (key != NULL)
-	{
-		/* discard any unnecessary data */
-		if (structure == dummy_p)
-			return 0;
-		if (strcmp(key, "results") == 0)
-		{
-			/* root.results = array; */
-			((ResultRoot *) structure)->results = (ResultArray *) obj;
-		}
-		else if (strcmp(key, "id") == 0 && obj)
-			TWEETCOPY(structure, id, obj);
-		else if (strcmp(key, "text") == 0 && obj)
-			TWEETCOPY(structure, text, obj);
-		else if(strcmp(key, "from_user") == 0 && obj)
-			TWEETCOPY(structure, from_user, obj);
-		else if(strcmp(key, "from_user_id") == 0 && obj)
-			TWEETCOPY(structure, from_user_id, obj);
-		else if(strcmp(key, "to_user") == 0 && obj)
-			TWEETCOPY(structure, to_user, obj);
-		else if(strcmp(key, "to_user_id") == 0 && obj)
-			TWEETCOPY(structure, to_user_id, obj);
-		else if(strcmp(key, "iso_language_code") == 0)
-			TWEETCOPY(structure, iso_language_code, obj);
-		else if(strcmp(key, "source") == 0 && obj)
-			TWEETCOPY(structure, source, obj);
-		else if(strcmp(key, "profile_image_url") == 0 && obj)
-			TWEETCOPY(structure, profile_image_url, obj);
-		else if(strcmp(key, "created_at") == 0 && obj)
-			TWEETCOPY(structure, created_at, obj);
-	}
-	else
+/*
+ * tweet_set
+ *   Keep the string or number value of a known key of tweet
+ */
+static void
+tweet_set(Tweet *tweet, int key, json_event *event)
+{
+	switch (key)
 	{
-		/*
-		 * array.push(tweet);
-		 * an array that is not dummy_p must be root.results
-		 */
-		ResultArray *array = (ResultArray *) structure;
-
-		if (array != dummy_p)
-			array->elements[array->index++] = (Tweet *) obj;
+	case KEY_ID:
+		TWEETID(tweet, id, event);
+		break;
+	case KEY_TEXT:
+		TWEETCOPY(tweet, text, event);
+		break;
+	case KEY_FROM_USER:
+		TWEETCOPY(tweet, from_user, event);
+		break;
+	case KEY_FROM_USER_ID:
+		TWEETID(tweet, from_user_id, event);
+		break;
+	case KEY_TO_USER:
+		TWEETCOPY(tweet, to_user, event);
+		break;
+	case KEY_TO_USER_ID:
+		TWEETID(tweet, to_user_id, event);
+		break;
+	case KEY_ISO_LANGUAGE_CODE:
+		TWEETCOPY(tweet, iso_language_code, event);
+		break;
+	case KEY_SOURCE:
+		TWEETCOPY(tweet, source, event);
+		break;
+	case KEY_PROFILE_IMAGE_URL:
+		TWEETCOPY(tweet, profile_image_url, event);
+		break;
+	case KEY_CREATED_AT:
+		TWEETCOPY(tweet, created_at, event);
+		break;
 	}
-	return 0;
 }